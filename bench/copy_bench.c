@@ -0,0 +1,73 @@
+/*
+ * Map to map copies with vfi_copy_map() against a plain memcpy() at
+ * sizes either side of the last level cache. Each size copies about
+ * the same number of bytes in total; both buffers are touched first
+ * so page faults are not timed.
+ */
+#include <vfi_api.h>
+#include <vfi_frmwrk.h>
+#include <stdio.h>
+#include <time.h>
+
+#define TOTAL (4LL << 30)	/* bytes copied at each size */
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static struct vfi_map *bench_map(long extent)
+{
+	struct vfi_map *map = calloc(1, sizeof(*map));
+
+	if (map == NULL || (map->mem = malloc(extent)) == NULL)
+		return NULL;
+	memset(map->mem, 0x5a, extent);
+	map->extent = extent;
+	return map;
+}
+
+int main(int argc, char **argv)
+{
+	static char *strategies[] = { "memcpy", "stream", "parallel" };
+	static long sizes[] = { 64 << 10, 1 << 20, 16 << 20, 64 << 20, 256 << 20 };
+	struct vfi_map *src, *dst;
+	double start, t_memcpy, t_copy;
+	long size, reps, n;
+	int i;
+
+	printf("%10s %-9s %12s %12s\n", "bytes", "strategy", "memcpy GB/s", "copy GB/s");
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		size = sizes[i];
+		reps = TOTAL / size < 4 ? 4 : TOTAL / size;
+		src = bench_map(size);
+		dst = bench_map(size);
+		if (src == NULL || dst == NULL) {
+			printf("%10ld cannot allocate\n", size);
+			return 1;
+		}
+
+		start = now();
+		for (n = 0; n < reps; n++)
+			memcpy(dst->mem, src->mem, size);
+		t_memcpy = now() - start;
+
+		start = now();
+		for (n = 0; n < reps; n++)
+			if (vfi_copy_map(dst, 0, src, 0, size, 0)) {
+				printf("%10ld copy failed\n", size);
+				return 1;
+			}
+		t_copy = now() - start;
+
+		printf("%10ld %-9s %12.2f %12.2f\n", size, strategies[vfi_copy_strategy(size, 0)],
+		       size * reps / t_memcpy, size * reps / t_copy);
+		free(src->mem);
+		free(dst->mem);
+		free(src);
+		free(dst);
+	}
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Round trips of event_chain and event_start through the stand in
+ * driver, in text and in binary framing. The stand in shares the
+ * same transcoder so the difference is in the framing, not the
+ * driver.
+ */
+#include "standin.h"
+
+#define ITERATIONS 200000
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int round_trip(struct vfi_dev *dev, struct vfi_cmd_buf *cb,
+		      struct vfi_async_handle *ah)
+{
+	char *result = NULL;
+	void *e;
+	long val = -1;
+
+	if (vfi_invoke_cmd_buf(dev, cb) <= 0 || vfi_post_async_handle(dev))
+		return -1;
+	vfi_wait_async_handle(ah, &result, &e);
+	vfi_get_dec_arg(result, "result", &val);
+	free(result);
+	return val;
+}
+
+int main(int argc, char **argv)
+{
+	static char *modes[] = { "text", "binary" };
+	struct vfi_async_handle *ah;
+	struct vfi_cmd_buf cb;
+	struct vfi_dev *dev;
+	int mode, n;
+	double start;
+
+	for (mode = 0; mode < 2; mode++) {
+		if (standin_open(&dev, 1000, mode ? VFI_OPEN_BINARY : 0)) {
+			printf("%-6s cannot open stand in\n", modes[mode]);
+			return 1;
+		}
+		if (vfi_dev_binary(dev) != mode) {
+			printf("%-6s framing not agreed\n", modes[mode]);
+			return 1;
+		}
+		ah = vfi_alloc_async_handle(NULL);
+		vfi_cmd_init(&cb);
+
+		start = now();
+		for (n = 0; n < ITERATIONS; n++) {
+			vfi_build_event_chain(&cb, "evt1.loc.f", ah, "evt2", 4);
+			if (round_trip(dev, &cb, ah)) {
+				printf("%-6s bad reply\n", modes[mode]);
+				return 1;
+			}
+			vfi_build_event_start(&cb, "evt1.loc.f");
+			if (vfi_cmd_request(&cb, ah) || round_trip(dev, &cb, ah)) {
+				printf("%-6s bad reply\n", modes[mode]);
+				return 1;
+			}
+		}
+		printf("%-6s %8.1f ns/round trip\n", modes[mode],
+		       (now() - start) / (2 * ITERATIONS));
+		vfi_cmd_release(&cb);
+
+		vfi_free_async_handle(ah);
+		vfi_close(dev);
+	}
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Microbenchmarks of the string parsing layer on RIL commands of the
+ * kind found in doc/ril.txt and the framework scripts. Prints one
+ * JSON object with ns/op and allocations/op per function so results
+ * can be kept and compared between builds.
+ *
+ * Allocations are counted by interposing malloc, calloc and realloc
+ * in this executable, which the shared library binds to ahead of
+ * libc.
+ */
+#include <vfi_api.h>
+
+#define ITERATIONS 200000
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static volatile long allocs;
+
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	allocs++;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+	allocs++;
+	return __libc_realloc(p, size);
+}
+
+static char *descs[] = {
+	"smb.loc.f#0:100000?map_name(frame)",
+	"evt1.loc.f",
+	"x.xl.f",
+	"frame#80:1000",
+	"bind.fabric.location.f#3a000:200000?event_name(dn),map_name(dst)",
+};
+
+static char *ternaries[] = {
+	"bind_create://x.xl.f/d.dl.f?event_name(dn)=s.sl.f?event_name(sn)",
+	"bind_create://xfer.loc.f#0:1000/dst.loc.f#0:1000=src.loc.f#0:1000",
+	"map_copy://copy/out#0:10000=in#0:10000",
+};
+
+static char *replies[] = {
+	"smb_create://smb.loc.f#0:100000?map_name(frame),map_address(7f3a2c000000),map_extent(100000),mytid(4242),reply(7f3a2c0012a0),result(0)",
+	"event_start://evt1.loc.f?reply(0x7f3a2c0012a0),result(0)",
+	"mmap_create://smb.loc.f#0:100000?map_name(frame),mmap_offset(3a000),reply(7f3a2c0012a0),result(0)",
+	"event_chain://evt1.loc.f?event_name(evt2),reply(7f3a2c0012a0),result(0)",
+};
+
+static char *cmds[] = {
+	"bind_create://x.xl.f/d.dl.f?event_name(dn)=s.sl.f?event_name(sn)",
+	"map_check://frame#0:10000",
+	"event_start://evt1.loc.f",
+	"location_find://loc.f",
+};
+
+static char *pre_cmds[] = {
+	"bind_create", "mmap_create", "smb_create", "map_install",
+	"event_find", "location_find", "sync_wait", "pipe", "unix_pipe",
+	"quit", "map_init", "map_check",
+};
+
+#define N(a) (sizeof(a)/sizeof(a[0]))
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int nop_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
+{
+	return 1;
+}
+
+static int first = 1;
+
+static void report(char *name, double start, long a0, long ops)
+{
+	double ns = now() - start;
+	long a = allocs - a0;
+
+	printf("%s\n    {\"name\": \"%s\", \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, \"ops\": %ld}",
+	       first ? "" : ",", name, ns / ops, (double)a / ops, ops);
+	first = 0;
+}
+
+#define BENCH(name, strs, body)						\
+	do {								\
+		long a0 = allocs;					\
+		double start = now();					\
+		int n, i;						\
+		for (n = 0; n < ITERATIONS; n++)			\
+			for (i = 0; i < N(strs); i++) {			\
+				char *s = strs[i];			\
+				body;					\
+			}						\
+		report(name, start, a0, (long)ITERATIONS * N(strs));	\
+	} while (0)
+
+int main(int argc, char **argv)
+{
+	struct vfi_cmd_elem *list = NULL;
+	char *a, *b, *c, *d;
+	int off, ext;
+	long val;
+	int i;
+
+	for (i = 0; i < N(pre_cmds); i++)
+		vfi_register_cmd(&list, pre_cmds[i], nop_cmd);
+
+	printf("{\n  \"iterations\": %d,\n  \"benchmarks\": [", ITERATIONS);
+
+	BENCH("vfi_parse_desc", descs, {
+		vfi_parse_desc(s, &a, &b, &off, &ext, &c);
+		free(a); free(b); free(c);
+	});
+
+	BENCH("vfi_parse_ternary_op", ternaries, {
+		vfi_parse_ternary_op(s, &a, &b, &c, &d);
+		free(a); free(b); free(c); free(d);
+	});
+
+	BENCH("vfi_get_str_arg", replies, {
+		if (vfi_get_str_arg(s, "map_name", &a) > 0)
+			free(a);
+	});
+
+	BENCH("vfi_get_hex_arg", replies, {
+		vfi_get_hex_arg(s, "reply", &val);
+	});
+
+	BENCH("vfi_get_name_location", cmds, {
+		a = b = NULL;
+		vfi_get_name_location(s, &a, &b);
+		free(a); free(b);
+	});
+
+	BENCH("vfi_find_cmd", cmds, {
+		vfi_find_cmd(NULL, NULL, list, &s);
+	});
+
+	printf("\n  ]\n}\n");
+	return 0;
+}
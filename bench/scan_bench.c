@@ -0,0 +1,67 @@
+/*
+ * Microbenchmark of the RIL delimiter scanners. Each implementation
+ * the CPU supports is checked against the scalar scanner and then
+ * timed over a set of typical commands and replies.
+ */
+#include <vfi_api.h>
+
+#define ITERATIONS 1000000
+
+static char *ril[] = {
+	"bind_create://x.xl.f/d.dl.f?event_name(dn)=s.sl.f?event_name(sn)",
+	"smb_create://smb.loc.f#0:100000?map_name(frame),map_address(7f3a2c000000),map_extent(100000),mytid(4242)",
+	"event_chain://evt1.loc.f?request(0x7f3a2c0012a0),event_name(evt2)",
+	"event_start://evt1.loc.f?reply(0x7f3a2c0012a0),result(0)",
+	"mmap_create://smb.loc.f#0:100000?map_name(frame),mmap_offset(3a000),reply(0x7f3a2c0012a0),result(0)",
+	"map_check://frame#0:10000?pattern(counting)",
+};
+
+#define NRIL (sizeof(ril)/sizeof(ril[0]))
+
+static char *names[] = { "auto", "scalar", "sse2", "avx2" };
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	struct vfi_delims ref, d;
+	int impl, i, n;
+	long bytes = 0;
+	double start, ns;
+
+	for (i = 0; i < NRIL; i++)
+		bytes += strlen(ril[i]);
+
+	for (impl = VFI_SCAN_SCALAR; impl <= VFI_SCAN_AVX2; impl++) {
+		if (vfi_select_scan(impl) != impl) {
+			printf("%-8s unsupported\n", names[impl]);
+			continue;
+		}
+
+		for (i = 0; i < NRIL; i++) {
+			vfi_select_scan(VFI_SCAN_SCALAR);
+			vfi_scan_delims(&ref, ril[i]);
+			vfi_select_scan(impl);
+			vfi_scan_delims(&d, ril[i]);
+			if (d.len != ref.len || memcmp(d.b, ref.b, sizeof(d.b))) {
+				printf("%-8s MISMATCH on %s\n", names[impl], ril[i]);
+				return 1;
+			}
+		}
+
+		start = now();
+		for (n = 0; n < ITERATIONS; n++)
+			for (i = 0; i < NRIL; i++)
+				vfi_scan_delims(&d, ril[i]);
+		ns = now() - start;
+
+		printf("%-8s %8.1f ns/string %6.2f GB/s\n", names[impl],
+		       ns / (ITERATIONS * NRIL), bytes * ITERATIONS / ns);
+	}
+	return 0;
+}
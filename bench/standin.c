@@ -0,0 +1,74 @@
+#include <sys/socket.h>
+#include <pthread.h>
+#include "standin.h"
+
+static void *standin_main(void *arg)
+{
+	union {
+		struct vfi_frame f;
+		char b[VFI_FRAME_MAX];
+	} frame;
+	char cmd[VFI_FRAME_MAX];
+	struct vfi_cmd_buf cb;
+	int fd = (long)arg;
+	int len;
+
+	vfi_cmd_init(&cb);
+	while ((len = read(fd, cmd, sizeof(cmd) - 1)) > 0) {
+		cmd[len] = '\0';
+
+		if ((unsigned char)cmd[0] == VFI_FRAME_MAGIC)
+			memcpy(frame.b, cmd, len);
+		else if (!strncmp(cmd, "framing://binary", 16)) {
+			long tag = 0;
+
+			vfi_get_hex_arg(cmd, "request", &tag);
+			len = sprintf(frame.b, "framing://binary?result(0),reply(%lx)\n", tag);
+			len = write(fd, frame.b, len);
+			continue;
+		}
+		else if (vfi_frame_encode(cmd, len, frame.b, sizeof(frame)) < 0)
+			continue;
+
+		frame.f.flags |= VFI_FRAME_RESULT;
+		if (frame.f.flags & VFI_FRAME_TAG)
+			frame.f.flags |= VFI_FRAME_REPLY;
+		frame.f.result = 0;
+
+		if ((unsigned char)cmd[0] == VFI_FRAME_MAGIC) {
+			len = write(fd, frame.b, frame.f.len);
+			continue;
+		}
+
+		if (vfi_frame_decode(frame.b, frame.f.len, &cb) == 0 &&
+		    vfi_cmd_lit(&cb, "\n") == 0)
+			len = write(fd, cb.p, cb.len);
+		vfi_cmd_release(&cb);
+	}
+
+	close(fd);
+	return NULL;
+}
+
+int standin_open(struct vfi_dev **dev, int timeout, int flags)
+{
+	pthread_t tid;
+	int sv[2];
+	int ret;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv))
+		return -errno;
+
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+	if ((ret = pthread_create(&tid, NULL, standin_main, (void *)(long)sv[1]))) {
+		close(sv[0]);
+		close(sv[1]);
+		return -ret;
+	}
+	pthread_detach(tid);
+
+	if ((ret = vfi_open_fd(dev, sv[0], timeout, flags)))
+		close(sv[0]);
+	return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef STANDIN_H
+#define STANDIN_H
+
+#include <vfi_api.h>
+
+/*
+ * A user space stand in for the vfi driver on a SOCK_SEQPACKET
+ * socketpair. Every command is answered with result(0) and its
+ * request() turned into a reply(), in text or, once agreed with
+ * framing://binary, in binary frames.
+ */
+extern int standin_open(struct vfi_dev **dev, int timeout, int flags);
+
+#endif /* STANDIN_H */
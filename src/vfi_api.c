@@ -3,205 +3,2199 @@
 #include <poll.h>
 #include <stdarg.h>
 #include <semaphore.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
 #define MY_ERROR VFI_DBG_DEFAULT
 #define MY_DEBUG (VFI_DBG_EVERYONE | VFI_DBG_EVERYTHING | VFI_LOG_DEBUG)
 
+/*
+ * The tokenizers below work from a single delimiter classification
+ * pass over the string, see vfi_scan.c, rather than repeated
+ * strstr()/sscanf() passes.
+ */
+static char *span_dup(const char *s, int len)
+{
+	char *p = malloc(len + 1);
+	if (p) {
+		memcpy(p, s, len);
+		p[len] = '\0';
+	}
+	return p;
+}
+
+/* Position just past the first "://" in the scanned string, or -1. */
+static int scheme_end(struct vfi_delims *d)
+{
+	int pos = 0;
+
+	while ((pos = vfi_next_delim(d, pos, ":")) < d->len) {
+		if (d->str[pos+1] == '/' && d->str[pos+2] == '/')
+			return pos + 3;
+		pos++;
+	}
+	return -1;
+}
+
 int vfi_get_extent(char *str, long *extent)
 {
-	char *ext = strstr(str,"://");
-	ext = ext ? strstr(ext+strlen("://"),":") : strstr(str,":");
-	if (ext)
-		if (sscanf(ext,":%x",extent) == 1)
-			return 0;
-	return VFI_RESULT(-EINVAL);
+	struct vfi_delims d;
+	unsigned long long val;
+	int pos;
+	int ret = -EINVAL;
+
+	if (vfi_scan_delims(&d, str) < 0)
+		return VFI_RESULT(-ENOMEM);
+
+	pos = scheme_end(&d);
+	pos = vfi_next_delim(&d, pos < 0 ? 0 : pos, ":") + 1;
+	if (pos < d.len)
+		if (vfi_parse_hex(str + pos, d.len - pos, &val)) {
+			*extent = val;
+			ret = 0;
+		}
+
+	vfi_release_delims(&d);
+	return VFI_RESULT(ret);
+}
+
+int vfi_get_offset(char *str, long long *offset)
+{
+	struct vfi_delims d;
+	unsigned long long val;
+	int pos;
+	int ret = -EINVAL;
+
+	if (vfi_scan_delims(&d, str) < 0)
+		return VFI_RESULT(-ENOMEM);
+
+	pos = vfi_next_delim(&d, 0, "#") + 1;
+	if (pos < d.len)
+		if (vfi_parse_hex(str + pos, d.len - pos, &val)) {
+			*offset = val;
+			ret = 0;
+		}
+
+	vfi_release_delims(&d);
+	return VFI_RESULT(ret);
+}
+
+int vfi_get_location(char *str, char **loc)
+{
+	struct vfi_delims d;
+	int start, end;
+	int ret = -EINVAL;
+
+	if (vfi_scan_delims(&d, str) < 0)
+		return VFI_RESULT(-ENOMEM);
+
+	start = vfi_next_delim(&d, 0, ".");
+	if (start && start < d.len) {
+		start++;
+		end = vfi_next_delim(&d, start, "?=/#:");
+		if (end > start) {
+			*loc = span_dup(str + start, end - start);
+			ret = *loc ? 0 : -ENOMEM;
+		}
+	}
+
+	vfi_release_delims(&d);
+	return VFI_RESULT(ret);
+}
+
+int vfi_get_name_location(char *str, char **name, char **loc)
+{
+	struct vfi_delims d;
+	int start, end;
+	int ret = -EINVAL;
+
+	if (vfi_scan_delims(&d, str) < 0)
+		return VFI_RESULT(-ENOMEM);
+
+	start = scheme_end(&d);
+	if (start < 0)
+		goto out;
+
+	end = vfi_next_delim(&d, start, ".?=/#:");
+	if (end == start)
+		goto out;
+
+	*loc = NULL;
+	*name = span_dup(str + start, end - start);
+	if (*name == NULL) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = 0;
+
+	if (str[end] == '.') {
+		start = end + 1;
+		end = vfi_next_delim(&d, start, "?=/#:");
+		if (end > start)
+			*loc = span_dup(str + start, end - start);
+	}
+out:
+	vfi_release_delims(&d);
+	return VFI_RESULT(ret);
+}
+
+/*
+ * Split @str into the fields of cmd://f1<sep>f2<sep>...fn. Each field
+ * must be non-empty and the last runs to the end of the line. Like
+ * the sscanf() it replaces, it returns the number of fields assigned
+ * and leaves the unassigned outputs untouched.
+ */
+static int parse_op(char *str, const char *seps, char ***fields, int nfields)
+{
+	struct vfi_delims d;
+	int start, end;
+	int cnt = 0;
+	char sep[2] = {0, 0};
+
+	if (*str == '\0')
+		return EOF;
+
+	if (vfi_scan_delims(&d, str) < 0)
+		return VFI_RESULT(-ENOMEM);
+
+	start = 0;
+	end = vfi_next_delim(&d, 0, ":");
+	while (cnt < nfields && end > start) {
+		*fields[cnt++] = span_dup(str + start, end - start);
+		if (cnt == nfields)
+			break;
+		if (cnt == 1) {
+			if (strncmp(str + end, "://", 3))
+				break;
+			start = end + 3;
+		}
+		else {
+			if (str[end] != seps[cnt-2])
+				break;
+			start = end + 1;
+		}
+		if (cnt == nfields - 1)
+			end = start + strcspn(str + start, "\n");
+		else {
+			sep[0] = seps[cnt-1];
+			end = vfi_next_delim(&d, start, sep);
+		}
+	}
+
+	vfi_release_delims(&d);
+	return cnt;
+}
+
+int vfi_parse_ternary_op(char *str, char **cmd, char **xfer, char **dest, char **src)
+{
+	char **fields[] = {cmd, xfer, dest, src};
+	return parse_op(str, "/=", fields, 4);
+}
+
+int vfi_parse_unary_op(char *str, char **cmd, char **desc)
+{
+	char **fields[] = {cmd, desc};
+	return parse_op(str, "", fields, 2);
+}
+
+int vfi_parse_desc(char *str, char **name, char **location, int *offset, int *extent, char **opts)
+{
+	struct vfi_delims d;
+	unsigned long long val;
+	int pos, end, n;
+	int cnt = 0;
+
+	*name = *location = *opts = NULL;
+
+	if (vfi_scan_delims(&d, str) < 0)
+		return VFI_RESULT(-ENOMEM);
+
+	end = vfi_next_delim(&d, 0, ".#:?");
+	*name = span_dup(str, end);
+
+	if (str[end] == '.') {
+		pos = end + 1;
+		end = vfi_next_delim(&d, pos, "#:?");
+		*location = span_dup(str + pos, end - pos);
+	}
+
+	while (str[end] == '#' || str[end] == ':') {
+		pos = end + 1;
+		n = vfi_parse_hex(str + pos, d.len - pos, &val);
+		if (n) {
+			if (str[end] == '#') {
+				*offset = val;
+				cnt |= 2;
+			}
+			else {
+				*extent = val;
+				cnt |= 1;
+			}
+		}
+		end = vfi_next_delim(&d, pos + n, "#:?");
+	}
+
+	if (str[end] == '?') {
+		pos = end + 1;
+		*opts = span_dup(str + pos, strcspn(str + pos, "\n"));
+	}
+
+	vfi_release_delims(&d);
+	return cnt;
+}
+
+struct vfi_dev {
+	int fd;
+	FILE *file;
+	aio_context_t ctx;
+	int to;
+	int done;
+	int mode;		/* VFI_OPEN_* agreed with the driver */
+	unsigned long probe;	/* tag of an unanswered framing probe */
+	unsigned long gen;	/* bumped when anything is (un)registered */
+	struct vfi_program *programs;
+	int notify_fd;		/* readable when a retried wait may succeed */
+	struct vfi_wait_stats wait_stats;
+	long minflt;		/* process faults at the last vfi_get_fault_stats() */
+	long majflt;
+	struct vfi_arena *arena;	/* small maps, see vfi_arena_create() */
+	struct vfi_npc *funcs;
+	struct vfi_npc *maps;
+	struct vfi_npc *events;
+	struct vfi_npc *pipes;
+	void (*free_pipe)(void *);	/* see vfi_set_pipe_free() */
+	struct vfi_cmd_elem *pre_commands;
+	struct vfi_cmd_elem *post_commands;
+};
+
+struct vfi_cmd_elem {
+	struct vfi_cmd_elem *next;
+	int (*f) (struct vfi_dev *, struct vfi_async_handle *, char **);
+	int (*bind) (struct vfi_dev *, char *, void **);
+	int (*run) (struct vfi_dev *, struct vfi_async_handle *, void *, char **);
+	int size;
+	char *cmd;		/* this is the name of the command is self->b */
+	char b[];		/* Holds the name of the card, pointed
+				 * to by cmd above. */
+};
+
+struct vfi_npc {
+	struct vfi_npc *next;
+	char *name;		/* name of closure self->b */
+	int size;		/* size of name */
+	void *e;		/* closure */
+	char b[];		/* buffer for name */
+};
+
+/*
+ * Generalize input of command strings from multiple sources, command
+ * line parameters (inputs), stream read (from files or stdin).
+ */
+static int get_file(void **s, char **command)
+{
+	int ret;
+	FILE *fp = *s;
+	do {
+		if (fp == stdin)
+			printf("[VFI]$ ");
+
+		ret = fscanf(fp, " %m[^\n]", command);
+
+		if (ret == EOF) {
+			free(*command);
+			*command = NULL;
+			return 0;
+		}
+			
+		if (**command == '#') {
+			free(*command);
+			ret = 0;
+		}
+	} while (ret == 0);
+
+	return ret;
+}
+
+int vfi_setup_file(struct vfi_dev *dev, struct vfi_source **src,
+		     FILE * fp)
+{
+	struct vfi_source *h = malloc(sizeof(*h) + sizeof(void *));
+	*src = h;
+
+	if (fp == NULL)
+		return VFI_RESULT(-EINVAL);
+
+	if (h == NULL)
+		return VFI_RESULT(-ENOMEM);
+
+	h->f = get_file;
+	h->d = dev;
+	h->h[0] = (void *)fp;
+
+	return 0;
+}
+
+int vfi_teardown_file(struct vfi_source *src)
+{
+	free(src);
+	return 0;
+}
+
+/*
+ * A mapped script. h[0] is the mapping, h[1] the next unread byte
+ * and h[2] the end. Lines are found with memchr and handed out as
+ * spans into the mapping.
+ */
+static int get_mmap_span(void **h, const char **command, int *len)
+{
+	const char *p = h[1];
+	const char *end = h[2];
+	const char *nl;
+
+	for (;;) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+			p++;
+		if (p == end) {
+			h[1] = (void *)p;
+			return 0;
+		}
+
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL)
+			nl = end;
+
+		if (*p != '#') {
+			*command = p;
+			*len = nl - p;
+			h[1] = (void *)nl;
+			return 1;
+		}
+		p = nl;
+	}
+}
+
+static int get_mmap(void **h, char **command)
+{
+	const char *p;
+	int len;
+
+	if (get_mmap_span(h, &p, &len) <= 0)
+		return 0;
+
+	*command = malloc(len + 1);
+	if (*command == NULL)
+		return VFI_RESULT(-ENOMEM);
+	memcpy(*command, p, len);
+	(*command)[len] = '\0';
+	return 1;
+}
+
+int vfi_setup_mmap(struct vfi_dev *dev, struct vfi_source **src, char *path)
+{
+	struct vfi_source *h;
+	struct stat st;
+	char *map = NULL;
+	int fd;
+
+	*src = NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return VFI_RESULT(-errno);
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return VFI_RESULT(-errno);
+	}
+
+	if (st.st_size) {
+		map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return VFI_RESULT(-errno);
+		}
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	h = malloc(sizeof(*h) + 3 * sizeof(void *));
+	if (h == NULL) {
+		if (map)
+			munmap(map, st.st_size);
+		return VFI_RESULT(-ENOMEM);
+	}
+
+	h->f = get_mmap;
+	h->d = dev;
+	h->h[0] = map;
+	h->h[1] = map;
+	h->h[2] = map + st.st_size;
+
+	*src = h;
+	return 0;
+}
+
+int vfi_teardown_mmap(struct vfi_source *src)
+{
+	if (src->h[0])
+		munmap(src->h[0], (char *)src->h[2] - (char *)src->h[0]);
+	free(src);
+	return 0;
+}
+
+/*
+ * Spans are only had from sources built here, known by their @f, so
+ * a #vfi_source made by the application needs nothing more than ever.
+ */
+typedef int (*span_fn)(void **h, const char **cmd, int *len);
+
+static int get_repeat(void **h, char **command);
+static int get_repeat_span(void **h, const char **line, int *len);
+
+static span_fn source_span(struct vfi_source *src)
+{
+	if (src->f == get_mmap)
+		return get_mmap_span;
+	if (src->f == get_repeat)
+		return get_repeat_span;
+	return NULL;
+}
+
+int vfi_get_span(struct vfi_source *src, const char **command, int *len)
+{
+	span_fn s = source_span(src);
+
+	if (s == NULL)
+		return VFI_RESULT(-EINVAL);
+
+	if (vfi_dev_done(src->d))
+		return 0;
+	return (s(src->h, command, len) > 0);
+}
+
+int vfi_get_cmd(struct vfi_source *src, char **command)
+{
+	free(*command);
+	*command = NULL;
+
+	if (vfi_dev_done(src->d))
+		return 0;
+	return (src->f(src->h, command) > 0);
+}
+
+/*
+ * Repeat blocks. A filter over another source which expands
+ *
+ *	repeat(N)[,rate(hz)] {
+ *	...
+ *	}
+ *
+ * Blocks, which may nest, are read and copied once and then replayed
+ * from memory N times, paced to hz iterations a second if a rate is
+ * given. Other lines pass through. An iteration is timed from handing
+ * out its first command to the request for the command after its
+ * last, so in a synchronous loop it covers executing every command.
+ */
+#define REPEAT_DEPTH 16
+
+struct rep_item {
+	char *line;		/* NULL for a nested block */
+	int len;
+	struct rep_block *blk;
+};
+
+struct rep_block {
+	long count;
+	double rate;
+	int n;
+	int max;
+	struct rep_item *items;
+	struct vfi_repeat_stats stats;
+};
+
+struct rep_frame {
+	struct rep_block *blk;
+	int idx;
+	long iter;
+	struct timespec t0;	/* start of the first iteration, for pacing */
+	struct timespec ti;	/* start of this iteration */
+};
+
+struct rep_state {
+	struct vfi_source *in;
+	char *cur;		/* owned line from a source without spans */
+	int sp;
+	struct rep_frame stack[REPEAT_DEPTH];
+	struct rep_block *top;	/* the outermost block being or last replayed */
+};
+
+static long long ts_ns(struct timespec *t)
+{
+	return t->tv_sec * 1000000000LL + t->tv_nsec;
+}
+
+static int inner_line(struct rep_state *st, const char **line, int *len)
+{
+	struct vfi_source *in = st->in;
+
+	if (source_span(in))
+		return vfi_get_span(in, line, len);
+
+	if (!vfi_get_cmd(in, &st->cur))
+		return 0;
+	*line = st->cur;
+	*len = strlen(st->cur);
+	return 1;
+}
+
+static int trim(const char *line, int len)
+{
+	while (len && (line[len-1] == ' ' || line[len-1] == '\t' || line[len-1] == '\r'))
+		len--;
+	return len;
+}
+
+/* Returns 1 with the count and rate if @line opens a repeat block. */
+static int repeat_header(const char *line, int len, long *count, double *rate)
+{
+	char buf[128];
+	char *val;
+
+	len = trim(line, len);
+	if (len < 9 || len >= sizeof(buf) || strncmp(line, "repeat(", 7) || line[len-1] != '{')
+		return 0;
+
+	memcpy(buf, line, len - 1);
+	buf[len-1] = '\0';
+	if (vfi_get_dec_arg(buf, "repeat", count) || *count < 0)
+		return VFI_RESULT(-EINVAL);
+
+	*rate = 0;
+	if (vfi_get_str_arg(buf, "rate", &val) > 0) {
+		*rate = strtod(val, NULL);
+		free(val);
+	}
+	return 1;
+}
+
+static void free_block(struct rep_block *blk)
+{
+	int i;
+
+	for (i = 0; i < blk->n; i++) {
+		free(blk->items[i].line);
+		if (blk->items[i].blk)
+			free_block(blk->items[i].blk);
+	}
+	free(blk->items);
+	free(blk);
+}
+
+static struct rep_item *add_item(struct rep_block *blk)
+{
+	struct rep_item *items;
+
+	if (blk->n == blk->max) {
+		int max = blk->max ? blk->max * 2 : 16;
+		items = realloc(blk->items, max * sizeof(*items));
+		if (items == NULL)
+			return NULL;
+		blk->items = items;
+		blk->max = max;
+	}
+	items = &blk->items[blk->n++];
+	memset(items, 0, sizeof(*items));
+	return items;
+}
+
+/* Read the body of a block up to its closing brace. */
+static int read_block(struct rep_state *st, struct rep_block **blkp, long count,
+		      double rate, int depth)
+{
+	struct rep_block *blk = calloc(1, sizeof(*blk));
+	struct rep_item *item;
+	const char *line;
+	int len, ret;
+	long n;
+	double r;
+
+	*blkp = blk;
+	if (blk == NULL)
+		return VFI_RESULT(-ENOMEM);
+	blk->count = count;
+	blk->rate = rate;
+	blk->stats.rate = rate;
+
+	if (depth >= REPEAT_DEPTH)
+		return VFI_RESULT(-E2BIG);
+
+	while (inner_line(st, &line, &len) > 0) {
+		if (trim(line, len) == 1 && line[0] == '}')
+			return 0;
+
+		if (!(item = add_item(blk)))
+			return VFI_RESULT(-ENOMEM);
+
+		if ((ret = repeat_header(line, len, &n, &r)) < 0)
+			return VFI_RESULT(ret);
+		if (ret) {
+			if ((ret = read_block(st, &item->blk, n, r, depth + 1)))
+				return VFI_RESULT(ret);
+			continue;
+		}
+
+		item->line = malloc(len + 1);
+		if (item->line == NULL)
+			return VFI_RESULT(-ENOMEM);
+		memcpy(item->line, line, len);
+		item->line[len] = '\0';
+		item->len = len;
+	}
+
+	vfi_log(VFI_LOG_ERR, "%s: repeat block is not closed", __func__);
+	return VFI_RESULT(-EINVAL);
+}
+
+static int push_block(struct rep_state *st, struct rep_block *blk)
+{
+	struct rep_frame *f;
+
+	if (st->sp == REPEAT_DEPTH)
+		return VFI_RESULT(-E2BIG);
+	f = &st->stack[st->sp++];
+	memset(f, 0, sizeof(*f));
+	f->blk = blk;
+	memset(&blk->stats, 0, sizeof(blk->stats));
+	blk->stats.rate = blk->rate;
+	return 0;
+}
+
+/* Start iteration f->iter, waiting for its slot when paced at @rate. */
+static void start_iteration(struct rep_frame *f, double rate)
+{
+	struct timespec t;
+	long long ns;
+
+	if (f->iter == 0)
+		clock_gettime(CLOCK_MONOTONIC, &f->t0);
+	else if (rate > 0) {
+		ns = ts_ns(&f->t0) + (long long)(f->iter * 1e9 / rate);
+		t.tv_sec = ns / 1000000000LL;
+		t.tv_nsec = ns % 1000000000LL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+			;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &f->ti);
+}
+
+static void end_iteration(struct rep_frame *f, struct vfi_repeat_stats *s)
+{
+	struct timespec t;
+	long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	ns = ts_ns(&t) - ts_ns(&f->ti);
+	if (s->iterations == 0 || ns < s->min_ns)
+		s->min_ns = ns;
+	if (ns > s->max_ns)
+		s->max_ns = ns;
+	s->total_ns += ns;
+	s->iterations++;
+	s->elapsed_ns = ts_ns(&t) - ts_ns(&f->t0);
+}
+
+static int get_repeat_span(void **h, const char **line, int *len)
+{
+	struct rep_state *st = h[0];
+	struct rep_frame *f;
+	struct rep_item *item;
+	struct rep_block *blk;
+	long n;
+	double r;
+	int ret;
+
+	for (;;) {
+		if (st->sp == 0) {
+			if ((ret = inner_line(st, line, len)) <= 0)
+				return ret;
+			if ((ret = repeat_header(*line, *len, &n, &r)) == 0)
+				return 1;
+			if (ret < 0)
+				return VFI_RESULT(ret);
+
+			/* The previous block is finished with, keep only its successor. */
+			if (st->top)
+				free_block(st->top);
+			st->top = NULL;
+
+			ret = read_block(st, &blk, n, r, 1);
+			if (ret) {
+				if (blk)
+					free_block(blk);
+				return VFI_RESULT(ret);
+			}
+			st->top = blk;
+			push_block(st, blk);
+			continue;
+		}
+
+		f = &st->stack[st->sp - 1];
+		if (f->iter >= f->blk->count || f->blk->n == 0) {
+			st->sp--;
+			continue;
+		}
+
+		if (f->idx == f->blk->n) {
+			end_iteration(f, &f->blk->stats);
+			f->idx = 0;
+			f->iter++;
+			continue;
+		}
+
+		if (f->idx == 0)
+			start_iteration(f, f->blk->rate);
+
+		item = &f->blk->items[f->idx++];
+		if (item->blk) {
+			if ((ret = push_block(st, item->blk)))
+				return VFI_RESULT(ret);
+			continue;
+		}
+
+		*line = item->line;
+		*len = item->len;
+		return 1;
+	}
+}
+
+static int get_repeat(void **h, char **command)
+{
+	const char *line;
+	int len;
+	int ret;
+
+	if ((ret = get_repeat_span(h, &line, &len)) <= 0)
+		return ret;
+
+	*command = malloc(len + 1);
+	if (*command == NULL)
+		return VFI_RESULT(-ENOMEM);
+	memcpy(*command, line, len);
+	(*command)[len] = '\0';
+	return 1;
+}
+
+int vfi_setup_repeat(struct vfi_dev *dev, struct vfi_source **src, struct vfi_source *in)
+{
+	struct vfi_source *h = malloc(sizeof(*h) + sizeof(void *));
+	struct rep_state *st = calloc(1, sizeof(*st));
+
+	*src = NULL;
+	if (h == NULL || st == NULL) {
+		free(h);
+		free(st);
+		return VFI_RESULT(-ENOMEM);
+	}
+
+	st->in = in;
+	h->f = get_repeat;
+	h->d = dev;
+	h->h[0] = st;
+
+	*src = h;
+	return 0;
+}
+
+int vfi_teardown_repeat(struct vfi_source *src)
+{
+	struct rep_state *st = src->h[0];
+
+	if (st->top)
+		free_block(st->top);
+	free(st->cur);
+	free(st);
+	free(src);
+	return 0;
+}
+
+int vfi_get_repeat_stats(struct vfi_source *src, struct vfi_repeat_stats *stats)
+{
+	struct rep_state *st = src->h[0];
+
+	if (src->f != get_repeat || st->top == NULL)
+		return VFI_RESULT(-EINVAL);
+
+	*stats = st->top->stats;
+	return 0;
+}
+
+static struct vfi_cmd_elem *find_cmd_elem(struct vfi_cmd_elem *commands, const char *buf, int size);
+
+/*
+ * Precompiled scripts. Each command is decoded once: the pre command
+ * for its verb is bound, and commands for the driver are laid out
+ * ready to send with a fixed width slot for the request tag. A run
+ * only patches the tag in, so no line is tokenized or looked up
+ * again. Pre commands with a bound form parse their command once, on
+ * first issue, and keep the arguments and the objects they name with
+ * the instruction. All bindings are dropped when anything is
+ * registered or unregistered, as the objects may be gone, and remade
+ * as each command is next issued.
+ *
+ * A repeat block read through vfi_setup_repeat() compiles to a loop
+ * instruction followed by its body, so each iteration replays the
+ * compiled commands rather than the text.
+ *
+ * Strings live in one arena and are referred to by offset so the
+ * arena can grow while compiling.
+ */
+#define TAG_DIGITS 16
+#define INSN_RES 6
+
+struct rep_loop {
+	long count;
+	double rate;
+	int end;		/* the instruction after the body */
+	struct vfi_repeat_stats stats;
+};
+
+struct vfi_insn {
+	struct vfi_cmd_elem *pre;
+	void *state;		/* from pre->bind */
+	struct rep_loop *loop;	/* for the head of a repeat block */
+	int verb;		/* length of the verb */
+	int cmd;		/* offset of the command in the arena */
+	int len;
+	int send;		/* offset of cmd?request(<tag>)\n */
+	int send_len;
+	int tag;		/* offset of the tag digits in send */
+	int barrier;		/* orders against everything */
+	int nrd;
+	int nwr;
+	unsigned long long rd[INSN_RES];	/* hashed names read */
+	unsigned long long wr[INSN_RES];	/* and written */
+};
+
+struct vfi_program {
+	struct vfi_program *next;
+	struct vfi_dev *dev;
+	unsigned long gen;
+	char *path;		/* cache key and the stat() it was compiled from */
+	struct stat st;
+	int n;
+	int max;
+	int loops;
+	struct vfi_insn *insn;
+	struct rep_loop *top;	/* the outermost block being or last run */
+	struct vfi_cmd_buf arena;
+};
+
+static void bind_program(struct vfi_program *prog)
+{
+	struct vfi_insn *in;
+	int i;
+
+	for (i = 0, in = prog->insn; i < prog->n; i++, in++) {
+		free(in->state);
+		in->state = NULL;
+		in->pre = in->loop ? NULL : find_cmd_elem(prog->dev->pre_commands,
+							  prog->arena.p + in->cmd, in->verb);
+	}
+	prog->gen = prog->dev->gen;
+}
+
+/*
+ * What a command reads and writes, for running independent commands
+ * concurrently. The objects are the names in the command: the name of
+ * each part of cmd://a/b=c and the values of event_name() and
+ * map_name(). The verb decides which of them are written, by part
+ * number and for the options. Verbs not in the table, and the sync
+ * points, are barriers. Names are compared by hash of the name before
+ * any location, so a collision or a shared name only costs
+ * concurrency.
+ */
+#define RES_PART(n) (1 << (n))
+#define RES_OPTS (1 << 8)
+
+static struct {
+	char *verb;
+	int writes;
+} res_rules[] = {
+	{ "bind_create", RES_PART(0) | RES_OPTS },
+	{ "mmap_create", RES_OPTS },
+	{ "smb_create", RES_PART(0) | RES_OPTS },
+	{ "map_install", RES_PART(0) | RES_OPTS },
+	{ "map_init", RES_PART(0) | RES_OPTS },
+	{ "map_check", 0 },
+	{ "event_find", RES_PART(0) | RES_OPTS },
+	{ "event_start", RES_PART(0) | RES_OPTS },
+	{ "event_chain", RES_PART(0) | RES_OPTS },
+};
+
+static unsigned long long res_hash(const char *s, int len)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+	return h;
+}
+
+static void add_res(struct vfi_insn *in, int write, const char *name, int len)
+{
+	if (len == 0)
+		return;
+	if (write && in->nwr < INSN_RES)
+		in->wr[in->nwr++] = res_hash(name, len);
+	else if (!write && in->nrd < INSN_RES)
+		in->rd[in->nrd++] = res_hash(name, len);
+	else
+		in->barrier = 1;
+}
+
+static void analyse_insn(struct vfi_insn *in, const char *cmd)
+{
+	struct vfi_delims d;
+	int rule, pos, end, part;
+
+	for (rule = 0; rule < sizeof(res_rules)/sizeof(res_rules[0]); rule++)
+		if (in->verb == strlen(res_rules[rule].verb) &&
+		    !strncmp(cmd, res_rules[rule].verb, in->verb))
+			break;
+
+	if (rule == sizeof(res_rules)/sizeof(res_rules[0]) ||
+	    in->verb == in->len || vfi_scan_delims(&d, cmd) < 0) {
+		in->barrier = 1;
+		return;
+	}
+
+	/* The parts: a name up to the first delimiter after each of ://, / and = */
+	pos = in->verb + 3;
+	for (part = 0; pos < d.len; part++) {
+		end = vfi_next_delim(&d, pos, NULL);
+		add_res(in, res_rules[rule].writes & RES_PART(part), cmd + pos, end - pos);
+		pos = vfi_next_delim(&d, end, "/=");
+		if (pos < d.len)
+			pos++;
+	}
+
+	/* The names given as options */
+	for (pos = vfi_next_delim(&d, in->verb + 3, "?,"); pos < d.len;
+	     pos = vfi_next_delim(&d, pos + 1, "?,")) {
+		end = vfi_next_delim(&d, pos + 1, NULL);
+		if (cmd[end] != '(')
+			continue;
+		if ((end - pos - 1 == 10 && !strncmp(cmd + pos + 1, "event_name", 10)) ||
+		    (end - pos - 1 == 8 && !strncmp(cmd + pos + 1, "map_name", 8))) {
+			pos = vfi_next_delim(&d, end + 1, ")");
+			add_res(in, res_rules[rule].writes & RES_OPTS, cmd + end + 1, pos - end - 1);
+		}
+	}
+
+	vfi_release_delims(&d);
+}
+
+static struct vfi_insn *new_insn(struct vfi_program *prog)
+{
+	struct vfi_insn *in;
+
+	if (prog->n == prog->max) {
+		int max = prog->max ? prog->max * 2 : 64;
+		in = realloc(prog->insn, max * sizeof(*in));
+		if (in == NULL)
+			return NULL;
+		prog->insn = in;
+		prog->max = max;
+	}
+
+	in = &prog->insn[prog->n];
+	memset(in, 0, sizeof(*in));
+	return in;
+}
+
+static int add_insn(struct vfi_program *prog, const char *cmd, int len)
+{
+	struct vfi_cmd_buf *a = &prog->arena;
+	struct vfi_insn *in;
+	const char *term;
+	int i;
+
+	if ((in = new_insn(prog)) == NULL)
+		return VFI_RESULT(-ENOMEM);
+	for (term = cmd; term + 2 < cmd + len; term++)
+		if (term[0] == ':' && term[1] == '/' && term[2] == '/')
+			break;
+	in->verb = term + 2 < cmd + len ? term - cmd : len;
+
+	in->cmd = a->len;
+	in->len = len;
+	if (vfi_cmd_put(a, cmd, len) || vfi_cmd_put(a, "", 1))
+		return VFI_RESULT(-ENOMEM);
+	analyse_insn(in, a->p + in->cmd);
+
+	in->send = a->len;
+	if (vfi_cmd_put(a, cmd, len) ||
+	    vfi_cmd_put(a, memchr(cmd, '?', len) ? ",request(" : "?request(", 9))
+		return VFI_RESULT(-ENOMEM);
+	in->tag = a->len - in->send;
+	for (i = 0; i < TAG_DIGITS; i++)
+		if (vfi_cmd_lit(a, "0"))
+			return VFI_RESULT(-ENOMEM);
+	if (vfi_cmd_lit(a, ")\n") || vfi_cmd_put(a, "", 1))
+		return VFI_RESULT(-ENOMEM);
+	in->send_len = a->len - in->send - 1;
+
+	prog->n++;
+	return 0;
+}
+
+/*
+ * The head of a repeat block takes no part in issuing. Its body runs
+ * to insn[end], which is patched in once the block is compiled.
+ */
+static int add_loop(struct vfi_program *prog, long count, double rate)
+{
+	struct vfi_insn *in;
+
+	if ((in = new_insn(prog)) == NULL ||
+	    (in->loop = calloc(1, sizeof(*in->loop))) == NULL)
+		return VFI_RESULT(-ENOMEM);
+	in->loop->count = count;
+	in->loop->rate = rate;
+	in->barrier = 1;
+	prog->n++;
+	prog->loops++;
+	return 0;
+}
+
+/* Compile the rest of @st's input, or at @depth the body of a block. */
+static int compile_block(struct vfi_program *prog, struct rep_state *st, int depth)
+{
+	const char *line;
+	int len, head, ret;
+	long n;
+	double r;
+
+	while (inner_line(st, &line, &len) > 0) {
+		if (depth && trim(line, len) == 1 && line[0] == '}')
+			return 0;
+
+		if ((ret = repeat_header(line, len, &n, &r)) < 0)
+			return VFI_RESULT(ret);
+		if (ret == 0) {
+			if ((ret = add_insn(prog, line, len)))
+				return VFI_RESULT(ret);
+			continue;
+		}
+
+		if (depth + 1 >= REPEAT_DEPTH)
+			return VFI_RESULT(-E2BIG);
+		head = prog->n;
+		if ((ret = add_loop(prog, n, r)) || (ret = compile_block(prog, st, depth + 1)))
+			return VFI_RESULT(ret);
+		prog->insn[head].loop->end = prog->n;
+	}
+
+	if (depth) {
+		vfi_log(VFI_LOG_ERR, "%s: repeat block is not closed", __func__);
+		return VFI_RESULT(-EINVAL);
+	}
+	return 0;
+}
+
+int vfi_compile_program(struct vfi_dev *dev, struct vfi_source *src,
+			struct vfi_program **progp)
+{
+	struct vfi_program *prog = calloc(1, sizeof(*prog));
+	const char *span;
+	char *cmd = NULL;
+	int len;
+	int ret = 0;
+
+	*progp = NULL;
+	if (prog == NULL)
+		return VFI_RESULT(-ENOMEM);
+
+	prog->dev = dev;
+	vfi_cmd_init(&prog->arena);
+
+	if (src->f == get_repeat)
+		ret = compile_block(prog, src->h[0], 0);
+	else if (source_span(src)) {
+		while (!ret && vfi_get_span(src, &span, &len) > 0)
+			ret = add_insn(prog, span, len);
+	}
+	else {
+		while (!ret && vfi_get_cmd(src, &cmd))
+			ret = add_insn(prog, cmd, strlen(cmd));
+		free(cmd);
+	}
+
+	if (ret) {
+		vfi_free_program(prog);
+		return VFI_RESULT(ret);
+	}
+
+	bind_program(prog);
+	*progp = prog;
+	return 0;
+}
+
+void vfi_free_program(struct vfi_program *prog)
+{
+	int i;
+
+	if (prog == NULL)
+		return;
+	for (i = 0; i < prog->n; i++) {
+		free(prog->insn[i].state);
+		free(prog->insn[i].loop);
+	}
+	vfi_cmd_release(&prog->arena);
+	free(prog->insn);
+	free(prog->path);
+	free(prog);
+}
+
+int vfi_program_size(struct vfi_program *prog)
+{
+	return prog->n - prog->loops;
+}
+
+int vfi_get_program_stats(struct vfi_program *prog, struct vfi_repeat_stats *stats)
+{
+	if (prog->top == NULL)
+		return VFI_RESULT(-EINVAL);
+
+	*stats = prog->top->stats;
+	return 0;
+}
+
+/*
+ * Compiled programs are cached on the device by path and recompiled
+ * when the file is replaced or modified, as seen by its inode, size
+ * or modification time.
+ */
+int vfi_load_program(struct vfi_dev *dev, char *path, struct vfi_program **progp)
+{
+	struct vfi_program **pp, *prog;
+	struct vfi_source *src, *rep;
+	struct stat st;
+	int ret;
+
+	*progp = NULL;
+	if (stat(path, &st))
+		return VFI_RESULT(-errno);
+
+	for (pp = &dev->programs; (prog = *pp); pp = &prog->next)
+		if (!strcmp(prog->path, path))
+			break;
+
+	if (prog) {
+		if (prog->st.st_ino == st.st_ino && prog->st.st_dev == st.st_dev &&
+		    prog->st.st_size == st.st_size &&
+		    prog->st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+		    prog->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+			*progp = prog;
+			return 0;
+		}
+		*pp = prog->next;
+		vfi_free_program(prog);
+	}
+
+	if ((ret = vfi_setup_mmap(dev, &src, path)))
+		return VFI_RESULT(ret);
+	if ((ret = vfi_setup_repeat(dev, &rep, src))) {
+		vfi_teardown_mmap(src);
+		return VFI_RESULT(ret);
+	}
+
+	ret = vfi_compile_program(dev, rep, &prog);
+	vfi_teardown_repeat(rep);
+	vfi_teardown_mmap(src);
+	if (ret)
+		return VFI_RESULT(ret);
+
+	prog->path = strdup(path);
+	if (prog->path == NULL) {
+		vfi_free_program(prog);
+		return VFI_RESULT(-ENOMEM);
+	}
+	prog->st = st;
+	prog->next = dev->programs;
+	dev->programs = prog;
+
+	*progp = prog;
+	return 0;
+}
+
+static void put_tag(char *p, unsigned long long tag)
+{
+	static const char hex[16] = "0123456789abcdef";
+	int i;
+
+	for (i = TAG_DIGITS; i--; tag >>= 4)
+		p[i] = hex[tag & 15];
+}
+
+/*
+ * Commands run as an application loop would run them: the pre command
+ * first, then if it wants the driver, the command with our request
+ * tag, then the closure the pre command left on the handle. Issue and
+ * retirement are split so that several commands can be at the driver
+ * at once. A closure which calls vfi_retry_async_handle() gets the
+ * command sent again, as the pre command left it, on the same handle.
+ */
+struct run_slot {
+	struct vfi_insn *in;
+	struct vfi_async_handle *ah;
+	char *cmd;		/* as rewritten by the pre command */
+};
+
+static int send_insn(struct vfi_program *prog, struct run_slot *slot)
+{
+	struct vfi_insn *in = slot->in;
+	struct vfi_cmd_buf cb;
+	char *send;
+	int ret;
+
+	if (slot->cmd) {
+		vfi_cmd_init(&cb);
+		if (vfi_cmd_from(&cb, slot->cmd) || vfi_cmd_request(&cb, slot->ah))
+			ret = -ENOMEM;
+		else
+			ret = vfi_invoke_cmd_buf(prog->dev, &cb);
+		vfi_cmd_release(&cb);
+		return ret;
+	}
+
+	send = prog->arena.p + in->send;
+	put_tag(send + in->tag, (unsigned long)slot->ah);
+	return vfi_invoke_cmd_str(prog->dev, send, in->send_len);
+}
+
+static void free_slot(struct run_slot *slot)
+{
+	vfi_free_async_handle(slot->ah);
+	free(slot->cmd);
+	slot->ah = NULL;
+	slot->cmd = NULL;
+}
+
+/* Returns 1 if the command was sent again and is still in flight. */
+static int retire_insn(struct vfi_program *prog, struct run_slot *slot,
+		       char *result, void *e)
+{
+	long rslt;
+	int ret;
+
+	if (e)
+		ret = (long)vfi_invoke_closure(e, prog->dev, slot->ah, result);
+	else if (vfi_get_dec_arg(result, "result", &rslt) == 0)
+		ret = rslt;
+	else
+		ret = -EIO;
+	free(result);
+
+	if (e && vfi_clear_retry_async_handle(slot->ah)) {
+		ret = send_insn(prog, slot);
+		if (ret > 0)
+			return 1;
+		ret = ret ? ret : -EIO;
+	}
+
+	if (ret < 0)
+		vfi_log(VFI_LOG_ERR, "%s: %s failed. Error is %d", __func__,
+			prog->arena.p + slot->in->cmd, ret);
+	free_slot(slot);
+	return VFI_RESULT(ret < 0 ? ret : 0);
+}
+
+/* Returns 1 if the command is left at the driver, else 0 or error. */
+static int issue_insn(struct vfi_program *prog, struct vfi_insn *in,
+		      struct run_slot *slot)
+{
+	int ret;
+
+	slot->in = in;
+	slot->cmd = NULL;
+	slot->ah = vfi_alloc_async_handle(NULL);
+	if (slot->ah == NULL)
+		return VFI_RESULT(-ENOMEM);
+
+	if (prog->gen != prog->dev->gen)
+		bind_program(prog);
+	if (in->pre && in->pre->bind && in->state == NULL &&
+	    (ret = in->pre->bind(prog->dev, prog->arena.p + in->cmd, &in->state)))
+		goto out;
+
+	if (in->state) {
+		ret = in->pre->run(prog->dev, slot->ah, in->state, &slot->cmd);
+		if (ret)
+			goto out;
+	}
+	else if (in->pre) {
+		slot->cmd = malloc(in->len + 1);
+		if (slot->cmd == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		memcpy(slot->cmd, prog->arena.p + in->cmd, in->len + 1);
+
+		ret = in->pre->f(prog->dev, slot->ah, &slot->cmd);
+		if (ret)
+			goto out;
+	}
+
+	ret = send_insn(prog, slot);
+	if (ret > 0)
+		return 1;
+	ret = ret ? ret : -EIO;
+out:
+	if (ret < 0)
+		vfi_log(VFI_LOG_ERR, "%s: %s failed. Error is %d", __func__,
+			prog->arena.p + in->cmd, ret);
+	free_slot(slot);
+	return VFI_RESULT(ret < 0 ? ret : 0);
+}
+
+/*
+ * Retire one command of the @n in flight and return its slot, or -1
+ * if the driver could not be read. With a dispatcher elsewhere we
+ * wait for the oldest. Reading the replies ourselves we take
+ * whichever comes first, matched by tag against the window so a
+ * stray reply is never taken for a handle.
+ */
+static int retire_one(struct vfi_program *prog, struct run_slot **win, int n,
+		      int flags, int *retired)
+{
+	struct vfi_async_handle *ah = NULL;
+	char *result = NULL;
+	void *e = NULL;
+	int i, ret;
+
+	if (!(flags & VFI_RUN_DISPATCH)) {
+		vfi_wait_async_handle(win[0]->ah, &result, &e);
+		*retired = 0;
+		return retire_insn(prog, win[0], result, e);
+	}
+
+	for (;;) {
+		ret = vfi_get_result(prog->dev, &result);
+		if (ret <= 0) {
+			*retired = -1;
+			return VFI_RESULT(ret ? ret : -EIO);
+		}
+
+		vfi_get_hex_arg(result, "reply", (long *)&ah);
+		for (i = 0; i < n; i++)
+			if (win[i]->ah == ah)
+				break;
+		if (i < n)
+			break;
+
+		vfi_log(VFI_LOG_ERR, "%s: Unmatched reply %s", __func__, result);
+		free(result);
+		result = NULL;
+	}
+
+	e = vfi_set_async_handle(ah, NULL);
+	vfi_set_async_handle(ah, e);
+	*retired = i;
+	return retire_insn(prog, win[i], result, e);
+}
+
+/* Move the slot retired from window position @r of @n to the free end. */
+static void retire_slot(struct run_slot **win, int r, int n)
+{
+	struct run_slot *slot = win[r];
+
+	memmove(&win[r], &win[r+1], (n - r - 1) * sizeof(*win));
+	win[n - 1] = slot;
+}
+
+static int conflicts(struct vfi_insn *a, struct vfi_insn *b)
+{
+	int i, j;
+
+	if (a->barrier || b->barrier)
+		return 1;
+	for (i = 0; i < a->nwr; i++) {
+		for (j = 0; j < b->nwr; j++)
+			if (a->wr[i] == b->wr[j])
+				return 1;
+		for (j = 0; j < b->nrd; j++)
+			if (a->wr[i] == b->rd[j])
+				return 1;
+	}
+	for (i = 0; i < a->nrd; i++)
+		for (j = 0; j < b->nwr; j++)
+			if (a->rd[i] == b->wr[j])
+				return 1;
+	return 0;
+}
+
+int vfi_run_program_parallel(struct vfi_program *prog, int depth, int flags)
+{
+	struct rep_frame loops[REPEAT_DEPTH];
+	struct rep_frame *f;
+	struct rep_loop *loop;
+	struct run_slot **win;
+	struct run_slot *slots;
+	struct vfi_insn *in;
+	int n = 0;
+	int sp = 0;
+	int i, j, r, edge, ret = 0;
+
+	if (depth < 1)
+		depth = 1;
+	/*
+	 * Slots stay put, as a pre command may keep the address of the
+	 * command in its slot. The window orders them, in flight first.
+	 */
+	win = calloc(depth, sizeof(*win) + sizeof(*slots));
+	if (win == NULL)
+		return VFI_RESULT(-ENOMEM);
+	slots = (struct run_slot *)(win + depth);
+	for (i = 0; i < depth; i++)
+		win[i] = &slots[i];
+
+	/*
+	 * Issue in program order. A command waits while the window is
+	 * full or it conflicts with one still in flight. The start and
+	 * end of each iteration of a repeat block wait for everything in
+	 * flight, so an iteration is timed over all its commands.
+	 */
+	for (i = 0; !ret && !vfi_dev_done(prog->dev); ) {
+		f = sp ? &loops[sp - 1] : NULL;
+		loop = f ? prog->insn[f->idx].loop : NULL;
+		in = i < prog->n ? &prog->insn[i] : NULL;
+		j = n;
+		if (loop && i == loop->end)
+			edge = 1;
+		else if (in == NULL)
+			break;
+		else if ((edge = in->loop != NULL) == 0)
+			for (j = 0; j < n; j++)
+				if (conflicts(in, win[j]->in))
+					break;
+
+		if (n == depth || j < n || (n && edge)) {
+			ret = retire_one(prog, win, n, flags, &r);
+			if (r < 0)
+				break;
+			if (ret == 1) {
+				ret = 0;
+				continue;
+			}
+			retire_slot(win, r, n--);
+			continue;
+		}
+
+		if (loop && i == loop->end) {
+			end_iteration(f, &loop->stats);
+			if (++f->iter < loop->count) {
+				start_iteration(f, loop->rate);
+				i = f->idx + 1;
+			}
+			else
+				sp--;
+			continue;
+		}
+
+		if (edge) {
+			memset(&in->loop->stats, 0, sizeof(in->loop->stats));
+			in->loop->stats.rate = in->loop->rate;
+			if (sp == 0)
+				prog->top = in->loop;
+			if (in->loop->count == 0 || in->loop->end == i + 1) {
+				i = in->loop->end;
+				continue;
+			}
+			f = &loops[sp++];
+			memset(f, 0, sizeof(*f));
+			f->idx = i++;
+			start_iteration(f, in->loop->rate);
+			continue;
+		}
+
+		ret = issue_insn(prog, in, win[n]);
+		if (ret > 0) {
+			n++;
+			ret = 0;
+		}
+		i++;
+	}
+
+	/* Drain, keeping the first error. */
+	while (n) {
+		r = retire_one(prog, win, n, flags, &j);
+		if (j < 0) {
+			ret = ret ? ret : r;
+			break;
+		}
+		if (r == 1)
+			continue;
+		if (r && !ret)
+			ret = r;
+		retire_slot(win, j, n--);
+	}
+
+	/* Abandoned if the driver stopped answering. */
+	for (j = 0; j < n; j++)
+		free_slot(win[j]);
+
+	free(win);
+	return VFI_RESULT(ret);
+}
+
+int vfi_run_program(struct vfi_program *prog, int flags)
+{
+	return vfi_run_program_parallel(prog, 1, flags);
+}
+
+int vfi_alloc_map(struct vfi_map **mapp, char *name)
+{
+	struct vfi_map *map = calloc(1,sizeof(*map)+strlen(name)+1);
+	if (map == NULL)
+		return VFI_RESULT(-ENOMEM);
+
+	strcpy(map->name_buf, name);
+	map->name = map->name_buf;
+	*mapp = map;
+	return 0;
+}
+
+/*
+ * Map memory. Plain maps come from the heap. Huge page and NUMA placed
+ * maps are anonymous mmaps, trimmed to the alignment wanted, so that
+ * madvise() and mbind() apply to whole pages of their own.
+ */
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#define HUGE_SIZE (2 << 20)
+
+/* The default huge page size, as /proc/meminfo has it, else 2MiB */
+static long huge_size(void)
+{
+	static long size;
+	long kb, got = __atomic_load_n(&size, __ATOMIC_RELAXED);
+	char line[128];
+	FILE *f;
+
+	if (got)
+		return got;
+	got = HUGE_SIZE;
+	if (f = fopen("/proc/meminfo", "r")) {
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "Hugepagesize: %ld kB", &kb) == 1) {
+				if (kb > 0 && !(kb & (kb - 1)))
+					got = kb << 10;
+				break;
+			}
+		fclose(f);
+	}
+	__atomic_store_n(&size, got, __ATOMIC_RELAXED);
+	return got;
+}
+
+/*
+ * An mmap() is aligned to @page, the page size of the mapping, so only
+ * a larger @align needs padding, and that is whole pages of @page.
+ */
+static void *map_anon(long len, long align, long page, int flags)
+{
+	long pad = align > page ? align : 0;
+	char *p, *a;
+
+	p = mmap(NULL, len + pad, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	if (pad == 0)
+		return p;
+
+	a = (char *)(((unsigned long)p + align - 1) & ~(align - 1));
+	if (a > p)
+		munmap(p, a - p);
+	if (pad > a - p)
+		munmap(a + len, pad - (a - p));
+	return a;
 }
 
-int vfi_get_offset(char *str, long long *offset)
+int vfi_alloc_map_mem(struct vfi_map *map, long extent, int flags, long align, int node)
 {
-	char *off = strstr(str,"#");
-	if (off) {
-		if (sscanf(off,"#%llx",offset) == 1) {
-			return 0;
+	unsigned long mask[16];
+	int bits = 8 * sizeof(mask[0]);
+	long page = getpagesize();
+	long len = extent;
+	void *mem = NULL;
+	int err;
+
+	if (extent <= 0 || align < 0 || (align & (align - 1)) || node >= 16 * bits - 1)
+		return VFI_RESULT(-EINVAL);
+
+	if (!(flags & VFI_MAP_HUGEPAGE) && node < 0) {
+		if (align > 2 * sizeof(void *)) {
+			if (err = posix_memalign(&mem, align, extent))
+				return VFI_RESULT(-err);
 		}
+		else if ((mem = malloc(extent)) == NULL)
+			return VFI_RESULT(-ENOMEM);
+		map->alloc = VFI_MAP_ALLOC_HEAP;
+		goto done;
 	}
-	return VFI_RESULT(-EINVAL);
-}
 
-int vfi_get_location(char *str, char **loc)
-{
-	int start;
-	start = strcspn(str,".");
-	if (start) {
-		start++;
-		if (sscanf(str+start,"%a[^?=/#:]",loc) == 1) {
-			return 0;
+	if (flags & VFI_MAP_HUGEPAGE) {
+		long huge = huge_size();
+
+		len = (extent + huge - 1) & ~(huge - 1);
+		mem = map_anon(len, align, huge, MAP_HUGETLB);
+		if (mem == NULL) {
+			/* no huge pages reserved, ask for transparent ones */
+			mem = map_anon(len, align > huge ? align : huge, page, 0);
+			if (mem)
+				madvise(mem, len, MADV_HUGEPAGE);
 		}
 	}
-	return VFI_RESULT(-EINVAL);
+	else {
+		len = (extent + page - 1) & ~(page - 1);
+		mem = map_anon(len, align, page, 0);
+	}
+	if (mem == NULL)
+		return VFI_RESULT(-ENOMEM);
+
+	if (node >= 0) {
+		memset(mask, 0, sizeof(mask));
+		mask[node / bits] |= 1UL << (node % bits);
+		if (syscall(SYS_mbind, mem, len, MPOL_BIND, mask, 16 * bits, 0)) {
+			err = -errno;
+			vfi_log(VFI_LOG_ERR, "%s: mbind to node %d failed. Error is %d", __func__, node, err);
+			munmap(mem, len);
+			return VFI_RESULT(err);
+		}
+	}
+	map->alloc = VFI_MAP_ALLOC_MMAP;
+done:
+	map->mem = mem;
+	map->extent = extent;
+	map->alloc_extent = len;
+	if (flags & (VFI_MAP_PREFAULT | VFI_MAP_LOCK))
+		return vfi_pin_map(map, flags);
+	return 0;
 }
 
-int vfi_get_name_location(char *str, char **name, char **loc)
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+int vfi_pin_map(struct vfi_map *map, int flags)
 {
-	char *start;
-	start = strstr(str,"://");
-	if (start) {
-		start += 3;
-		if (sscanf(start,"%a[^.?=/#:].%a[^?=/#:]",name,loc) > 0) {
-			return 0;
+	long page = getpagesize();
+	volatile char *p;
+	long i;
+	int err;
+
+	if (map->mem == NULL || map->mem == MAP_FAILED)
+		return VFI_RESULT(-EINVAL);
+
+	if ((flags & VFI_MAP_PREFAULT) && !(flags & VFI_MAP_LOCK)) {
+		/* madvise wants a page aligned start */
+		p = (char *)((unsigned long)map->mem & ~(page - 1));
+		if (madvise((void *)p, (char *)map->mem + map->extent - p, MADV_POPULATE_WRITE)) {
+			/* older kernel, touch each page keeping its contents */
+			p = map->mem;
+			for (i = 0; i < map->extent; i += page)
+				p[i] = p[i];
+			if (map->extent)
+				p[map->extent - 1] = p[map->extent - 1];
 		}
 	}
-	return VFI_RESULT(-EINVAL);
+	if ((flags & VFI_MAP_LOCK) && mlock(map->mem, map->extent)) {
+		err = -errno;
+		vfi_log(VFI_LOG_ERR, "%s: mlock of %s failed. Error is %d", __func__, map->name, err);
+		return VFI_RESULT(err);
+	}
+	map->flags |= flags & (VFI_MAP_PREFAULT | VFI_MAP_LOCK);
+	return 0;
 }
 
-int vfi_parse_ternary_op(char *str, char **cmd, char **xfer, char **dest, char **src)
+/*
+ * Multi buffered maps. Each buffer is free, being filled, ready or
+ * held by the consumer. Buffers are few, so finding one is a scan;
+ * ready buffers carry a sequence number so the consumer always gets
+ * the one filled first.
+ */
+struct map_ring {
+	pthread_mutex_t lock;
+	unsigned long seq;
+	int next;		/* where the producer looks first */
+	struct {
+		unsigned long seq;
+		int state;
+	} b[];
+};
+
+int vfi_map_set_buffers(struct vfi_map *map, int buffers)
 {
-	return sscanf(str,"%a[^:]://%a[^/]/%a[^=]=%a[^\n]",cmd,xfer,dest,src);
+	struct map_ring *ring;
+
+	if (buffers < 1 || map->extent % buffers)
+		return VFI_RESULT(-EINVAL);
+
+	ring = calloc(1, sizeof(*ring) + buffers * sizeof(ring->b[0]));
+	if (ring == NULL)
+		return VFI_RESULT(-ENOMEM);
+	pthread_mutex_init(&ring->lock, NULL);
+
+	if (map->ring) {
+		pthread_mutex_destroy(&((struct map_ring *)map->ring)->lock);
+		free(map->ring);
+	}
+	map->ring = ring;
+	map->buffers = buffers;
+	map->buffer_extent = map->extent / buffers;
+	return 0;
 }
 
-int vfi_parse_unary_op(char *str, char **cmd, char **desc)
+static int map_index(struct vfi_map *map, void *buf)
 {
-	return sscanf(str,"%a[^:]://%a[^\n]",cmd,desc);
+	long off = (char *)buf - (char *)map->mem;
+
+	if (off < 0 || off >= map->extent || off % map->buffer_extent)
+		return VFI_RESULT(-EINVAL);
+	return off / map->buffer_extent;
 }
 
-int vfi_parse_desc(char *str, char **name, char **location, int *offset, int *extent, char **opts)
+/* Move a buffer from one state to the next, choosing one if @i < 0. */
+static int map_move(struct vfi_map *map, int i, int from, int to, void **buf)
 {
-	char *p, *q;
-	int cnt;
-
-	cnt = sscanf(str,"%a[^?]?%a[^\n]",&p,opts);
-
-	cnt = sscanf(p,"%a[^.#:].%a[^#:]%a[^\n]",name,location,&q);
-	free(p);
-	p = NULL;
-
-	switch (cnt) {
-	case 1:
-		free(q);
-		sscanf(*name,"%a[^#:]",&p,&q);
-		free(*name);
-		*name = p;
-	case 3:
-		cnt = 0;
-		cnt += sscanf(q,"#%llx:%lx",offset,extent);
-		cnt++;
-		cnt += sscanf(q,":%lx#%llx",extent,offset);
-		break;
-	case 2:
-		cnt = 0;
-	default:
-		break;
+	struct map_ring *ring = map->ring;
+	int j, n = map->buffers;
+
+	if (ring == NULL) {
+		if (buf)
+			*buf = map->mem;
+		return 0;
 	}
-	
-	free(q);
 
-	return cnt;
+	pthread_mutex_lock(&ring->lock);
+	if (i < 0 && from == VFI_BUF_FREE) {
+		for (j = 0; j < n; j++)
+			if (ring->b[(ring->next + j) % n].state == VFI_BUF_FREE)
+				break;
+		i = j < n ? (ring->next + j) % n : -1;
+		if (i >= 0)
+			ring->next = (i + 1) % n;
+	}
+	else if (i < 0) {
+		for (j = 0; j < n; j++)
+			if (ring->b[j].state == from &&
+			    (i < 0 || ring->b[j].seq < ring->b[i].seq))
+				i = j;
+	}
+	else if (ring->b[i].state != from &&
+		 !(from == VFI_BUF_BUSY && ring->b[i].state == VFI_BUF_READY))
+		i = -EINVAL;
+
+	if (i >= 0) {
+		ring->b[i].state = to;
+		if (to == VFI_BUF_READY)
+			ring->b[i].seq = ++ring->seq;
+		if (buf)
+			*buf = (char *)map->mem + i * map->buffer_extent;
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	if (i == -1)
+		return -EAGAIN;
+	return VFI_RESULT(i);
 }
 
-struct vfi_dev {
-	int fd;
-	FILE *file;
-	aio_context_t ctx;
-	int to;
-	int done;
-	struct vfi_npc *funcs;
-	struct vfi_npc *maps;
-	struct vfi_npc *events;
-	struct vfi_cmd_elem *pre_commands;
-	struct vfi_cmd_elem *post_commands;
-};
+int vfi_map_get_free(struct vfi_map *map, void **buf)
+{
+	return map_move(map, -1, VFI_BUF_FREE, VFI_BUF_FILLING, buf);
+}
 
-struct vfi_cmd_elem {
-	struct vfi_cmd_elem *next;
-	int (*f) (struct vfi_dev *, struct vfi_async_handle *, char **);
-	int size;
-	char *cmd;		/* this is the name of the command is self->b */
-	char b[];		/* Holds the name of the card, pointed
-				 * to by cmd above. */
-};
+int vfi_map_put_ready(struct vfi_map *map, void *buf)
+{
+	int i;
 
-struct vfi_npc {
-	struct vfi_npc *next;
-	char *name;		/* name of closure self->b */
-	int size;		/* size of name */
-	void *e;		/* closure */
-	char b[];		/* buffer for name */
-};
+	if (map->ring == NULL)
+		return 0;
+	if ((i = map_index(map, buf)) < 0)
+		return VFI_RESULT(i);
+	i = map_move(map, i, VFI_BUF_FILLING, VFI_BUF_READY, NULL);
+	return VFI_RESULT(i < 0 ? i : 0);
+}
+
+int vfi_map_get_ready(struct vfi_map *map, void **buf)
+{
+	return map_move(map, -1, VFI_BUF_READY, VFI_BUF_BUSY, buf);
+}
+
+int vfi_map_put_free(struct vfi_map *map, void *buf)
+{
+	int i;
+
+	if (map->ring == NULL)
+		return 0;
+	if ((i = map_index(map, buf)) < 0)
+		return VFI_RESULT(i);
+	i = map_move(map, i, VFI_BUF_BUSY, VFI_BUF_FREE, NULL);
+	return VFI_RESULT(i < 0 ? i : 0);
+}
+
+int vfi_map_buffer_state(struct vfi_map *map, void *buf)
+{
+	struct map_ring *ring = map->ring;
+	int i;
+
+	if (ring == NULL)
+		return VFI_BUF_FREE;
+	if ((i = map_index(map, buf)) < 0)
+		return VFI_RESULT(i);
+
+	pthread_mutex_lock(&ring->lock);
+	i = ring->b[i].state;
+	pthread_mutex_unlock(&ring->lock);
+	return i;
+}
 
 /*
- * Generalize input of command strings from multiple sources, command
- * line parameters (inputs), stream read (from files or stdin).
+ * Streaming ring maps. The map's memory is mapped twice, back to back,
+ * so any run of up to the ring's size starting anywhere in the first
+ * copy is contiguous. The producer and consumer each own one index,
+ * on a cache line of its own, and only read the other's, so a single
+ * producer and a single consumer need no lock.
  */
-static int get_file(void **s, char **command)
+struct vfi_stream {
+	unsigned long head __attribute__((aligned(64)));	/* bytes produced */
+	unsigned long tail __attribute__((aligned(64)));	/* bytes consumed */
+	long size __attribute__((aligned(64)));
+	long chunk;
+};
+
+int vfi_map_set_stream(struct vfi_map *map, long chunk)
 {
-	int ret;
-	FILE *fp = *s;
-	do {
-		if (fp == stdin)
-			printf("[VFI]$ ");
+	struct vfi_stream *stream;
 
-		ret = fscanf(fp, " %a[^\n]", command);
+	if (chunk <= 0 || chunk > map->extent || map->extent % chunk)
+		return VFI_RESULT(-EINVAL);
 
-		if (ret == EOF) {
-			free(*command);
-			*command = NULL;
-			return 0;
-		}
-			
-		if (**command == '#') {
-			free(*command);
-			ret = 0;
+	if (posix_memalign((void **)&stream, 64, sizeof(*stream)))
+		return VFI_RESULT(-ENOMEM);
+	memset(stream, 0, sizeof(*stream));
+	stream->size = map->extent;
+	stream->chunk = chunk;
+	free(map->stream);
+	map->stream = stream;
+	return 0;
+}
+
+int vfi_alloc_ring_mem(struct vfi_map *map, long extent, int fd, long long offset)
+{
+	long page = getpagesize();
+	char *base;
+	int own = fd < 0;
+	int err = 0;
+
+	if (extent <= 0 || extent % page)
+		return VFI_RESULT(-EINVAL);
+
+	if (own) {
+		fd = syscall(SYS_memfd_create, map->name, 0);
+		if (fd < 0)
+			return VFI_RESULT(-errno);
+		if (ftruncate(fd, extent)) {
+			err = -errno;
+			close(fd);
+			return VFI_RESULT(err);
 		}
-	} while (ret == 0);
+	}
 
-	return ret;
+	/* reserve both copies then map the memory over each */
+	base = mmap(NULL, 2 * extent, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		err = -errno;
+	else if (mmap(base, extent, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		      fd, offset) == MAP_FAILED ||
+		 mmap(base + extent, extent, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		      fd, offset) == MAP_FAILED) {
+		err = -errno;
+		munmap(base, 2 * extent);
+	}
+	if (own)
+		close(fd);	/* the mappings keep the memory */
+	if (err) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to double map %s. Error is %d", __func__, map->name, err);
+		return VFI_RESULT(err);
+	}
+
+	map->mem = base;
+	map->extent = extent;
+	map->alloc = VFI_MAP_ALLOC_MMAP;
+	map->alloc_extent = 2 * extent;
+	return 0;
 }
 
-int vfi_setup_file(struct vfi_dev *dev, struct vfi_source **src,
-		     FILE * fp)
+long vfi_stream_space(struct vfi_map *map, void **p)
 {
-	struct vfi_source *h = malloc(sizeof(*h) + sizeof(void *));
-	*src = h;
+	struct vfi_stream *s = map->stream;
+	unsigned long tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
 
-	if (fp == NULL)
+	if (p)
+		*p = (char *)map->mem + s->head % s->size;
+	return s->size - (s->head - tail);
+}
+
+int vfi_stream_commit(struct vfi_map *map, long len)
+{
+	struct vfi_stream *s = map->stream;
+
+	if (len < 0 || len > vfi_stream_space(map, NULL))
 		return VFI_RESULT(-EINVAL);
+	__atomic_store_n(&s->head, s->head + len, __ATOMIC_RELEASE);
+	return 0;
+}
 
-	if (h == NULL)
-		return VFI_RESULT(-ENOMEM);
+long vfi_stream_claim(struct vfi_map *map, void **p)
+{
+	struct vfi_stream *s = map->stream;
+	unsigned long head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
 
-	h->f = get_file;
-	h->d = dev;
-	h->h[0] = (void *)fp;
+	if (p)
+		*p = (char *)map->mem + s->tail % s->size;
+	return head - s->tail;
+}
 
+int vfi_stream_release(struct vfi_map *map, long len)
+{
+	struct vfi_stream *s = map->stream;
+
+	if (len < 0 || len > vfi_stream_claim(map, NULL))
+		return VFI_RESULT(-EINVAL);
+	__atomic_store_n(&s->tail, s->tail + len, __ATOMIC_RELEASE);
 	return 0;
 }
 
-int vfi_teardown_file(struct vfi_source *src)
+long vfi_stream_chunk(struct vfi_map *map)
 {
-	free(src);
-	return 0;
+	return map->stream ? map->stream->chunk : 0;
 }
 
-int vfi_get_cmd(struct vfi_source *src, char **command)
+/*
+ * Per device arena for many small maps. One region is carved into
+ * power of 2 blocks and a freed block goes on the free list for its
+ * size, so getting and putting a block are list operations. The map
+ * headers come from a table of fixed size slots at the start of the
+ * region, which keeps them together rather than scattered over the
+ * heap.
+ */
+#define ARENA_MIN_SHIFT 6	/* 64 byte blocks */
+#define ARENA_MAX_SHIFT 20	/* 1MiB blocks */
+#define ARENA_CLASSES (ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1)
+#define ARENA_NAME 48		/* longest name a table slot holds */
+
+struct vfi_arena {
+	pthread_mutex_t lock;
+	struct vfi_map *region;
+	char *next;		/* blocks not yet carved */
+	char *end;
+	void *free[ARENA_CLASSES];
+	char *slots;
+	int slot_size;
+	int carved_slots;
+	void *free_slots;
+	struct vfi_arena_stats stats;
+};
+
+int vfi_arena_create(struct vfi_dev *dev, long size, int maps, int flags)
 {
-	free(*command);
-	*command = NULL;
+	struct vfi_arena *arena;
+	long page = getpagesize();
+	long table;
+	int err;
 
-	if (vfi_dev_done(src->d))
-		return 0;
-	return (src->f(src->h, command) > 0);
+	if (dev->arena)
+		return VFI_RESULT(-EEXIST);
+	if (size <= 0)
+		return VFI_RESULT(-EINVAL);
+	if (maps <= 0)
+		maps = size / page + 1;
+
+	arena = calloc(1, sizeof(*arena));
+	if (arena == NULL)
+		return VFI_RESULT(-ENOMEM);
+
+	arena->slot_size = (sizeof(struct vfi_map) + ARENA_NAME + 63) & ~63;
+	table = ((long)maps * arena->slot_size + page - 1) & ~(page - 1);
+
+	if ((err = vfi_alloc_map(&arena->region, "arena")) ||
+	    (err = vfi_alloc_map_mem(arena->region, table + size,
+				     flags & (VFI_MAP_HUGEPAGE | VFI_MAP_PREFAULT | VFI_MAP_LOCK),
+				     page, -1))) {
+		if (arena->region)
+			vfi_free_map(arena->region);
+		free(arena);
+		return VFI_RESULT(err);
+	}
+	pthread_mutex_init(&arena->lock, NULL);
+	arena->slots = arena->region->mem;
+	arena->next = arena->slots + table;
+	arena->end = arena->next + size;
+	arena->stats.size = size;
+	arena->stats.max_maps = maps;
+	dev->arena = arena;
+	return 0;
 }
 
-int vfi_alloc_map(struct vfi_map **mapp, char *name)
+static void arena_destroy(struct vfi_arena *arena)
 {
-	struct vfi_map *map = calloc(1,sizeof(*map)+strlen(name)+1);
+	pthread_mutex_destroy(&arena->lock);
+	vfi_free_map(arena->region);
+	free(arena);
+}
+
+int vfi_arena_alloc_map(struct vfi_dev *dev, struct vfi_map **mapp, char *name, long extent)
+{
+	struct vfi_arena *arena = dev->arena;
+	struct vfi_map *map;
+	long size, align;
+	void *mem;
+	int shift;
+
+	if (arena == NULL)
+		return VFI_RESULT(-ENODEV);
+	if (extent <= 0 || extent > 1L << ARENA_MAX_SHIFT || strlen(name) >= ARENA_NAME)
+		return VFI_RESULT(-ENOSPC);
+
+	shift = extent > 1 ? 64 - __builtin_clzl(extent - 1) : 0;
+	if (shift < ARENA_MIN_SHIFT)
+		shift = ARENA_MIN_SHIFT;
+	size = 1L << shift;
+	/* blocks are aligned to their size, up to a page */
+	align = size < getpagesize() ? size : getpagesize();
+
+	pthread_mutex_lock(&arena->lock);
+	if ((map = arena->free_slots))
+		arena->free_slots = *(void **)map;
+	else if (arena->carved_slots < arena->stats.max_maps)
+		map = (struct vfi_map *)(arena->slots + arena->carved_slots++ * arena->slot_size);
 	if (map == NULL)
-		return VFI_RESULT(-ENOMEM);
+		goto full;
+
+	if ((mem = arena->free[shift - ARENA_MIN_SHIFT])) {
+		arena->free[shift - ARENA_MIN_SHIFT] = *(void **)mem;
+		arena->stats.free_listed -= size;
+	}
+	else {
+		mem = (char *)(((unsigned long)arena->next + align - 1) & ~(align - 1));
+		if (size > arena->end - (char *)mem) {
+			*(void **)map = arena->free_slots;
+			arena->free_slots = map;
+			goto full;
+		}
+		arena->next = (char *)mem + size;
+		arena->stats.carved = arena->next - (arena->end - arena->stats.size);
+	}
+	arena->stats.in_use += size;
+	arena->stats.maps++;
+	pthread_mutex_unlock(&arena->lock);
 
+	memset(map, 0, sizeof(*map));
 	strcpy(map->name_buf, name);
 	map->name = map->name_buf;
+	map->mem = mem;
+	map->extent = extent;
+	map->alloc = VFI_MAP_ALLOC_ARENA;
+	map->alloc_extent = size;
+	map->arena = arena;
 	*mapp = map;
 	return 0;
+
+full:
+	pthread_mutex_unlock(&arena->lock);
+	return VFI_RESULT(-ENOSPC);
+}
+
+static void arena_free_map(struct vfi_map *map)
+{
+	struct vfi_arena *arena = map->arena;
+	int class = __builtin_ctzl(map->alloc_extent) - ARENA_MIN_SHIFT;
+
+	pthread_mutex_lock(&arena->lock);
+	*(void **)map->mem = arena->free[class];
+	arena->free[class] = map->mem;
+	*(void **)map = arena->free_slots;
+	arena->free_slots = map;
+	arena->stats.in_use -= map->alloc_extent;
+	arena->stats.free_listed += map->alloc_extent;
+	arena->stats.maps--;
+	pthread_mutex_unlock(&arena->lock);
+}
+
+int vfi_get_arena_stats(struct vfi_dev *dev, struct vfi_arena_stats *stats)
+{
+	struct vfi_arena *arena = dev->arena;
+
+	if (arena == NULL)
+		return VFI_RESULT(-ENODEV);
+
+	pthread_mutex_lock(&arena->lock);
+	*stats = arena->stats;
+	pthread_mutex_unlock(&arena->lock);
+	return 0;
+}
+
+int vfi_map_slice(struct vfi_dev *dev, struct vfi_map *parent, char *name,
+		  long long offset, long extent)
+{
+	struct vfi_map *map;
+	int err;
+
+	if (offset < 0 || extent <= 0 || parent->extent < offset + extent)
+		return VFI_RESULT(-EINVAL);
+
+	if (err = vfi_alloc_map(&map, name))
+		return VFI_RESULT(err);
+
+	map->mem = (char *)parent->mem + offset;
+	map->extent = extent;
+	map->alloc = VFI_MAP_ALLOC_NONE;
+	map->parent = parent;
+	if (err = vfi_register_map(dev, name, map)) {
+		free(map);
+		return VFI_RESULT(err);
+	}
+	__atomic_add_fetch(&parent->slices, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void vfi_free_map(struct vfi_map *map)
+{
+	if (map->slices) {
+		vfi_log(VFI_LOG_ERR, "%s: Map %s still has %d slices. Error is %d", __func__, map->name, map->slices, -EBUSY);
+		return;
+	}
+	if (map->ring) {
+		pthread_mutex_destroy(&((struct map_ring *)map->ring)->lock);
+		free(map->ring);
+	}
+	free(map->stream);
+	if (map->parent)
+		__atomic_sub_fetch(&map->parent->slices, 1, __ATOMIC_RELAXED);
+	if (map->alloc == VFI_MAP_ALLOC_ARENA) {
+		arena_free_map(map);
+		return;
+	}
+	if (map->flags & VFI_MAP_LOCK)
+		munlock(map->mem, map->extent);
+	if (map->alloc == VFI_MAP_ALLOC_HEAP)
+		free(map->mem);
+	else if (map->alloc == VFI_MAP_ALLOC_MMAP)
+		munmap(map->mem, map->alloc_extent);
+	free(map);
 }
 
 /*
@@ -297,6 +2291,7 @@ int vfi_find_event(struct vfi_dev *dev, char *name, void **e)
 /* Again, three lists in dev, funcs, maps, events. */
 int vfi_register_map(struct vfi_dev *dev, char *name, struct vfi_map *e)
 {
+	dev->gen++;
 	return vfi_register_npc(&dev->maps, name, e);
 }
 
@@ -304,6 +2299,7 @@ int vfi_register_func(struct vfi_dev *dev, char *name, void *func, int numin, in
 {
 	int ret = -ENOMEM;
 	struct {void *func; int numin; int numout;} *e = calloc(1,sizeof(*e));
+	dev->gen++;
 	if (e) {
 		e->func = func;
 		e->numin = numin;
@@ -323,6 +2319,7 @@ int vfi_register_func(struct vfi_dev *dev, char *name, void *func, int numin, in
 int vfi_register_event(struct vfi_dev *dev, char *name, void *e)
 {
 	int ret;
+	dev->gen++;
 	ret = vfi_register_npc(&dev->events, name, e);
 	if ( ret == -EEXIST )
 		return 0;
@@ -331,6 +2328,16 @@ int vfi_register_event(struct vfi_dev *dev, char *name, void *e)
 
 int vfi_unregister_map(struct vfi_dev *dev, char *name, struct vfi_map **e)
 {
+	struct vfi_map *map;
+	int ret;
+
+	/* a parent must outlive its slices, which point into it */
+	if (!vfi_find_map(dev,name,&map) && map->slices) {
+		ret = -EBUSY;
+		vfi_log(VFI_LOG_ERR, "%s: Map %s still has %d slices. Error is %d", __func__, name, map->slices, ret);
+		return VFI_RESULT(ret);
+	}
+	dev->gen++;
 	return vfi_unregister_npc(&dev->maps,name,(void **)e);
 }
 
@@ -339,6 +2346,7 @@ int vfi_unregister_func(struct vfi_dev *dev, char *name, void **func, int *numin
 	int ret;
 	struct {void *func; int numin; int numout;} *e;
 
+	dev->gen++;
 	if (ret = vfi_unregister_npc(&dev->funcs,name,(void *)&e))
 		return VFI_RESULT(ret);
 
@@ -349,13 +2357,50 @@ int vfi_unregister_func(struct vfi_dev *dev, char *name, void **func, int *numin
 	if (numout)
 		*numout = e->numout;
 
-	free(e);
-	return VFI_RESULT(0);
+	free(e);
+	return VFI_RESULT(0);
+}
+
+int vfi_unregister_event(struct vfi_dev *dev, char *name, void **e)
+{
+	dev->gen++;
+	return vfi_unregister_npc(&dev->events,name,e);
+}
+
+/*
+ * Compiled pipelines are kept by the text they were compiled from.
+ * The list owns them and frees them when the device is closed, with
+ * free() unless whoever compiled them says how.
+ */
+int vfi_register_pipe(struct vfi_dev *dev, char *name, void *pipe)
+{
+	return vfi_register_npc(&dev->pipes, name, pipe);
+}
+
+void vfi_set_pipe_free(struct vfi_dev *dev, void (*free_pipe)(void *pipe))
+{
+	dev->free_pipe = free_pipe;
+}
+
+int vfi_unregister_pipe(struct vfi_dev *dev, char *name, void **pipe)
+{
+	dev->gen++;
+	return vfi_unregister_npc(&dev->pipes, name, pipe);
+}
+
+int vfi_find_pipe(struct vfi_dev *dev, char *name, void **pipe)
+{
+	struct vfi_npc *npc;
+	if (vfi_find_npc(dev->pipes, name, &npc))
+		return -EINVAL;
+
+	*pipe = npc->e;
+	return 0;
 }
 
-int vfi_unregister_event(struct vfi_dev *dev, char *name, void **e)
+unsigned long vfi_dev_gen(struct vfi_dev *dev)
 {
-	return vfi_unregister_npc(&dev->events,name,e);
+	return dev->gen;
 }
 
 /*
@@ -363,6 +2408,16 @@ int vfi_unregister_event(struct vfi_dev *dev, char *name, void **e)
  * an async handle and a parameter string and return a void * allowing
  * the construction of closures.
  */
+static struct vfi_cmd_elem *find_cmd_elem(struct vfi_cmd_elem *commands, const char *buf, int size)
+{
+	struct vfi_cmd_elem *cmd;
+
+	for (cmd = commands; cmd && cmd->f; cmd = cmd->next)
+		if (size == cmd->size && !strncmp(buf, cmd->cmd, size))
+			return cmd;
+	return NULL;
+}
+
 int vfi_find_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah,
 		     struct vfi_cmd_elem *commands, char **buf)
 {
@@ -375,9 +2430,8 @@ int vfi_find_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah,
 	if (term) 
 		size = term - *buf;
 
-	for (cmd = commands; cmd && cmd->f; cmd = cmd->next)
-		if (size == cmd->size && !strncmp(*buf, cmd->cmd, size))
-			return cmd->f(dev, ah, buf);	
+	if ((cmd = find_cmd_elem(commands, *buf, size)))
+		return cmd->f(dev, ah, buf);	
 	return 0;
 }
 
@@ -443,23 +2497,42 @@ int vfi_register_pre_cmd(struct vfi_dev *dev, char *name,
 			   int (*f) (struct vfi_dev *,
 					struct vfi_async_handle *, char **))
 {
+	dev->gen++;
 	return vfi_register_cmd(&dev->pre_commands, name,f);
 }
 
 int vfi_unregister_pre_cmd(struct vfi_dev *dev, char *name)
 {
+	dev->gen++;
 	return vfi_unregister_cmd(&dev->pre_commands, name);
 }
 
+int vfi_bind_pre_cmd(struct vfi_dev *dev, char *name,
+		     int (*bind) (struct vfi_dev *, char *, void **),
+		     int (*run) (struct vfi_dev *, struct vfi_async_handle *,
+				 void *, char **))
+{
+	struct vfi_cmd_elem *c = find_cmd_elem(dev->pre_commands, name, strlen(name));
+
+	if (c == NULL)
+		return VFI_RESULT(-ENOENT);
+	dev->gen++;
+	c->bind = bind;
+	c->run = run;
+	return 0;
+}
+
 int vfi_register_post_cmd(struct vfi_dev *dev, char *name,
 			    int (*f) (struct vfi_dev *,
 					 struct vfi_async_handle *, char **))
 {
+	dev->gen++;
 	return vfi_register_cmd(&dev->post_commands, name,f);
 }
 
 int vfi_unregister_post_cmd(struct vfi_dev *dev, char *name)
 {
+	dev->gen++;
 	return vfi_unregister_cmd(&dev->post_commands, name);
 }
 
@@ -500,6 +2573,7 @@ struct vfi_async_handle {
 	sem_t wait_sem;
 	sem_t access_sem;
 	int count;
+	int retry;		/* see vfi_retry_async_handle() */
 };
 
 /* As a convenience the async handle can be passed the closure on its creation. */
@@ -531,6 +2605,21 @@ void *vfi_set_async_handle(struct vfi_async_handle *h,
 	return ret;
 }
 
+/* A closure asks for its command again by marking the handle, as
+ * any value it returns may be a pointer. */
+void vfi_retry_async_handle(struct vfi_async_handle *h)
+{
+	h->retry = 1;
+}
+
+int vfi_clear_retry_async_handle(struct vfi_async_handle *h)
+{
+	int retry = h->retry;
+
+	h->retry = 0;
+	return retry;
+}
+
 /* This is the synchronization call for a thread which returns the
  * result retrieved by the dispatcher loop and the closure lodged with
  * the handle. The return value is the handle if it is and remains
@@ -608,6 +2697,8 @@ struct vfi_async_handle *vfi_free_async_handle(struct vfi_async_handle *h)
 	return vfi_put_async_handle(h);
 }
 
+static int get_reply(struct vfi_dev *dev, char **result, struct vfi_async_handle **handle);
+
 /* This is the main function of any dispatch loop. Retrieve a result
  * from the driver, decode the reply handle, stash the result in the
  * handle and then post its semaphore to release the waiting thread. */
@@ -617,12 +2708,10 @@ int vfi_post_async_handle(struct vfi_dev *dev)
 	char *result = NULL;
 	struct vfi_async_handle *handle = NULL;
 
-	ret = vfi_get_result(dev, &result);
+	ret = get_reply(dev, &result, &handle);
 	if (ret <= 0)
 		return VFI_RESULT(ret);
 
-	ret = vfi_get_hex_arg(result, "reply", (long *)&handle);
-
 	if (handle && (handle->c == handle)) {
 		handle->result = result;
 		sem_post(&handle->wait_sem);
@@ -678,34 +2767,247 @@ void *vfi_make_post_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah,
  */
 int vfi_open(struct vfi_dev **device, char *dev_name, int timeout)
 {
-	struct vfi_dev *dev = calloc(1,sizeof(struct vfi_dev));
+	return vfi_open_mode(device, dev_name, timeout, 0);
+}
 
-	if (dev == NULL)
-		return VFI_RESULT(-ENOMEM);
+int vfi_open_mode(struct vfi_dev **device, char *dev_name, int timeout, int flags)
+{
+	int fd;
+	int ret;
 
 	if (dev_name == NULL)
 		dev_name = "/dev/vfi";
 
-	dev->to = timeout;
-	dev->fd = open(dev_name, (O_NONBLOCK | O_RDWR));
+	fd = open(dev_name, (O_NONBLOCK | O_RDWR));
 
-	if (dev->fd < 0) {
-		free(dev);
+	if (fd < 0)
 		return VFI_RESULT(-ENODEV);
+
+	if ((ret = vfi_open_fd(device, fd, timeout, flags)))
+		close(fd);
+
+	return VFI_RESULT(ret);
+}
+
+/*
+ * Ask for binary framing with a text command any driver can parse. A
+ * driver which does not know framing:// answers with an error, or
+ * not at all, and we carry on in text. The probe is tagged with the
+ * device, which no async handle can be, so its answer is told from
+ * any other reply, and one which comes after we gave up waiting is
+ * dropped by vfi_get_result() rather than taken for a command's.
+ */
+static void negotiate_binary(struct vfi_dev *dev)
+{
+	struct pollfd fd = { dev->fd, POLLIN, 0 };
+	char cmd[64];
+	char buf[1024];
+	long result = -1;
+	long tag;
+	int ret;
+
+	sprintf(cmd, "framing://binary?request(%lx)", (unsigned long)dev);
+	if (vfi_invoke_cmd_str(dev, cmd, 0) <= 0)
+		return;
+	dev->probe = (unsigned long)dev;
+
+	/* one reply per read, as read_msg() */
+	while (poll(&fd, 1, dev->to > 0 ? dev->to : 1000) > 0 &&
+	       (ret = read(dev->fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[ret] = '\0';
+		if (vfi_get_hex_arg(buf, "reply", &tag) || tag != dev->probe) {
+			vfi_log(VFI_LOG_ERR, "%s: Unmatched reply %s", __func__, buf);
+			continue;
+		}
+		dev->probe = 0;
+		if (vfi_get_dec_arg(buf, "result", &result) == 0 && result == 0)
+			dev->mode |= VFI_OPEN_BINARY;
+		return;
 	}
+}
+
+int vfi_open_fd(struct vfi_dev **device, int fd, int timeout, int flags)
+{
+	struct vfi_dev *dev = calloc(1,sizeof(struct vfi_dev));
 
+	if (dev == NULL)
+		return VFI_RESULT(-ENOMEM);
+
+	dev->to = timeout;
+	dev->fd = fd;
+	dev->notify_fd = -1;
 	dev->file = fdopen(dev->fd, "r+");
 
+	if (dev->file == NULL) {
+		free(dev);
+		return VFI_RESULT(-errno);
+	}
+
+	if ((flags & VFI_OPEN_MLOCKALL) && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		int err = -errno;
+		vfi_log(VFI_LOG_ERR, "%s: mlockall failed. Error is %d", __func__, err);
+		fclose(dev->file);
+		free(dev);
+		return VFI_RESULT(err);
+	}
+
+	if (flags & VFI_OPEN_BINARY)
+		negotiate_binary(dev);
+	dev->mode |= flags & VFI_OPEN_UNCHAIN;
+
+	vfi_get_fault_stats(dev, NULL);
 	*device = dev;
 	return 0;
 }
 
 void vfi_close(struct vfi_dev *dev)
 {
-	close(dev->fd);
+	struct vfi_program *prog;
+	struct vfi_npc *npc;
+
+	while ((prog = dev->programs)) {
+		dev->programs = prog->next;
+		vfi_free_program(prog);
+	}
+	while ((npc = dev->pipes)) {
+		dev->pipes = npc->next;
+		if (dev->free_pipe)
+			dev->free_pipe(npc->e);
+		else
+			free(npc->e);
+		free(npc);
+	}
+	if (dev->arena)
+		arena_destroy(dev->arena);
+	fclose(dev->file);
 	free(dev);
 }
 
+int vfi_dev_binary(struct vfi_dev *dev)
+{
+	return (dev->mode & VFI_OPEN_BINARY) != 0;
+}
+
+int vfi_dev_unchain(struct vfi_dev *dev)
+{
+	return (dev->mode & VFI_OPEN_UNCHAIN) != 0;
+}
+
+/*
+ * Retry with backoff for commands which the driver answers with "not
+ * yet", such as sync_wait. Delays double from a few microseconds up to
+ * a cap so a short wait costs little and a long one polls the driver
+ * rarely. If the application gives us a descriptor which the driver
+ * signals, any signal cuts the delay short.
+ */
+int vfi_set_notify_fd(struct vfi_dev *dev, int fd)
+{
+	dev->notify_fd = fd;
+	return 0;
+}
+
+void vfi_backoff_init(struct vfi_backoff *b, long first_us, long cap_us, long timeout_ms)
+{
+	b->delay_us = first_us > 0 ? first_us : 1;
+	b->cap_us = cap_us > b->delay_us ? cap_us : b->delay_us;
+	b->retries = 0;
+	clock_gettime(CLOCK_MONOTONIC, &b->start);
+	b->deadline_ns = timeout_ms > 0 ?
+		b->start.tv_sec * 1000000000LL + b->start.tv_nsec + timeout_ms * 1000000LL : 0;
+}
+
+static long long now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int vfi_backoff_wait(struct vfi_dev *dev, struct vfi_backoff *b)
+{
+	struct pollfd fd = { dev->notify_fd, POLLIN, 0 };
+	long long now = now_ns();
+	long long delay = b->delay_us * 1000LL;
+	struct timespec t;
+	unsigned long long count;
+
+	if (b->deadline_ns) {
+		if (now >= b->deadline_ns)
+			return VFI_RESULT(-ETIMEDOUT);
+		if (now + delay > b->deadline_ns)
+			delay = b->deadline_ns - now;
+	}
+
+	/* poll only counts in milliseconds, so sleep out shorter delays */
+	if (dev->notify_fd >= 0 && delay >= 1000000) {
+		if (poll(&fd, 1, delay / 1000000) > 0 && (fd.revents & POLLIN))
+			if (read(dev->notify_fd, &count, sizeof(count)) < 0)
+				; /* not an eventfd, or already drained */
+	}
+	else {
+		t.tv_sec = delay / 1000000000LL;
+		t.tv_nsec = delay % 1000000000LL;
+		while (nanosleep(&t, &t) && errno == EINTR)
+			;
+	}
+
+	b->retries++;
+	b->delay_us *= 2;
+	if (b->delay_us > b->cap_us)
+		b->delay_us = b->cap_us;
+	return 0;
+}
+
+long long vfi_backoff_done(struct vfi_dev *dev, struct vfi_backoff *b, int timedout)
+{
+	struct vfi_wait_stats *s = &dev->wait_stats;
+	long long ns = now_ns() - (b->start.tv_sec * 1000000000LL + b->start.tv_nsec);
+	long long max;
+
+	__atomic_add_fetch(&s->waits, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->retries, b->retries, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&s->total_ns, ns, __ATOMIC_RELAXED);
+	if (timedout)
+		__atomic_add_fetch(&s->timeouts, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->last_ns, ns, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return ns;
+}
+
+int vfi_get_wait_stats(struct vfi_dev *dev, struct vfi_wait_stats *stats)
+{
+	stats->waits = __atomic_load_n(&dev->wait_stats.waits, __ATOMIC_RELAXED);
+	stats->retries = __atomic_load_n(&dev->wait_stats.retries, __ATOMIC_RELAXED);
+	stats->timeouts = __atomic_load_n(&dev->wait_stats.timeouts, __ATOMIC_RELAXED);
+	stats->total_ns = __atomic_load_n(&dev->wait_stats.total_ns, __ATOMIC_RELAXED);
+	stats->max_ns = __atomic_load_n(&dev->wait_stats.max_ns, __ATOMIC_RELAXED);
+	stats->last_ns = __atomic_load_n(&dev->wait_stats.last_ns, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int vfi_get_fault_stats(struct vfi_dev *dev, struct vfi_fault_stats *stats)
+{
+	struct rusage ru;
+	long minflt, majflt;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return VFI_RESULT(-errno);
+
+	minflt = __atomic_exchange_n(&dev->minflt, ru.ru_minflt, __ATOMIC_RELAXED);
+	majflt = __atomic_exchange_n(&dev->majflt, ru.ru_majflt, __ATOMIC_RELAXED);
+	if (stats) {
+		stats->minor = ru.ru_minflt - minflt;
+		stats->major = ru.ru_majflt - majflt;
+	}
+	return 0;
+}
+
 int vfi_fileno(struct vfi_dev *dev)
 {
 	return dev->fd;
@@ -726,12 +3028,53 @@ int vfi_set_dev_done(struct vfi_dev *dev)
  * extract common parameters and values.
  */
 
-/* Boolean named options, str present is true absent is false. */
+/*
+ * Find option @name in the scanned string. Options start the string
+ * or follow a '?' or ',' so we only compare at those positions. On
+ * return @val and @len give the span of the value, if any. Returns -1
+ * if the option is not present, 0 if present but with no value, 1 if
+ * a value is present.
+ */
+static int find_arg(struct vfi_delims *d, char *name, int *val, int *len)
+{
+	int size = strlen(name);
+	int pos = 0;
+	int end;
+
+	for (;;) {
+		end = vfi_next_delim(d, pos, NULL);
+		if (end - pos == size && !strncmp(d->str + pos, name, size)) {
+			if (d->str[end] != '(')
+				return 0;
+			*val = end + 1;
+			*len = vfi_next_delim(d, *val, ")") - *val;
+			return *len > 0;
+		}
+		if (d->str[end] == '(')
+			end = vfi_next_delim(d, end, ")");
+		pos = vfi_next_delim(d, end, "?,");
+		if (pos >= d->len)
+			return -1;
+		pos++;
+	}
+}
+
+/*
+ * Boolean named options, str present is true absent is false. The
+ * option is matched whole, so ?lock is not found in ?unlock nor in a
+ * name or a value.
+ */
 int vfi_get_option(char *str, char *name)
 {
-	if (str && name)
-		return (strstr(str, name) != NULL);
-	return 0;
+	struct vfi_delims d;
+	int start, len;
+	int ret;
+
+	if (str == NULL || name == NULL || vfi_scan_delims(&d, str) < 0)
+		return 0;
+	ret = find_arg(&d, name, &start, &len) >= 0;
+	vfi_release_delims(&d);
+	return ret;
 }
 
 /* Get a str valued options opt_name(opt_value). Return -1 if the
@@ -739,36 +3082,75 @@ int vfi_get_option(char *str, char *name)
  * is present. */
 int vfi_get_str_arg(char *str, char *name, char **val)
 {
-	char *var = NULL;
+	struct vfi_delims d;
+	int start, len;
+	int ret;
 
 	*val = NULL;
 
-	if (str)
-		if ((var = strstr(str, name))) {
-			char *arg;
-			arg = var + strlen(name);
-			if (*arg == '(') {
-				sscanf(arg + 1, "%a[^)]", val);
-				return 1;
-			}
-			return 0;
-		}
+	if (str == NULL)
+		return VFI_RESULT(-1);
+
+	if (vfi_scan_delims(&d, str) < 0)
+		return VFI_RESULT(-ENOMEM);
+
+	ret = find_arg(&d, name, &start, &len);
+	if (ret > 0) {
+		*val = span_dup(str + start, len);
+		if (*val == NULL)
+			ret = -ENOMEM;
+	}
+
+	vfi_release_delims(&d);
+	return VFI_RESULT(ret);
+}
+
+/*
+ * Decode a numeric option value in place. The common hex and decimal
+ * bases go through the span codec, anything else is left to strtoul()
+ * which stops at the closing ')' by itself.
+ */
+static long decode_long(const char *s, int len, int base)
+{
+	unsigned long long uval;
+	long long val;
 
-	return VFI_RESULT(-1);
+	switch (base) {
+	case 16:
+		if (len && *s == '-') {
+			vfi_parse_hex(s + 1, len - 1, &uval);
+			return -(long)uval;
+		}
+		vfi_parse_hex(s, len, &uval);
+		return uval;
+	case 10:
+		vfi_parse_dec(s, len, &val);
+		return val;
+	default:
+		return strtoul(s, 0, base);
+	}
 }
 
 /* Retrieve a numeric valued option in various bases. */
 int vfi_get_long_arg(char *str, char *name, long *value, int base)
 {
-	char *val = NULL;
-	int ret;
-	ret = vfi_get_str_arg(str, name, &val);
-	if (ret > 0) {
-		*value = strtoul(val, 0, base);
-		free(val);
-		return 0;
+	struct vfi_delims d;
+	int start, len;
+	int ret = -1;
+
+	if (str == NULL)
+		return VFI_RESULT(-1);
+
+	if (vfi_scan_delims(&d, str) < 0)
+		return VFI_RESULT(-ENOMEM);
+
+	if (find_arg(&d, name, &start, &len) > 0) {
+		*value = decode_long(str + start, len, base);
+		ret = 0;
 	}
-	return VFI_RESULT(-1);
+
+	vfi_release_delims(&d);
+	return VFI_RESULT(ret);
 }
 
 /* 
@@ -803,39 +3185,132 @@ int vfi_poll_read(struct vfi_dev *dev)
 /* Read vfi device. Either block or if non-block and no result is
  * obtained, block with poll and re-read for result. Caller is
  * responsible for freeing returned result string. */
-int vfi_get_result(struct vfi_dev *dev, char **result)
+static int read_msg(struct vfi_dev *dev, char *buf, int size)
 {
 	int ret;
 
-	*result = malloc(1024);
-
-	if ( *result == NULL )
-		return VFI_RESULT(-ENOMEM);
-
-	ret = read(dev->fd, *result, 1024);
+	ret = read(dev->fd, buf, size);
 
 	while ((ret < 0 && errno == EAGAIN) || ret == 0 ) {
 		ret = vfi_poll_read(dev);
 		if (ret < 0)
-			goto out;
-		if (ret == 0) {
-			ret = -ETIMEDOUT;
-			goto out;
-		}
+			return VFI_RESULT(ret);
+		if (ret == 0)
+			return VFI_RESULT(-ETIMEDOUT);
 
-		ret = read(dev->fd, *result, 1024);
+		ret = read(dev->fd, buf, size);
 	}
 
-	if (ret) {
+	return VFI_RESULT(ret);
+}
+
+/*
+ * Read a binary reply frame and hand it back transcoded to text so
+ * the callers see the same result strings as ever. The reply tag is
+ * returned from the header, undecoded.
+ */
+static int get_frame_result(struct vfi_dev *dev, char **result, unsigned long long *tag)
+{
+	union {
+		struct vfi_frame f;
+		char b[VFI_FRAME_MAX];
+	} frame;
+	struct vfi_cmd_buf cb;
+	int ret;
+
+	*result = NULL;
+	ret = read_msg(dev, frame.b, sizeof(frame));
+	if (ret <= 0)
+		return VFI_RESULT(ret);
+
+	vfi_cmd_init(&cb);
+	if ((ret = vfi_frame_decode(frame.b, ret, &cb)))
+		goto out;
+
+	*tag = (frame.f.flags & VFI_FRAME_REPLY) ? frame.f.tag : 0;
+	*result = vfi_cmd_dup(&cb);
+	ret = *result ? cb.len : -ENOMEM;
+out:
+	vfi_cmd_release(&cb);
+	return VFI_RESULT(ret);
+}
+
+int vfi_get_result(struct vfi_dev *dev, char **result)
+{
+	unsigned long long tag;
+	int ret;
+
+	if (dev->mode & VFI_OPEN_BINARY)
+		return get_frame_result(dev, result, &tag);
+
+	*result = malloc(1024);
+
+	if ( *result == NULL )
+		return VFI_RESULT(-ENOMEM);
+
+	while ((ret = read_msg(dev, *result, 1023)) > 0) {
+		long tag;
+
 		(*result)[ret]='\0';
+		/* the answer to a framing probe we stopped waiting for */
+		if (dev->probe && !vfi_get_hex_arg(*result, "reply", &tag) &&
+		    tag == dev->probe) {
+			dev->probe = 0;
+			continue;
+		}
 		return VFI_RESULT(ret);
 	}
-out:
+
 	free (*result);
 	*result = NULL;
 	return VFI_RESULT(ret);
 }
 
+static int get_reply(struct vfi_dev *dev, char **result, struct vfi_async_handle **handle)
+{
+	unsigned long long tag;
+	int ret;
+
+	if (dev->mode & VFI_OPEN_BINARY) {
+		ret = get_frame_result(dev, result, &tag);
+		*handle = (struct vfi_async_handle *)(unsigned long)tag;
+		if (ret > 0 && tag == 0)
+			vfi_get_hex_arg(*result, "reply", (long *)handle);
+		return VFI_RESULT(ret);
+	}
+
+	ret = vfi_get_result(dev, result);
+	if (ret > 0)
+		vfi_get_hex_arg(*result, "reply", (long *)handle);
+	return VFI_RESULT(ret);
+}
+
+/*
+ * Transcode a text command to a frame and write it. Frames go
+ * straight to the descriptor, the stdio stream is always flushed so
+ * there is nothing buffered for them to overtake.
+ */
+static int send_frame(struct vfi_dev *dev, const char *cmd, int size)
+{
+	union {
+		struct vfi_frame f;
+		char b[VFI_FRAME_MAX];
+	} frame;
+	struct pollfd fd = { dev->fd, POLLOUT, 0 };
+	int len;
+	int ret;
+
+	len = vfi_frame_encode(cmd, size, frame.b, sizeof(frame));
+	if (len < 0)
+		return VFI_RESULT(len);
+
+	while ((ret = write(dev->fd, frame.b, len)) < 0 && errno == EAGAIN)
+		if ((ret = poll(&fd, 1, dev->to)) <= 0)
+			return VFI_RESULT(ret ? -errno : -ETIMEDOUT);
+
+	return ret < 0 ? VFI_RESULT(-errno) : size;
+}
+
 /*
  * The invoke cmd functions are really only of use on a non-blocking
  * vfi driver interface where the application wishes to continue
@@ -846,7 +3321,16 @@ out:
  */
 int vfi_invoke_cmd_ap(struct vfi_dev *dev, char *f, va_list ap)
 {
+	char cmd[VFI_FRAME_MAX];
 	int ret;
+
+	if (dev->mode & VFI_OPEN_BINARY) {
+		ret = vsnprintf(cmd, sizeof(cmd), f, ap);
+		if (ret >= sizeof(cmd))
+			return VFI_RESULT(-E2BIG);
+		return send_frame(dev, cmd, ret);
+	}
+
 	ret = vfprintf(dev->file, f, ap);
 	fflush(dev->file);
 	return ret;
@@ -867,6 +3351,10 @@ int vfi_invoke_cmd(struct vfi_dev *dev, char *f, ...)
 int vfi_invoke_cmd_str(struct vfi_dev *dev, char *cmd, int size)
 {
 	int ret;
+
+	if (dev->mode & VFI_OPEN_BINARY)
+		return send_frame(dev, cmd, size ? size : strlen(cmd));
+
 	if (size)
 		ret = fwrite(cmd, size, 1, dev->file);
 	else
@@ -877,6 +3365,63 @@ int vfi_invoke_cmd_str(struct vfi_dev *dev, char *cmd, int size)
 
 }
 
+/*
+ * Support for the typed command builders in vfi_api.h. Commands are
+ * built in a #vfi_cmd_buf which only leaves its inline storage for
+ * unusually long names.
+ */
+int vfi_cmd_grow(struct vfi_cmd_buf *cb, int n)
+{
+	int size = cb->size * 2;
+	char *p;
+
+	while (size <= cb->len + n + 1)
+		size *= 2;
+
+	if (cb->p == cb->b) {
+		p = malloc(size);
+		if (p)
+			memcpy(p, cb->b, cb->len + 1);
+	}
+	else
+		p = realloc(cb->p, size);
+
+	if (p == NULL)
+		return VFI_RESULT(-ENOMEM);
+
+	cb->p = p;
+	cb->size = size;
+	return 0;
+}
+
+void vfi_cmd_release(struct vfi_cmd_buf *cb)
+{
+	if (cb->p != cb->b)
+		free(cb->p);
+	cb->p = cb->b;
+	cb->size = sizeof(cb->b);
+}
+
+char *vfi_cmd_dup(struct vfi_cmd_buf *cb)
+{
+	char *p = malloc(cb->len + 1);
+	if (p)
+		memcpy(p, cb->p, cb->len + 1);
+	return p;
+}
+
+int vfi_invoke_cmd_buf(struct vfi_dev *dev, struct vfi_cmd_buf *cb)
+{
+	int ret;
+
+	if (vfi_cmd_lit(cb, "\n"))
+		return VFI_RESULT(-ENOMEM);
+
+	ret = vfi_invoke_cmd_str(dev, cb->p, cb->len);
+	cb->p[--cb->len] = '\0';
+	return VFI_RESULT(ret);
+}
+
 /* 
  * The do_cmd functions are designed to achieve the same blocking
  * semantics as a blocking interface while using a non-blocking driver
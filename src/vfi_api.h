@@ -48,6 +48,87 @@ struct vfi_dev;
  */
 extern int vfi_open(struct vfi_dev **dev, char *devname, int timeout);
 
+/**
+ * VFI_OPEN_BINARY:
+ *
+ * Flag for vfi_open_mode() asking the driver for binary framing of
+ * commands and replies. See #vfi_frame.
+ */
+#define VFI_OPEN_BINARY 0x1
+
+/**
+ * VFI_OPEN_MLOCKALL:
+ *
+ * Flag for vfi_open_mode() which locks all of the process's memory,
+ * present and future, with mlockall() so no map or stack page is
+ * faulted in or out once running. This applies to the whole process,
+ * not just the device, and needs a large enough RLIMIT_MEMLOCK.
+ */
+#define VFI_OPEN_MLOCKALL 0x2
+
+/**
+ * VFI_OPEN_UNCHAIN:
+ *
+ * Flag for vfi_open_mode() saying the driver implements
+ * event_unchain, see doc/ril.txt. Only then is a pipeline's chain of
+ * events, part made when a link fails, taken apart again.
+ */
+#define VFI_OPEN_UNCHAIN 0x4
+
+/**
+ * vfi_open_mode:
+ * @dev: a handle to be instantiated.
+ * @devname: as vfi_open().
+ * @timeout: as vfi_open().
+ * @flags: VFI_OPEN_* flags.
+ *
+ * As vfi_open() with options. With %VFI_OPEN_BINARY the driver is
+ * asked for binary framing when the device is opened. If it agrees,
+ * commands are transcoded to frames on the way out and replies back
+ * to text on the way in so all the string interfaces work
+ * unchanged. A driver which does not support framing leaves the
+ * device in text mode, see vfi_dev_binary(). The open waits for the
+ * driver's answer for up to @timeout milliseconds, a second when
+ * there is none, so a driver which never answers delays it that long.
+ * With %VFI_OPEN_MLOCKALL the open fails if the memory cannot be
+ * locked. %VFI_OPEN_UNCHAIN is taken as given, see vfi_dev_unchain().
+ *
+ * Returns: 0 on success, negative on errors.
+ */
+extern int vfi_open_mode(struct vfi_dev **dev, char *devname, int timeout, int flags);
+
+/**
+ * vfi_open_fd:
+ * @dev: a handle to be instantiated.
+ * @fd: an open non-blocking descriptor speaking the driver protocol.
+ * @timeout: as vfi_open().
+ * @flags: as vfi_open_mode().
+ *
+ * As vfi_open_mode() on a descriptor the caller has already opened,
+ * for example one end of a SOCK_SEQPACKET socketpair served by a
+ * user space stand in for the driver. The descriptor belongs to @dev
+ * on success and is closed by vfi_close().
+ *
+ * Returns: 0 on success, negative on errors.
+ */
+extern int vfi_open_fd(struct vfi_dev **dev, int fd, int timeout, int flags);
+
+/**
+ * vfi_dev_binary:
+ * @dev: the API device handle
+ *
+ * Returns: non zero if binary framing was agreed with the driver.
+ */
+extern int vfi_dev_binary(struct vfi_dev *dev);
+
+/**
+ * vfi_dev_unchain:
+ * @dev: the API device handle
+ *
+ * Returns: non zero if @dev was opened with %VFI_OPEN_UNCHAIN.
+ */
+extern int vfi_dev_unchain(struct vfi_dev *dev);
+
 /**
  * vfi_close:
  * @dev: handle of device to be closed and freed.
@@ -70,6 +151,131 @@ extern int vfi_fileno(struct vfi_dev *dev);
 extern int  vfi_dev_done(struct vfi_dev *dev);
 extern int vfi_set_dev_done(struct vfi_dev *dev);
 
+/**
+ * vfi_backoff:
+ * @delay_us: the next delay
+ * @cap_us: the longest delay
+ * @retries: retries so far
+ * @start: when the wait began
+ * @deadline_ns: CLOCK_MONOTONIC time to give up, 0 for never
+ *
+ * State of one retried wait, see vfi_backoff_init().
+ */
+struct vfi_backoff {
+	long delay_us;
+	long cap_us;
+	int retries;
+	struct timespec start;
+	long long deadline_ns;
+};
+
+/**
+ * vfi_wait_stats:
+ * @waits: waits finished
+ * @retries: retries over all waits
+ * @timeouts: waits which gave up at their deadline
+ * @total_ns: time spent over all waits
+ * @max_ns: longest wait
+ * @last_ns: most recent wait
+ *
+ * How long retried commands such as sync_wait really waited on a
+ * device, see vfi_get_wait_stats().
+ */
+struct vfi_wait_stats {
+	long waits;
+	long retries;
+	long timeouts;
+	long long total_ns;
+	long long max_ns;
+	long long last_ns;
+};
+
+/**
+ * vfi_set_notify_fd:
+ * @dev: the API device handle
+ * @fd: a descriptor, or -1 for none
+ *
+ * Gives the device a descriptor, typically an eventfd from
+ * vfi_get_eventfd(), which becomes readable when the driver has
+ * something new to say. Backoff delays of a millisecond or more then
+ * end as soon as it is signalled rather than when they run out. The
+ * descriptor remains the caller's.
+ *
+ * Returns: 0
+ */
+extern int vfi_set_notify_fd(struct vfi_dev *dev, int fd);
+
+/**
+ * vfi_backoff_init:
+ * @b: the backoff state
+ * @first_us: the first delay in microseconds
+ * @cap_us: the longest delay in microseconds
+ * @timeout_ms: overall deadline in milliseconds, 0 for none
+ *
+ * Starts a retried wait. Each vfi_backoff_wait() doubles the delay
+ * up to @cap_us.
+ */
+extern void vfi_backoff_init(struct vfi_backoff *b, long first_us, long cap_us, long timeout_ms);
+
+/**
+ * vfi_backoff_wait:
+ * @dev: the API device handle
+ * @b: the backoff state
+ *
+ * Waits before the next retry, never past the deadline, waking early
+ * if the device notification descriptor is signalled.
+ *
+ * Returns: 0 to retry, -ETIMEDOUT if the deadline has passed.
+ */
+extern int vfi_backoff_wait(struct vfi_dev *dev, struct vfi_backoff *b);
+
+/**
+ * vfi_backoff_done:
+ * @dev: the API device handle
+ * @b: the backoff state
+ * @timedout: non zero if the wait gave up
+ *
+ * Ends a retried wait and adds it to the device wait statistics.
+ *
+ * Returns: how long the wait took in nanoseconds.
+ */
+extern long long vfi_backoff_done(struct vfi_dev *dev, struct vfi_backoff *b, int timedout);
+
+/**
+ * vfi_get_wait_stats:
+ * @dev: the API device handle
+ * @stats: filled in with the totals so far
+ *
+ * Returns: 0
+ */
+extern int vfi_get_wait_stats(struct vfi_dev *dev, struct vfi_wait_stats *stats);
+
+/**
+ * vfi_fault_stats:
+ * @minor: page faults which needed no I/O, such as first touches
+ * @major: page faults which needed I/O
+ *
+ * Page faults taken by the process, see vfi_get_fault_stats().
+ */
+struct vfi_fault_stats {
+	long minor;
+	long major;
+};
+
+/**
+ * vfi_get_fault_stats:
+ * @dev: the API device handle
+ * @stats: filled in with the faults taken
+ *
+ * Reports the page faults the whole process took since @dev was
+ * opened or since the previous call, so that calls either side of a
+ * steady state run show the faults prefaulted and locked maps, see
+ * vfi_pin_map(), did not remove.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_get_fault_stats(struct vfi_dev *dev, struct vfi_fault_stats *stats);
+
 /**
  * vfi_source:
  * @f: function which is passed a pointer to @h[] and an input/output parameter @cmd
@@ -118,6 +324,118 @@ extern int vfi_setup_file(struct vfi_dev *dev, struct vfi_source **src,
  */
 extern int vfi_teardown_file(struct vfi_source *src);
 
+/**
+ * vfi_setup_mmap:
+ * @dev: api root object
+ * @src: the vfi_source handle to be initialized
+ * @path: the script file to be read
+ *
+ * A #vfi_source constructor which maps the script at @path rather
+ * than reading it. Commands can be retrieved as spans into the
+ * mapping with vfi_get_span(), without copying, or as allocated
+ * strings with vfi_get_cmd(). Comment lines, those starting with #,
+ * and blank lines are skipped as by vfi_setup_file().
+ *
+ * Returns: 0 if successful, negative errno if @path can't be opened
+ * or mapped or -ENOMEM.
+ */
+extern int vfi_setup_mmap(struct vfi_dev *dev, struct vfi_source **src, char *path);
+
+/**
+ * vfi_teardown_mmap:
+ * @src: a vfi_source made by vfi_setup_mmap()
+ *
+ * Unmaps the script and frees @src. Spans returned by vfi_get_span()
+ * are invalid after this call.
+ *
+ * Returns: 0 if successful.
+ */
+extern int vfi_teardown_mmap(struct vfi_source *src);
+
+/**
+ * vfi_get_span:
+ * @src: a source made by vfi_setup_mmap() or vfi_setup_repeat()
+ * @cmd: set to the start of the next command
+ * @len: set to the length of the command
+ *
+ * As vfi_get_cmd() but the command is returned in place. It is not
+ * NUL terminated and remains valid until the source is torn down.
+ *
+ * Returns: true if a command is returned, false at the end of the
+ * source, or -EINVAL if @src can't return spans.
+ */
+extern int vfi_get_span(struct vfi_source *src, const char **cmd, int *len);
+
+/**
+ * vfi_repeat_stats:
+ * @iterations: iterations completed
+ * @min_ns: shortest iteration
+ * @max_ns: longest iteration
+ * @total_ns: sum of the iteration times
+ * @elapsed_ns: from the start of the first iteration to the end of
+ * the last completed, including any pacing
+ * @rate: the requested rate in iterations a second, 0 if unpaced
+ *
+ * Timing of a repeat block, see vfi_setup_repeat().
+ */
+struct vfi_repeat_stats {
+	long iterations;
+	long long min_ns;
+	long long max_ns;
+	long long total_ns;
+	long long elapsed_ns;
+	double rate;
+};
+
+/**
+ * vfi_setup_repeat:
+ * @dev: api root object
+ * @src: the vfi_source handle to be initialized
+ * @in: the source to be filtered
+ *
+ * A #vfi_source which passes on the commands of @in and expands
+ * repeat blocks in it:
+ *
+ * <programlisting>
+ * repeat(N)[,rate(hz)] {
+ * commands...
+ * }
+ * </programlisting>
+ *
+ * The block, which may contain further repeat blocks, is read once
+ * and its commands are then returned N times from memory, both
+ * through vfi_get_cmd() and vfi_get_span(). With a rate, iterations
+ * start no faster than hz a second. Each iteration is timed from
+ * returning its first command until the command after its last is
+ * requested, see vfi_get_repeat_stats(). @in remains the caller's to
+ * tear down after @src.
+ *
+ * Given to vfi_compile_program(), blocks are compiled as loops over
+ * their compiled commands rather than expanded.
+ *
+ * Returns: 0 if successful or -ENOMEM.
+ */
+extern int vfi_setup_repeat(struct vfi_dev *dev, struct vfi_source **src, struct vfi_source *in);
+
+/**
+ * vfi_teardown_repeat:
+ * @src: a vfi_source made by vfi_setup_repeat()
+ *
+ * Returns: 0 if successful.
+ */
+extern int vfi_teardown_repeat(struct vfi_source *src);
+
+/**
+ * vfi_get_repeat_stats:
+ * @src: a vfi_source made by vfi_setup_repeat()
+ * @stats: the timing of the outermost repeat block being or last
+ * replayed
+ *
+ * Returns: 0 if successful or -EINVAL if there has been no repeat
+ * block.
+ */
+extern int vfi_get_repeat_stats(struct vfi_source *src, struct vfi_repeat_stats *stats);
+
 /**
  * vfi_get_cmd:
  * @src: a source closure prepared with a source
@@ -142,6 +460,125 @@ extern int vfi_teardown_file(struct vfi_source *src);
  */
 extern int vfi_get_cmd(struct vfi_source *src, char **cmd);
 
+/**
+ * vfi_program:
+ *
+ * An opaque type holding a compiled script. Each command in it is
+ * decoded once, with the pre command for its verb bound, and commands
+ * for the driver are kept ready to send. Made with
+ * vfi_compile_program() or vfi_load_program() and run with
+ * vfi_run_program().
+ */
+struct vfi_program;
+
+/**
+ * VFI_RUN_DISPATCH:
+ *
+ * Flag for vfi_run_program() when no thread is calling
+ * vfi_post_async_handle(). The program reads each reply itself.
+ */
+#define VFI_RUN_DISPATCH 0x1
+
+/**
+ * vfi_compile_program:
+ * @dev: api root object
+ * @src: the source of the script, as from vfi_setup_file() or
+ * vfi_setup_mmap()
+ * @prog: the compiled program
+ *
+ * Reads @src to the end and compiles each command. Repeat blocks of
+ * a source from vfi_setup_repeat() are kept as blocks, each compiled
+ * once and run as often as it says. The program is freed with
+ * vfi_free_program().
+ *
+ * Returns: 0 on success, -EINVAL for a repeat block which is malformed
+ * or not closed, -E2BIG if blocks nest too deep, or -ENOMEM.
+ */
+extern int vfi_compile_program(struct vfi_dev *dev, struct vfi_source *src,
+			       struct vfi_program **prog);
+
+/**
+ * vfi_load_program:
+ * @dev: api root object
+ * @path: the script file
+ * @prog: the compiled program
+ *
+ * As vfi_compile_program() for the script at @path, read through
+ * vfi_setup_repeat() so it may have repeat blocks, with the result
+ * cached on @dev. A later load of the same path returns the cached
+ * program unless the file has since been replaced or modified. Cached
+ * programs belong to @dev and are freed by vfi_close(), not by the
+ * caller.
+ *
+ * Returns: 0 on success, negative errno if @path can't be read or
+ * -ENOMEM.
+ */
+extern int vfi_load_program(struct vfi_dev *dev, char *path, struct vfi_program **prog);
+
+/**
+ * vfi_free_program:
+ * @prog: a program from vfi_compile_program()
+ */
+extern void vfi_free_program(struct vfi_program *prog);
+
+/**
+ * vfi_program_size:
+ * @prog: a compiled program
+ *
+ * Returns: the number of commands in @prog.
+ */
+extern int vfi_program_size(struct vfi_program *prog);
+
+/**
+ * vfi_get_program_stats:
+ * @prog: a compiled program
+ * @stats: the timing of the outermost repeat block being or last run
+ *
+ * As vfi_get_repeat_stats() for the repeat blocks of a program.
+ *
+ * Returns: 0 if successful or -EINVAL if no repeat block has run.
+ */
+extern int vfi_get_program_stats(struct vfi_program *prog, struct vfi_repeat_stats *stats);
+
+/**
+ * vfi_run_program:
+ * @prog: a compiled program
+ * @flags: VFI_RUN_* flags
+ *
+ * Runs each command of @prog in turn. The bound pre command is
+ * called and, unless it handles the command itself, the command is
+ * passed to the driver with a request tag and the reply waited for.
+ * The closure left on the handle by the pre command, if any, is
+ * invoked with the reply, otherwise the result() of the reply is
+ * checked. Stops at the first command which fails or when the device
+ * is done.
+ *
+ * Returns: 0 on success or the error of the failing command.
+ */
+extern int vfi_run_program(struct vfi_program *prog, int flags);
+
+/**
+ * vfi_run_program_parallel:
+ * @prog: a compiled program
+ * @depth: the most commands to have at the driver at once
+ * @flags: VFI_RUN_* flags
+ *
+ * As vfi_run_program() but independent commands are issued without
+ * waiting for the replies to those before them. When compiled, each
+ * command is given the set of maps, events and binds it reads and
+ * writes, from the names in it and what its verb does with them.
+ * Commands are issued in program order. A command waits while @depth
+ * are in flight or while one it conflicts with is, and the oldest in
+ * flight, or with %VFI_RUN_DISPATCH the first to reply, is retired to
+ * make way. Commands whose verb is not known, and the sync points
+ * location_find and sync_wait, wait for everything before them and
+ * hold back everything after, as does the start and end of each
+ * iteration of a repeat block.
+ *
+ * Returns: 0 on success or the first error.
+ */
+extern int vfi_run_program_parallel(struct vfi_program *prog, int depth, int flags);
+
 /**
  * vfi_async_handle:
  *
@@ -260,6 +697,26 @@ extern struct vfi_async_handle *vfi_free_async_handle(struct
  */
 extern void *vfi_set_async_handle(struct vfi_async_handle * h,
 				  void *e);
+/**
+ * vfi_retry_async_handle:
+ * @h: handle to #vfi_async_handle
+ *
+ * Called by a closure on the handle it was invoked with to ask for
+ * its command to be sent again on @h, as a wait does until the
+ * driver agrees. The program runner and the command server honour
+ * it whatever the closure returns.
+ */
+extern void vfi_retry_async_handle(struct vfi_async_handle *h);
+/**
+ * vfi_clear_retry_async_handle:
+ * @h: handle to #vfi_async_handle
+ *
+ * Clears the request of vfi_retry_async_handle(), for whoever invoked
+ * the closure.
+ *
+ * Returns: 1 if the command was asked for again, otherwise 0.
+ */
+extern int vfi_clear_retry_async_handle(struct vfi_async_handle *h);
 /**
  * vfi_wait_async_handle:
  * @h: handle of #vfi_async_handle to wait on
@@ -403,6 +860,30 @@ extern int vfi_register_pre_cmd(struct vfi_dev *dev, char *name,
  */
 extern int vfi_unregister_pre_cmd(struct vfi_dev *dev, char *name);
 
+/**
+ * vfi_bind_pre_cmd
+ * @dev: a #vfi_dev handle
+ * @name: the name string of a registered pre command
+ * @bind: parses a command once
+ * @run: runs a command as bound
+ *
+ * Gives the pre command @name a second form for compiled programs.
+ * @bind is passed the command and leaves in its last argument a
+ * single allocation holding the arguments, with the maps, events or
+ * pipes they name already looked up. It returns 0, or the error the
+ * pre command would have failed with. @run is then called in place of
+ * the pre command with that state and returns as the pre command
+ * would. It may set its last argument to a command to send in place
+ * of the compiled one. A program frees its states whenever vfi_dev_gen() changes, so
+ * nothing looked up is used once it could have gone.
+ *
+ * Returns: 0 if successful or -ENOENT if @name is not registered.
+ */
+extern int vfi_bind_pre_cmd(struct vfi_dev *dev, char *name,
+			    int (*bind) (struct vfi_dev *dev, char *cmd, void **state),
+			    int (*run) (struct vfi_dev *dev, struct vfi_async_handle *ah,
+					void *state, char **cmd));
+
 /**
  * vfi_register_post_cmd
  * @dev: an #vfi_dev handle
@@ -508,6 +989,18 @@ extern int vfi_unregister_func(struct vfi_dev *dev, char *name, void **func, int
  * @name: a pointer to a heap allocated name string
  * @mem: a void * to the virtual address of the mmap
  * @extent: the size of the mmap in bytes.
+ * @buffers: number of buffers @mem is divided into, 0 or 1 if single buffered
+ * @buffer_extent: the size of each buffer
+ * @ring: private ownership state of the buffers
+ * @digest_algo: the VFI_CHECKSUM_ algorithm of @digest, 0 if none taken
+ * @digest: the last checksum taken of the map, see vfi_checksum_map()
+ * @alloc: how @mem was allocated, one of the VFI_MAP_ALLOC_ kinds
+ * @alloc_extent: the size of the allocation, which may exceed @extent
+ * @flags: the VFI_MAP_ flags applied to @mem, see vfi_pin_map()
+ * @arena: the arena @mem and the map came from, see vfi_arena_alloc_map()
+ * @stream: private producer and consumer state of a ring map, see vfi_map_set_stream()
+ * @parent: the map this one is a slice of, see vfi_map_slice()
+ * @slices: number of slices of this map
  * @name_buf: the name buffer pointed to by @name
  *
  * This structure is used to provide a closure structure for use with vfi_register_map() and vfi_find_map().
@@ -517,6 +1010,18 @@ struct vfi_map {
 	char *name;
 	void *mem;
 	long extent;
+	int buffers;
+	long buffer_extent;
+	void *ring;
+	int digest_algo;
+	unsigned long long digest;
+	int alloc;
+	long alloc_extent;
+	int flags;
+	struct vfi_arena *arena;
+	struct vfi_stream *stream;
+	struct vfi_map *parent;
+	int slices;
 	char name_buf[];
 };
 
@@ -532,128 +1037,553 @@ struct vfi_map {
 extern int vfi_alloc_map(struct vfi_map **map, char *name);
 
 /**
- * vfi_register_map
- * @dev: the #vfi_dev handle with the list head of maps
- * @name: the name of the map
- * @map: the closure representing the map
- *
- * This function adds a closure representing an API map to the @dev's
- * list of maps
+ * VFI_MAP_ALLOC_NONE:
  *
- * Returns: 0 on success otherwise error
+ * The map does not own its memory, see vfi_free_map().
  */
-extern int vfi_register_map(struct vfi_dev *dev, char *name, struct vfi_map *map);
+#define VFI_MAP_ALLOC_NONE 0
 
 /**
- * vfi_unregister_map
- * @dev: the #vfi_dev handle with the list head of maps
- * @name: the name of the map
- * @map: returns the closure of the unregistered map
+ * VFI_MAP_ALLOC_HEAP:
  *
- * This function removes a closure representing an API map from the @dev's
- * list of maps
- *
- * Returns: 0 on success otherwise error
+ * The map's memory came from malloc() or posix_memalign().
  */
-extern int vfi_unregister_map(struct vfi_dev *dev, char *name, struct vfi_map **map);
+#define VFI_MAP_ALLOC_HEAP 1
 
 /**
- * vfi_register_event
- * @dev: the #vfi_dev handle with the list head of maps
- * @name: the name of the map
- * @e: the closure representing the event
- *
- * This function adds a closure representing an API event to the @dev's
- * list of events
+ * VFI_MAP_ALLOC_MMAP:
  *
- * Returns: 0 on success otherwise error
+ * The map's memory is an mmap() of @alloc_extent bytes at @mem.
  */
-extern int vfi_register_event(struct vfi_dev *dev, char *name, void *e);
+#define VFI_MAP_ALLOC_MMAP 2
 
 /**
- * vfi_unregister_event
- * @dev: the #vfi_dev handle with the list head of maps
- * @name: the name of the map
- * @e: the closure from the unregistered event
- *
- * This function removes a closure representing an API event from the @dev's
- * list of events
+ * VFI_MAP_ALLOC_ARENA:
  *
- * Returns: 0 on success otherwise error
+ * The map and its memory came from the device's arena, see
+ * vfi_arena_alloc_map().
  */
-extern int vfi_unregister_event(struct vfi_dev *dev, char *name, void **e);
+#define VFI_MAP_ALLOC_ARENA 3
 
 /**
- * vfi_find_npc
- * @list: the list to be searched
- * @name: the name of the closure being searched for.
- * @npc: the returned npc if found
- *
- * This function searches a list of named closures.
+ * VFI_MAP_HUGEPAGE:
  *
- * Returns: 0 on success otherwise error
+ * Back the map with huge pages, see vfi_alloc_map_mem().
  */
-extern int vfi_find_npc(struct vfi_npc *list, char *name, struct vfi_npc **npc);
+#define VFI_MAP_HUGEPAGE 1
 
 /**
- * vfi_find_func
- * @dev: the #vfi_dev handle whose function list is to be searched
- * @name: the name of the function closure being searched for.
- * @func: returns the function pointer if found.
- * @numin: returns the number of input buffers if found.
- * @numout: return the number of output buffers if found.
- *
- * This function searches the function list of named closures whose head is held in @dev
+ * VFI_MAP_PREFAULT:
  *
- * Returns: 0 on success otherwise error
+ * Fault in every page of the map up front, see vfi_pin_map().
  */
-extern int vfi_find_func(struct vfi_dev *dev, char *name, void **func, int *numin, int *numout);
+#define VFI_MAP_PREFAULT 2
 
 /**
- * vfi_find_map
- * @dev: the #vfi_dev handle whose map list is to be searched
- * @name: the name of the map closure being searched for.
- * @map: returns the map if found
- *
- * This function searches the map list of named closures whose head is held in @dev
+ * VFI_MAP_LOCK:
  *
- * Returns: 0 on success otherwise error
+ * Lock the map into memory, see vfi_pin_map().
  */
-extern int vfi_find_map(struct vfi_dev *dev, char *name, struct vfi_map **map);
+#define VFI_MAP_LOCK 4
 
 /**
- * vfi_find_event
- * @dev: the #vfi_dev handle whose event list is to be searched
- * @name: the name of the event closure being searched for.
- * @e: returns the event if found
- *
- * This function searches the event list of named closures whose head is held in @dev
+ * vfi_alloc_map_mem
+ * @map: the map
+ * @extent: size in bytes
+ * @flags: %VFI_MAP_HUGEPAGE, %VFI_MAP_PREFAULT and %VFI_MAP_LOCK
+ * @align: alignment of the memory, a power of 2, or 0
+ * @node: NUMA node to place the memory on, or -1 for anywhere
+ *
+ * Allocates @extent bytes of memory for @map and records how, so that
+ * vfi_free_map() can release it. With no options this is malloc(). An
+ * @align beyond malloc's uses posix_memalign(). %VFI_MAP_HUGEPAGE or a
+ * @node use an anonymous mmap(): MAP_HUGETLB if huge pages are
+ * reserved, otherwise transparent huge pages are asked for with
+ * madvise() on a huge page aligned range, and the pages are bound to
+ * @node with mbind() before they are first touched.
+ * %VFI_MAP_PREFAULT and %VFI_MAP_LOCK are then applied with
+ * vfi_pin_map().
  *
- * Returns: 0 on success otherwise error
+ * Returns: 0 on success error otherwise
  */
-extern int vfi_find_event(struct vfi_dev *dev, char *name, void **e);
+extern int vfi_alloc_map_mem(struct vfi_map *map, long extent, int flags, long align, int node);
 
 /**
- * vfi_get_option
- * @str: the string to be searched for the option
- * @name: the name of the option to be search for.
+ * vfi_pin_map
+ * @map: the map
+ * @flags: %VFI_MAP_PREFAULT and or %VFI_MAP_LOCK
  *
- * The @str is searched for the string @name. 
+ * Takes the first touch page faults of @map now rather than in the
+ * first pass over it. %VFI_MAP_PREFAULT populates the page tables for
+ * writing without changing the contents, with MADV_POPULATE_WRITE
+ * where the kernel has it and otherwise by touching each page.
+ * %VFI_MAP_LOCK mlock()s the map, which also faults it in, so that it
+ * is never paged out. The flags applied are recorded in @map.
  *
- * Returns: %TRUE if @name is found in @str %FALSE otherwise
+ * Returns: 0 on success, otherwise error.
  */
-extern int vfi_get_option(char *str, char *name);
+extern int vfi_pin_map(struct vfi_map *map, int flags);
 
 /**
- * vfi_get_str_arg
- * @str: to be searched for named option
- * @name: option to be sought
- * @val: string value of option if found
- *
- * If @name is not found a negative error value is returned. If @name is
- * found but doesn't have a value, ie @name(value) format, then zero is
- * returned. Otherwise %TRUE is returned.
- *
+ * vfi_arena_stats
+ * @size: bytes in the arena for map memory
+ * @carved: bytes of @size handed out at some time, the rest never used
+ * @in_use: bytes in blocks held by maps
+ * @free_listed: bytes in freed blocks waiting for reuse
+ * @maps: maps allocated
+ * @max_maps: map headers the arena has room for
+ *
+ * Memory use of a device's arena, see vfi_get_arena_stats(). Blocks
+ * are powers of 2 so @in_use may exceed the total of the maps' extents.
+ */
+struct vfi_arena_stats {
+	long size;
+	long carved;
+	long in_use;
+	long free_listed;
+	int maps;
+	int max_maps;
+};
+
+/**
+ * vfi_arena_create
+ * @dev: the API device handle
+ * @size: bytes of map memory
+ * @maps: most maps the arena will hold, 0 for one per page of @size
+ * @flags: %VFI_MAP_HUGEPAGE, %VFI_MAP_PREFAULT and %VFI_MAP_LOCK
+ *
+ * Gives @dev an arena for many small maps: one page aligned region,
+ * allocated as by vfi_alloc_map_mem() with @flags, holding a table of
+ * map headers and @size bytes carved into blocks of powers of 2 from
+ * 64 bytes to 1MiB. A freed block is kept on a free list for its size
+ * so allocating and freeing take constant time. The arena lasts until
+ * vfi_close().
+ *
+ * Returns: 0 on success, -EEXIST if @dev has an arena, otherwise error.
+ */
+extern int vfi_arena_create(struct vfi_dev *dev, long size, int maps, int flags);
+
+/**
+ * vfi_arena_alloc_map
+ * @dev: the API device handle
+ * @map: returns the map
+ * @name: the name of the map
+ * @extent: size of the map's memory
+ *
+ * As vfi_alloc_map() followed by vfi_alloc_map_mem() but taking both
+ * from the arena of @dev. The memory is aligned to its block size, up
+ * to a page, and like malloc() memory is not cleared. Free the map
+ * with vfi_free_map() as any other.
+ *
+ * Returns: 0 on success, -ENODEV if @dev has no arena, -ENOSPC if the
+ * map does not fit: @extent over 1MiB, a long @name or a full arena.
+ */
+extern int vfi_arena_alloc_map(struct vfi_dev *dev, struct vfi_map **map, char *name, long extent);
+
+/**
+ * vfi_get_arena_stats
+ * @dev: the API device handle
+ * @stats: filled in with the arena's memory use
+ *
+ * Returns: 0 on success, -ENODEV if @dev has no arena.
+ */
+extern int vfi_get_arena_stats(struct vfi_dev *dev, struct vfi_arena_stats *stats);
+
+/**
+ * vfi_alloc_ring_mem
+ * @map: the map
+ * @extent: size of the ring in bytes, a multiple of the page size
+ * @fd: descriptor to map, or -1 for new anonymous memory
+ * @offset: offset of the ring in @fd
+ *
+ * Gives @map memory for a ring: @extent bytes mapped twice, the second
+ * copy straight after the first, so that @extent bytes from anywhere in
+ * the first copy can be used without wrapping. With @fd -1 the memory is
+ * a memfd, otherwise @extent bytes at @offset of @fd, such as the
+ * device, are mapped.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_alloc_ring_mem(struct vfi_map *map, long extent, int fd, long long offset);
+
+/**
+ * vfi_map_set_stream
+ * @map: the map, usually with memory from vfi_alloc_ring_mem()
+ * @chunk: bytes each transfer into the ring delivers, dividing @extent
+ *
+ * Makes @map a ring with one producer, which adds data at the head, and
+ * one consumer, which takes it from the tail. Neither side locks; each
+ * index sits on its own cache line. In vfi_run_pipe() the producer is
+ * the pipe's events: each completion adds the @chunk bytes its head
+ * event is bound to.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_map_set_stream(struct vfi_map *map, long chunk);
+
+/**
+ * vfi_stream_chunk
+ * @map: the map
+ *
+ * Returns: the chunk size of ring map @map, 0 if it is not a ring.
+ */
+extern long vfi_stream_chunk(struct vfi_map *map);
+
+/**
+ * vfi_stream_space
+ * @map: a ring map
+ * @p: returns where the next data goes, may be %NULL
+ *
+ * Producer side: the room left in the ring, all of it contiguous from @p.
+ *
+ * Returns: free bytes.
+ */
+extern long vfi_stream_space(struct vfi_map *map, void **p);
+
+/**
+ * vfi_stream_commit
+ * @map: a ring map
+ * @len: bytes written at the position vfi_stream_space() gave
+ *
+ * Producer side: hands @len bytes to the consumer.
+ *
+ * Returns: 0 on success, -EINVAL if @len exceeds the space.
+ */
+extern int vfi_stream_commit(struct vfi_map *map, long len);
+
+/**
+ * vfi_stream_claim
+ * @map: a ring map
+ * @p: returns where the oldest data is, may be %NULL
+ *
+ * Consumer side: the data waiting, all of it contiguous from @p. It
+ * stays valid until given back with vfi_stream_release().
+ *
+ * Returns: bytes available.
+ */
+extern long vfi_stream_claim(struct vfi_map *map, void **p);
+
+/**
+ * vfi_stream_release
+ * @map: a ring map
+ * @len: bytes consumed from the position vfi_stream_claim() gave
+ *
+ * Consumer side: gives @len bytes back to the producer.
+ *
+ * Returns: 0 on success, -EINVAL if @len exceeds the data available.
+ */
+extern int vfi_stream_release(struct vfi_map *map, long len);
+
+/**
+ * vfi_map_slice
+ * @dev: the API device handle
+ * @parent: the map to take a slice of
+ * @name: the name to register the slice under
+ * @offset: byte offset of the slice in @parent
+ * @extent: size of the slice in bytes
+ *
+ * Registers a map which is a view of part of @parent: it shares the
+ * parent's memory and allocates nothing but its own header, so a large
+ * frame can be handed out as tiles by name to anything taking a map,
+ * pipe:// inputs and outputs, map_init:// and map_check:// included.
+ * The parent cannot be freed while it has slices.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_map_slice(struct vfi_dev *dev, struct vfi_map *parent, char *name,
+			 long long offset, long extent);
+
+/**
+ * vfi_free_map
+ * @map: the map
+ *
+ * Frees @map with its buffer state and, according to @alloc, its
+ * memory. The map must not be registered. A map with slices is not
+ * freed, the error is logged and the map left as it was.
+ */
+extern void vfi_free_map(struct vfi_map *map);
+
+/**
+ * VFI_BUF_FREE:
+ *
+ * A buffer no one is using, see vfi_map_buffer_state().
+ */
+#define VFI_BUF_FREE 0
+
+/**
+ * VFI_BUF_FILLING:
+ *
+ * A buffer being filled by its producer, typically a transfer.
+ */
+#define VFI_BUF_FILLING 1
+
+/**
+ * VFI_BUF_READY:
+ *
+ * A filled buffer waiting for its consumer.
+ */
+#define VFI_BUF_READY 2
+
+/**
+ * VFI_BUF_BUSY:
+ *
+ * A filled buffer held by its consumer.
+ */
+#define VFI_BUF_BUSY 3
+
+/**
+ * vfi_map_set_buffers
+ * @map: a map with @mem and @extent set
+ * @buffers: number of equal buffers to divide the map into
+ *
+ * Makes @map multi buffered, as the buffers(N) option of
+ * map_install, mmap_create and smb_create does, so that one buffer
+ * can be filled while another is computed on. Ownership of each
+ * buffer passes from producer to consumer and back through
+ * vfi_map_get_free(), vfi_map_put_ready(), vfi_map_get_ready() and
+ * vfi_map_put_free().
+ *
+ * Returns: 0 on success, -EINVAL if @extent does not divide into
+ * @buffers, otherwise error.
+ */
+extern int vfi_map_set_buffers(struct vfi_map *map, int buffers);
+
+/**
+ * vfi_map_get_free
+ * @map: a map
+ * @buf: returns the buffer to be filled
+ *
+ * The producer side takes the next free buffer to fill. A single
+ * buffered map always hands out its one buffer.
+ *
+ * Returns: the buffer index, or -EAGAIN if none is free.
+ */
+extern int vfi_map_get_free(struct vfi_map *map, void **buf);
+
+/**
+ * vfi_map_put_ready
+ * @map: a map
+ * @buf: a buffer from vfi_map_get_free()
+ *
+ * The producer side passes a filled buffer to the consumer side.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_map_put_ready(struct vfi_map *map, void *buf);
+
+/**
+ * vfi_map_get_ready
+ * @map: a map
+ * @buf: returns the buffer to be consumed
+ *
+ * The consumer side takes the buffer which has been ready longest.
+ *
+ * Returns: the buffer index, or -EAGAIN if none is ready.
+ */
+extern int vfi_map_get_ready(struct vfi_map *map, void **buf);
+
+/**
+ * vfi_map_put_free
+ * @map: a map
+ * @buf: a buffer from vfi_map_get_ready(), or one still ready
+ *
+ * The consumer side gives a buffer back to be filled again.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_map_put_free(struct vfi_map *map, void *buf);
+
+/**
+ * vfi_map_buffer_state
+ * @map: a map
+ * @buf: one of its buffers
+ *
+ * Returns: the VFI_BUF_* state of @buf, or negative on error.
+ */
+extern int vfi_map_buffer_state(struct vfi_map *map, void *buf);
+
+/**
+ * vfi_register_map
+ * @dev: the #vfi_dev handle with the list head of maps
+ * @name: the name of the map
+ * @map: the closure representing the map
+ *
+ * This function adds a closure representing an API map to the @dev's
+ * list of maps
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_register_map(struct vfi_dev *dev, char *name, struct vfi_map *map);
+
+/**
+ * vfi_unregister_map
+ * @dev: the #vfi_dev handle with the list head of maps
+ * @name: the name of the map
+ * @map: returns the closure of the unregistered map
+ *
+ * This function removes a closure representing an API map from the @dev's
+ * list of maps. A map with slices is refused with -EBUSY.
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_unregister_map(struct vfi_dev *dev, char *name, struct vfi_map **map);
+
+/**
+ * vfi_register_event
+ * @dev: the #vfi_dev handle with the list head of maps
+ * @name: the name of the map
+ * @e: the closure representing the event
+ *
+ * This function adds a closure representing an API event to the @dev's
+ * list of events
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_register_event(struct vfi_dev *dev, char *name, void *e);
+
+/**
+ * vfi_unregister_event
+ * @dev: the #vfi_dev handle with the list head of maps
+ * @name: the name of the map
+ * @e: the closure from the unregistered event
+ *
+ * This function removes a closure representing an API event from the @dev's
+ * list of events
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_unregister_event(struct vfi_dev *dev, char *name, void **e);
+
+/**
+ * vfi_register_pipe
+ * @dev: the #vfi_dev handle with the list head of pipes
+ * @name: the text the pipe was compiled from
+ * @pipe: the compiled pipe, a single allocation
+ *
+ * This function adds a compiled pipeline to the @dev's list of pipes
+ * so that it can be found again by the same text. The list owns
+ * @pipe and frees it when @dev is closed, see vfi_set_pipe_free().
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_register_pipe(struct vfi_dev *dev, char *name, void *pipe);
+
+/**
+ * vfi_set_pipe_free
+ * @dev: the #vfi_dev handle with the list head of pipes
+ * @free_pipe: frees a registered pipe, %NULL for free()
+ *
+ * Sets how vfi_close() frees the pipes still registered on @dev, for
+ * pipes which hold more than their one allocation.
+ */
+extern void vfi_set_pipe_free(struct vfi_dev *dev, void (*free_pipe)(void *pipe));
+
+/**
+ * vfi_unregister_pipe
+ * @dev: the #vfi_dev handle with the list head of pipes
+ * @name: the text the pipe was compiled from
+ * @pipe: returns the unregistered pipe, which is the caller's again
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_unregister_pipe(struct vfi_dev *dev, char *name, void **pipe);
+
+/**
+ * vfi_find_pipe
+ * @dev: the #vfi_dev handle with the list head of pipes
+ * @name: the text the pipe was compiled from
+ * @pipe: returns the pipe if found
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_find_pipe(struct vfi_dev *dev, char *name, void **pipe);
+
+/**
+ * vfi_dev_gen
+ * @dev: the API device handle
+ *
+ * Returns: a count which changes whenever a command, function, map
+ * or event is registered or unregistered, or a pipe unregistered, on
+ * @dev, so that anything which has resolved names can tell when to
+ * resolve them again.
+ */
+extern unsigned long vfi_dev_gen(struct vfi_dev *dev);
+
+/**
+ * vfi_find_npc
+ * @list: the list to be searched
+ * @name: the name of the closure being searched for.
+ * @npc: the returned npc if found
+ *
+ * This function searches a list of named closures.
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_find_npc(struct vfi_npc *list, char *name, struct vfi_npc **npc);
+
+/**
+ * vfi_find_func
+ * @dev: the #vfi_dev handle whose function list is to be searched
+ * @name: the name of the function closure being searched for.
+ * @func: returns the function pointer if found.
+ * @numin: returns the number of input buffers if found.
+ * @numout: return the number of output buffers if found.
+ *
+ * This function searches the function list of named closures whose head is held in @dev
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_find_func(struct vfi_dev *dev, char *name, void **func, int *numin, int *numout);
+
+/**
+ * vfi_find_map
+ * @dev: the #vfi_dev handle whose map list is to be searched
+ * @name: the name of the map closure being searched for.
+ * @map: returns the map if found
+ *
+ * This function searches the map list of named closures whose head is held in @dev
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_find_map(struct vfi_dev *dev, char *name, struct vfi_map **map);
+
+/**
+ * vfi_find_event
+ * @dev: the #vfi_dev handle whose event list is to be searched
+ * @name: the name of the event closure being searched for.
+ * @e: returns the event if found
+ *
+ * This function searches the event list of named closures whose head is held in @dev
+ *
+ * Returns: 0 on success otherwise error
+ */
+extern int vfi_find_event(struct vfi_dev *dev, char *name, void **e);
+
+/**
+ * vfi_get_option
+ * @str: the string to be searched for the option
+ * @name: the name of the option to be search for.
+ *
+ * The @str is searched for the option @name, such as ?lock or ,wait,
+ * with or without a value. Only whole options are matched, not part of
+ * another option, a name or a value.
+ *
+ * Returns: %TRUE if @name is found in @str %FALSE otherwise
+ */
+extern int vfi_get_option(char *str, char *name);
+
+/**
+ * vfi_get_str_arg
+ * @str: to be searched for named option
+ * @name: option to be sought
+ * @val: string value of option if found
+ *
+ * If @name is not found a negative error value is returned. If @name is
+ * found but doesn't have a value, ie @name(value) format, then zero is
+ * returned. Otherwise %TRUE is returned. Options are only matched
+ * as whole tokens at the start of @str or following a '?' or ',' so
+ * "name" is not found inside "map_name(x)".
+ *
  * Returns: < 0 if @name not found, 0 if found but no value, > 0 if
  * @val is returned.
  */
@@ -769,8 +1699,8 @@ extern int vfi_parse_unary_op(char *str, char **cmd, char **desc);
  * @str: string to be parsed of form name[.location][#offset][:extent][[?option][,option]*]
  * @name: string containing name if found or #NULL
  * @location: string containing location if found or NULL
- * @offset: long long to contain value of #offset if found else undefined
- * @extent: long to contain value of :extent if found else undefined
+ * @offset: int to contain value of #offset if found else unchanged
+ * @extent: int to contain value of :extent if found else unchanged
  * @opts: string containing options if found else NULL.
  *
  * Parses desc string. Returned strings must be freed by caller.
@@ -791,6 +1721,152 @@ extern int vfi_parse_desc(char *str, char **name, char **location, int *offset,
  */
 extern int vfi_get_hex_arg(char *str, char *name, long *val);
 
+/**
+ * VFI_SCAN_WORDS:
+ *
+ * Number of words of inline bitmap in a #vfi_delims, enough to cover
+ * the longest reply the driver returns in a single read.
+ */
+#define VFI_SCAN_WORDS (1024 / (8 * sizeof(unsigned long)))
+
+/**
+ * vfi_delims
+ * @str: the string which was scanned
+ * @len: the length of @str
+ * @nwords: the number of words in @bits
+ * @bits: bitmap with bit n set if @str[n] is a RIL delimiter
+ * @b: inline storage for @bits
+ *
+ * The result of a single classification pass over a RIL string. Every
+ * occurrence of one of the delimiters ':', '/', '?', '(', ')', ',',
+ * '#', '.' and '=' is marked in @bits so that the parsing helpers can
+ * jump from token to token instead of rescanning @str with
+ * strstr()/sscanf(). Strings too long for @b are given a heap bitmap
+ * which must be released with vfi_release_delims().
+ */
+struct vfi_delims {
+	const char *str;
+	int len;
+	int nwords;
+	unsigned long *bits;
+	unsigned long b[VFI_SCAN_WORDS];
+};
+
+/**
+ * VFI_SCAN_AUTO:
+ * @VFI_SCAN_AUTO: pick the best scanner the CPU supports
+ * @VFI_SCAN_SCALAR: portable table driven scanner
+ * @VFI_SCAN_SSE2: 16 bytes per step
+ * @VFI_SCAN_AVX2: 32 bytes per step
+ *
+ * Delimiter scanner implementations selectable with vfi_select_scan().
+ */
+enum {
+	VFI_SCAN_AUTO,
+	VFI_SCAN_SCALAR,
+	VFI_SCAN_SSE2,
+	VFI_SCAN_AVX2,
+};
+
+/**
+ * vfi_select_scan
+ * @impl: one of the VFI_SCAN_ implementations
+ *
+ * Selects the scanner used by vfi_scan_delims(). By default the best
+ * one supported by the CPU is chosen on first use so applications
+ * only need this to force a particular implementation, e.g., to
+ * benchmark the scalar path.
+ *
+ * Returns: the implementation selected or -EINVAL if @impl is not
+ * supported on this CPU.
+ */
+extern int vfi_select_scan(int impl);
+
+/**
+ * vfi_scan_delims
+ * @d: the #vfi_delims to be filled in
+ * @str: the RIL string to be scanned
+ *
+ * Classifies every character of @str in one sweep and records the
+ * positions of the RIL delimiters in @d.
+ *
+ * Returns: the length of @str or a negative error.
+ */
+extern int vfi_scan_delims(struct vfi_delims *d, const char *str);
+
+/**
+ * vfi_release_delims
+ * @d: the #vfi_delims to be released
+ *
+ * Frees any heap bitmap allocated by vfi_scan_delims() for long strings.
+ */
+extern void vfi_release_delims(struct vfi_delims *d);
+
+/**
+ * vfi_next_delim
+ * @d: a scanned #vfi_delims
+ * @pos: position in the string to start looking from
+ * @set: string of the delimiters of interest, %NULL for any.
+ *
+ * Finds the first delimiter at or after @pos which is one of @set.
+ *
+ * Returns: the position of the delimiter or the length of the string
+ * if there is none.
+ */
+extern int vfi_next_delim(struct vfi_delims *d, int pos, const char *set);
+
+/**
+ * vfi_parse_hex
+ * @s: start of the span to be decoded
+ * @len: length of the span
+ * @val: output parameter for the decoded value
+ *
+ * Decodes hex digits, with an optional leading 0x, from the start of
+ * the span @s. Decoding stops at the first non hex digit so values
+ * can be decoded in place inside a command or reply string. A value
+ * of more than 64 bits is refused, and @val set to 0.
+ *
+ * Returns: the number of characters consumed, 0 if there were no digits
+ * or too many.
+ */
+extern int vfi_parse_hex(const char *s, int len, unsigned long long *val);
+
+/**
+ * vfi_parse_dec
+ * @s: start of the span to be decoded
+ * @len: length of the span
+ * @val: output parameter for the decoded value
+ *
+ * Decodes an optionally signed decimal number from the start of the
+ * span @s, eight digits at a time where it can.
+ *
+ * Returns: the number of characters consumed, 0 if there were no digits.
+ */
+extern int vfi_parse_dec(const char *s, int len, long long *val);
+
+/**
+ * vfi_format_hex
+ * @buf: buffer of at least 17 characters
+ * @val: the value to be encoded
+ *
+ * Encodes @val as lower case hex digits without a leading 0x, the
+ * form the driver and vfi_get_hex_arg() expect, and NUL terminates it.
+ *
+ * Returns: the number of digits written.
+ */
+extern int vfi_format_hex(char *buf, unsigned long long val);
+
+/**
+ * vfi_format_dec
+ * @buf: buffer of at least 21 characters
+ * @val: the value to be encoded
+ *
+ * Encodes @val as signed decimal and NUL terminates it.
+ *
+ * Returns: the number of characters written.
+ */
+extern int vfi_format_dec(char *buf, long long val);
+
 /**
  * vfi_poll_read
  * @dev: the #vfi_dev handle to be polled for results.
@@ -891,6 +1967,408 @@ extern int vfi_invoke_cmd_ap(struct vfi_dev *dev, char *format,va_list list);
  */
 extern int vfi_invoke_cmd_str(struct vfi_dev *dev, char *str, int size);
 
+/**
+ * VFI_CMD_SIZE:
+ *
+ * Size of the inline buffer in a #vfi_cmd_buf. Every command the
+ * library builds fits in this unless the names in it are unusually
+ * long, in which case the buffer moves to the heap once.
+ */
+#define VFI_CMD_SIZE 256
+
+/**
+ * vfi_cmd_buf
+ * @p: the command being built, NUL terminated
+ * @len: length of the command in @p
+ * @size: size of the buffer at @p
+ * @opts: non zero once the command has an option list
+ * @b: inline storage for @p
+ *
+ * A send buffer for the typed command builders below. Literal pieces
+ * of a command are appended with vfi_cmd_lit() whose length is a
+ * compile time constant, names with vfi_cmd_str() and numbers with
+ * the #vfi_format_hex/#vfi_format_dec encoders, so no format string
+ * is interpreted at run time. vfi_cmd_opt_sep() supplies the '?' or
+ * ',' needed before each option. The result is passed to the driver
+ * with vfi_invoke_cmd_buf() and the buffer released with
+ * vfi_cmd_release().
+ *
+ * A buffer is set up once with vfi_cmd_init() and may then be built
+ * into any number of times, as in a loop: each builder first frees any
+ * heap storage the previous command took, see vfi_cmd_reset().
+ */
+struct vfi_cmd_buf {
+	char *p;
+	int len;
+	int size;
+	int opts;
+	char b[VFI_CMD_SIZE];
+};
+
+/**
+ * vfi_cmd_grow
+ * @cb: the buffer to be grown
+ * @n: the number of further characters needed
+ *
+ * Moves @cb to a heap buffer large enough for @n more characters.
+ * Called by the builders, never needed directly.
+ *
+ * Returns: 0 on success or -ENOMEM.
+ */
+extern int vfi_cmd_grow(struct vfi_cmd_buf *cb, int n);
+
+/**
+ * vfi_cmd_release
+ * @cb: the buffer to be released
+ *
+ * Frees any heap storage taken by @cb.
+ */
+extern void vfi_cmd_release(struct vfi_cmd_buf *cb);
+
+/**
+ * vfi_cmd_dup
+ * @cb: a built command
+ *
+ * Returns: an allocated copy of the command in @cb, exactly sized,
+ * for callers which must hand back a command string such as the pre
+ * commands, or %NULL.
+ */
+extern char *vfi_cmd_dup(struct vfi_cmd_buf *cb);
+
+/**
+ * vfi_invoke_cmd_buf
+ * @dev: #vfi_dev handle currently in use
+ * @cb: the command built in a #vfi_cmd_buf
+ *
+ * Terminates the command in @cb and writes it to @dev in one piece.
+ *
+ * Returns: as vfi_invoke_cmd_str().
+ */
+extern int vfi_invoke_cmd_buf(struct vfi_dev *dev, struct vfi_cmd_buf *cb);
+
+/**
+ * vfi_cmd_init
+ * @cb: an unused buffer
+ *
+ * Sets up @cb, which must be done once before it is first built into.
+ */
+static inline void vfi_cmd_init(struct vfi_cmd_buf *cb)
+{
+	cb->p = cb->b;
+	cb->len = 0;
+	cb->size = sizeof(cb->b);
+	cb->opts = 0;
+	cb->b[0] = '\0';
+}
+
+/**
+ * vfi_cmd_reset
+ * @cb: a buffer set up with vfi_cmd_init()
+ *
+ * Empties @cb for a new command, freeing any heap storage taken by the
+ * last. The builders start with this, so reusing @cb does not leak.
+ */
+static inline void vfi_cmd_reset(struct vfi_cmd_buf *cb)
+{
+	vfi_cmd_release(cb);
+	cb->len = 0;
+	cb->opts = 0;
+	cb->b[0] = '\0';
+}
+
+static inline int vfi_cmd_put(struct vfi_cmd_buf *cb, const char *s, int n)
+{
+	if (cb->len + n >= cb->size && vfi_cmd_grow(cb, n))
+		return -ENOMEM;
+	memcpy(cb->p + cb->len, s, n);
+	cb->len += n;
+	cb->p[cb->len] = '\0';
+	return 0;
+}
+
+#define vfi_cmd_lit(cb, s) vfi_cmd_put((cb), "" s, sizeof(s) - 1)
+
+static inline int vfi_cmd_str(struct vfi_cmd_buf *cb, const char *s)
+{
+	return vfi_cmd_put(cb, s, strlen(s));
+}
+
+static inline int vfi_cmd_hex(struct vfi_cmd_buf *cb, unsigned long long v)
+{
+	if (cb->len + 16 >= cb->size && vfi_cmd_grow(cb, 16))
+		return -ENOMEM;
+	cb->len += vfi_format_hex(cb->p + cb->len, v);
+	return 0;
+}
+
+static inline int vfi_cmd_dec(struct vfi_cmd_buf *cb, long long v)
+{
+	if (cb->len + 20 >= cb->size && vfi_cmd_grow(cb, 20))
+		return -ENOMEM;
+	cb->len += vfi_format_dec(cb->p + cb->len, v);
+	return 0;
+}
+
+static inline int vfi_cmd_opt_sep(struct vfi_cmd_buf *cb)
+{
+	return vfi_cmd_put(cb, cb->opts++ ? "," : "?", 1);
+}
+
+/* Start @cb from an existing command, e.g. to append options to it. */
+static inline int vfi_cmd_from(struct vfi_cmd_buf *cb, const char *cmd)
+{
+	vfi_cmd_reset(cb);
+	cb->opts = strchr(cmd, '?') != NULL;
+	return vfi_cmd_str(cb, cmd);
+}
+
+#define vfi_cmd_opt_hex(cb, name, v) \
+	(vfi_cmd_opt_sep(cb) || vfi_cmd_lit((cb), name "(") || \
+	 vfi_cmd_hex((cb), (v)) || vfi_cmd_lit((cb), ")"))
+
+#define vfi_cmd_opt_dec(cb, name, v) \
+	(vfi_cmd_opt_sep(cb) || vfi_cmd_lit((cb), name "(") || \
+	 vfi_cmd_dec((cb), (v)) || vfi_cmd_lit((cb), ")"))
+
+#define vfi_cmd_opt_str(cb, name, s, n) \
+	(vfi_cmd_opt_sep(cb) || vfi_cmd_lit((cb), name "(") || \
+	 vfi_cmd_put((cb), (s), (n)) || vfi_cmd_lit((cb), ")"))
+
+/**
+ * vfi_cmd_request
+ * @cb: the command being built
+ * @ah: the #vfi_async_handle the reply is to be posted to
+ *
+ * Appends the request(xxx) option tagging the command with @ah.
+ *
+ * Returns: 0 on success.
+ */
+static inline int vfi_cmd_request(struct vfi_cmd_buf *cb, struct vfi_async_handle *ah)
+{
+	return vfi_cmd_opt_hex(cb, "request", (unsigned long)ah);
+}
+
+/**
+ * vfi_build_event_start
+ * @cb: buffer to build the command in
+ * @event: the event to be started
+ *
+ * Builds event_start://@event.
+ *
+ * Returns: 0 on success.
+ */
+static inline int vfi_build_event_start(struct vfi_cmd_buf *cb, const char *event)
+{
+	vfi_cmd_reset(cb);
+	return vfi_cmd_lit(cb, "event_start://") || vfi_cmd_str(cb, event);
+}
+
+/**
+ * vfi_build_event_chain
+ * @cb: buffer to build the command in
+ * @event: the event to be chained from
+ * @ah: the #vfi_async_handle for the reply
+ * @next: the name of the event to be chained to
+ * @n: the length of @next
+ *
+ * Builds event_chain://@event?request(@ah),event_name(@next).
+ *
+ * Returns: 0 on success.
+ */
+static inline int vfi_build_event_chain(struct vfi_cmd_buf *cb, const char *event,
+					struct vfi_async_handle *ah, const char *next, int n)
+{
+	vfi_cmd_reset(cb);
+	return vfi_cmd_lit(cb, "event_chain://") || vfi_cmd_str(cb, event) ||
+		vfi_cmd_request(cb, ah) || vfi_cmd_opt_str(cb, "event_name", next, n);
+}
+
+/**
+ * vfi_build_event_unchain
+ * @cb: buffer to build the command in
+ * @event: the event chained from
+ * @ah: the #vfi_async_handle for the reply
+ * @next: the name of the event chained to
+ * @n: the length of @next
+ *
+ * Builds event_unchain://@event?request(@ah),event_name(@next), undoing
+ * vfi_build_event_chain(). Only for drivers which implement it, see
+ * vfi_dev_unchain().
+ *
+ * Returns: 0 on success.
+ */
+static inline int vfi_build_event_unchain(struct vfi_cmd_buf *cb, const char *event,
+					  struct vfi_async_handle *ah, const char *next, int n)
+{
+	vfi_cmd_reset(cb);
+	return vfi_cmd_lit(cb, "event_unchain://") || vfi_cmd_str(cb, event) ||
+		vfi_cmd_request(cb, ah) || vfi_cmd_opt_str(cb, "event_name", next, n);
+}
+
+/**
+ * vfi_build_mmap_create
+ * @cb: buffer to build the command in
+ * @smb: the smb descriptor to be mapped
+ * @n: the length of @smb
+ * @name: the map name to register the mapping under
+ *
+ * Builds mmap_create://@smb?map_name(@name).
+ *
+ * Returns: 0 on success.
+ */
+static inline int vfi_build_mmap_create(struct vfi_cmd_buf *cb, const char *smb, int n,
+					const char *name)
+{
+	vfi_cmd_reset(cb);
+	return vfi_cmd_lit(cb, "mmap_create://") || vfi_cmd_put(cb, smb, n) ||
+		vfi_cmd_opt_str(cb, "map_name", name, strlen(name));
+}
+
+/**
+ * VFI_FRAME_MAGIC:
+ *
+ * First byte of every binary frame. Not a character that can start a
+ * text command.
+ */
+#define VFI_FRAME_MAGIC 0xf5
+
+/**
+ * VFI_FRAME_MAX:
+ *
+ * Largest frame, header and body, exchanged with the driver.
+ */
+#define VFI_FRAME_MAX 1024
+
+enum {
+	VFI_VERB_TEXT,
+	VFI_VERB_EVENT_START,
+	VFI_VERB_EVENT_CHAIN,
+	VFI_VERB_BIND_CREATE,
+};
+
+#define VFI_FRAME_TAG	 0x1
+#define VFI_FRAME_REPLY	 0x2
+#define VFI_FRAME_RESULT 0x4
+
+/**
+ * vfi_frame
+ * @magic: %VFI_FRAME_MAGIC
+ * @verb: VFI_VERB_*, %VFI_VERB_TEXT for a command the table lacks
+ * @flags: which of @tag and @result are present, and whether @tag is
+ * a request(), or with %VFI_FRAME_REPLY a reply()
+ * @len: length of the frame including this header
+ * @result: the result() of a reply
+ * @tag: the request() or reply() tag
+ * @b: the body
+ *
+ * A command or reply in binary framing. The verb, tag and result
+ * travel as integers. The body is the rest of the command after the
+ * :// with those options removed, or for %VFI_VERB_TEXT the command
+ * including its verb, so frames and text convert both ways without
+ * loss.
+ */
+struct vfi_frame {
+	unsigned char magic;
+	unsigned char verb;
+	unsigned char flags;
+	unsigned char pad;
+	unsigned int len;
+	int result;
+	unsigned int pad2;
+	unsigned long long tag;
+	char b[];
+};
+
+/**
+ * vfi_frame_encode
+ * @cmd: a text command or reply
+ * @len: its length, a trailing newline is ignored
+ * @buf: the buffer to encode the frame in
+ * @size: size of @buf
+ *
+ * Returns: the length of the frame, or -E2BIG or -ENOMEM.
+ */
+extern int vfi_frame_encode(const char *cmd, int len, char *buf, int size);
+
+/**
+ * vfi_frame_decode
+ * @buf: a frame
+ * @len: number of bytes at @buf
+ * @cb: a buffer set up with vfi_cmd_init(), left holding the text form
+ *
+ * Header options are appended to the last option list of the body.
+ * The caller releases @cb.
+ *
+ * Returns: 0 on success, -EINVAL for a malformed frame, -EBADMSG for
+ * one whose length is shorter than its header, or -ENOMEM.
+ */
+extern int vfi_frame_decode(const char *buf, int len, struct vfi_cmd_buf *cb);
+
+/**
+ * vfi_server:
+ *
+ * An opaque type for an in-process command server. Local clients
+ * connect to a UNIX domain socket and write RIL commands, one per
+ * line, and read back one reply line per command. A single event
+ * loop multiplexes every client onto one #vfi_dev: commands go
+ * through the pre commands as usual, those for the driver are sent
+ * with a request tag of the server's own and each reply is routed
+ * back to the client which sent the command. A client's own
+ * request(tag) is returned as reply(tag). Pre commands run in the
+ * event loop and so must not block waiting on the driver.
+ */
+struct vfi_server;
+
+/**
+ * vfi_server_open:
+ * @dev: the device the server owns
+ * @srv: the server
+ * @path: the socket path, replaced if it exists
+ *
+ * Returns: 0 on success or negative error.
+ */
+extern int vfi_server_open(struct vfi_dev *dev, struct vfi_server **srv, char *path);
+
+/**
+ * vfi_server_close:
+ * @srv: the server
+ *
+ * Disconnects all clients, abandons outstanding requests and removes
+ * the socket.
+ */
+extern void vfi_server_close(struct vfi_server *srv);
+
+/**
+ * vfi_server_poll:
+ * @srv: the server
+ * @timeout: poll timeout in milliseconds, -1 for none
+ *
+ * One pass of the event loop: accepts clients, issues the complete
+ * command lines they have sent, returns replies and flushes output.
+ * For applications with an event loop of their own.
+ *
+ * Returns: 0 or negative error.
+ */
+extern int vfi_server_poll(struct vfi_server *srv, int timeout);
+
+/**
+ * vfi_server_run:
+ * @srv: the server
+ *
+ * Runs vfi_server_poll() until the device is done.
+ *
+ * Returns: 0 or negative error.
+ */
+extern int vfi_server_run(struct vfi_server *srv);
+
+/**
+ * vfi_server_clients:
+ * @srv: the server
+ *
+ * Returns: the number of connected clients.
+ */
+extern int vfi_server_clients(struct vfi_server *srv);
+
 /**
  * vfi_get_result
  * @dev: @vfi_dev handle in use
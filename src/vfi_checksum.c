@@ -0,0 +1,327 @@
+#include <vfi_api.h>
+#include <vfi_frmwrk.h>
+#include <vfi_log.h>
+#include <pthread.h>
+#include <stdint.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_CRC32_U64 1
+#endif
+
+#define MY_ERROR VFI_DBG_DEFAULT
+#define MY_DEBUG (VFI_DBG_EVERYONE | VFI_DBG_EVERYTHING | VFI_LOG_DEBUG)
+
+/*
+ * Checksums of map contents. Both algorithms are computed in pieces
+ * on several threads and give the same digest however the work is
+ * split: CRC32C pieces are joined with crc32c_combine(), and the XXH64
+ * digest of a region larger than one chunk is defined over the digests
+ * of its fixed size chunks.
+ */
+#define CHUNK (1 << 20)		/* XXH64 chunk */
+#define THREAD_MIN (8 << 20)	/* bytes worth a thread of their own */
+#define THREAD_MAX 16
+
+typedef unsigned long long u64;
+typedef unsigned int u32;
+
+static const struct {
+	char *name;
+	int type;
+} algos[] = {
+	{ "crc32c", VFI_CHECKSUM_CRC32C },
+	{ "xxh64", VFI_CHECKSUM_XXH64 },
+};
+
+int vfi_checksum_type(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(algos)/sizeof(algos[0]); i++)
+		if (!strcmp(name, algos[i].name))
+			return algos[i].type;
+	return VFI_RESULT(-EINVAL);
+}
+
+/* CRC32C, the Castagnoli polynomial, reflected */
+#define CRC32C_POLY 0x82f63b78
+
+static u32 crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void)
+{
+	u32 c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[i] = c;
+	}
+}
+
+static u32 crc32c_sw(u32 crc, const unsigned char *p, u64 n)
+{
+	pthread_once(&crc32c_once, crc32c_init_table);
+	crc = ~crc;
+	while (n--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#ifdef HAVE_CRC32_U64
+__attribute__((target("sse4.2")))
+static u32 crc32c_hw(u32 crc, const unsigned char *p, u64 n)
+{
+	u64 c = ~crc & 0xffffffff;
+	u64 w;
+
+	while (n && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		n--;
+	}
+	for (; n >= 8; n -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	while (n--)
+		c = _mm_crc32_u8(c, *p++);
+	return ~c;
+}
+#endif
+
+static u32 crc32c(u32 crc, const unsigned char *p, u64 n)
+{
+#ifdef HAVE_CRC32_U64
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_hw(crc, p, n);
+#endif
+	return crc32c_sw(crc, p, n);
+}
+
+/* The CRC of A then B from the CRCs of each, as zlib's crc32_combine() */
+static u32 gf2_times(const u32 *mat, u32 vec)
+{
+	u32 sum = 0;
+
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+	return sum;
+}
+
+static void gf2_square(u32 *square, const u32 *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_times(mat, mat[n]);
+}
+
+static u32 crc32c_combine(u32 crc1, u32 crc2, u64 len2)
+{
+	u32 even[32], odd[32];
+	u32 row = 1;
+	int n;
+
+	if (len2 == 0)
+		return crc1;
+
+	/* operator for one zero bit in odd, then two and four in even */
+	odd[0] = CRC32C_POLY;
+	for (n = 1; n < 32; n++, row <<= 1)
+		odd[n] = row;
+	gf2_square(even, odd);
+	gf2_square(odd, even);
+
+	/* apply len2 zero bytes to crc1 */
+	do {
+		gf2_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_times(even, crc1);
+		len2 >>= 1;
+		if (len2 == 0)
+			break;
+		gf2_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2);
+
+	return crc1 ^ crc2;
+}
+
+/* XXH64, seed 0, little endian input */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static inline u64 rotl64(u64 x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 xxh_round(u64 acc, u64 in)
+{
+	return rotl64(acc + in * XXH_P2, 31) * XXH_P1;
+}
+
+static inline u64 xxh_merge(u64 acc, u64 v)
+{
+	return (acc ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+static u64 xxh64(const unsigned char *p, u64 n)
+{
+	const unsigned char *end = p + n;
+	u64 v1, v2, v3, v4, h, w;
+	u32 w32;
+
+	if (n >= 32) {
+		v1 = XXH_P1 + XXH_P2;
+		v2 = XXH_P2;
+		v3 = 0;
+		v4 = -XXH_P1;
+		for (; p + 32 <= end; p += 32) {
+			memcpy(&w, p, 8);
+			v1 = xxh_round(v1, w);
+			memcpy(&w, p + 8, 8);
+			v2 = xxh_round(v2, w);
+			memcpy(&w, p + 16, 8);
+			v3 = xxh_round(v3, w);
+			memcpy(&w, p + 24, 8);
+			v4 = xxh_round(v4, w);
+		}
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	}
+	else
+		h = XXH_P5;
+	h += n;
+
+	for (; p + 8 <= end; p += 8) {
+		memcpy(&w, p, 8);
+		h = rotl64(h ^ xxh_round(0, w), 27) * XXH_P1 + XXH_P4;
+	}
+	if (p + 4 <= end) {
+		memcpy(&w32, p, 4);
+		h = rotl64(h ^ (w32 * XXH_P1), 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = rotl64(h ^ (*p * XXH_P5), 11) * XXH_P1;
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+struct checksum_job {
+	const unsigned char *mem;
+	u64 start;		/* byte offset of the piece in the region */
+	u64 len;
+	int algo;
+	u32 crc;
+	u64 *chunks;		/* XXH64: digests for the whole region */
+};
+
+static void *checksum_thread(void *arg)
+{
+	struct checksum_job *job = arg;
+	u64 i, n;
+
+	if (job->algo == VFI_CHECKSUM_CRC32C) {
+		job->crc = crc32c(0, job->mem + job->start, job->len);
+		return NULL;
+	}
+	for (i = 0; i < job->len; i += n) {
+		n = job->len - i < CHUNK ? job->len - i : CHUNK;
+		job->chunks[(job->start + i) / CHUNK] = xxh64(job->mem + job->start + i, n);
+	}
+	return NULL;
+}
+
+int vfi_checksum_map(struct vfi_map *map, long long offset, long extent, int algo,
+		     int threads, unsigned long long *digest)
+{
+	struct checksum_job job[THREAD_MAX];
+	pthread_t tid[THREAD_MAX];
+	u64 nchunks = (extent + CHUNK - 1) / CHUNK;
+	u64 *chunks = NULL;
+	u64 per;
+	u32 crc;
+	int i, n, started;
+
+	if (offset < 0 || extent < 0 || map->extent < offset + extent)
+		return VFI_RESULT(-EINVAL);
+	if (algo != VFI_CHECKSUM_CRC32C && algo != VFI_CHECKSUM_XXH64)
+		return VFI_RESULT(-EINVAL);
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads > extent / THREAD_MIN)
+			threads = extent / THREAD_MIN;
+	}
+	if (threads > THREAD_MAX)
+		threads = THREAD_MAX;
+	if (threads > nchunks)
+		threads = nchunks;
+	if (threads < 1)
+		threads = 1;
+
+	if (algo == VFI_CHECKSUM_XXH64 && nchunks > 1) {
+		chunks = malloc(nchunks * sizeof(*chunks));
+		if (chunks == NULL)
+			return VFI_RESULT(-ENOMEM);
+	}
+
+	/* whole chunks to each thread so XXH64 chunks line up */
+	per = (nchunks + threads - 1) / threads * CHUNK;
+	for (n = 0; n < threads && (n == 0 || n * per < extent); n++) {
+		job[n].mem = (unsigned char *)map->mem + offset;
+		job[n].start = n * per;
+		job[n].len = extent - job[n].start < per ? extent - job[n].start : per;
+		job[n].algo = algo;
+		job[n].chunks = chunks;
+	}
+
+	if (algo == VFI_CHECKSUM_XXH64 && chunks == NULL) {
+		*digest = xxh64(job[0].mem, extent);
+		goto done;
+	}
+
+	for (started = 1; started < n; started++)
+		if (pthread_create(&tid[started], NULL, checksum_thread, &job[started]))
+			break;
+	/* anything we could not hand off is done here */
+	for (i = started; i < n; i++)
+		checksum_thread(&job[i]);
+	checksum_thread(&job[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(tid[i], NULL);
+
+	if (algo == VFI_CHECKSUM_CRC32C) {
+		crc = job[0].crc;
+		for (i = 1; i < n; i++)
+			crc = crc32c_combine(crc, job[i].crc, job[i].len);
+		*digest = crc;
+	}
+	else {
+		*digest = xxh64((unsigned char *)chunks, nchunks * sizeof(*chunks));
+		free(chunks);
+	}
+done:
+	map->digest = *digest;
+	map->digest_algo = algo;
+	return 0;
+}
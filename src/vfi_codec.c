@@ -0,0 +1,158 @@
+#include <vfi_api.h>
+#include <vfi_log.h>
+
+#define MY_ERROR VFI_DBG_DEFAULT
+#define MY_DEBUG (VFI_DBG_EVERYONE | VFI_DBG_EVERYTHING | VFI_LOG_DEBUG)
+
+/*
+ * Integer encoding and decoding for request tags, offsets, extents
+ * and numeric options. These work on spans, a pointer and a length,
+ * so values can be decoded in place inside a command or reply and
+ * encoded straight into a send buffer without going through the
+ * stdio format interpreters.
+ */
+
+#define XX 0xff
+static const unsigned char hex_val[256] = {
+	[0 ... 255] = XX,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+};
+
+static const char hex_digit[16] = "0123456789abcdef";
+
+static const char dec_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+int vfi_parse_hex(const char *s, int len, unsigned long long *val)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned long long v = 0;
+	unsigned int d;
+	int n = 0;
+
+	if (len >= 3 && p[0] == '0' && (p[1] | 0x20) == 'x' && hex_val[p[2]] != XX)
+		n = 2;
+
+	while (n < len && (d = hex_val[p[n]]) != XX) {
+		/* a seventeenth significant digit does not fit */
+		if (v >> 60) {
+			*val = 0;
+			return 0;
+		}
+		v = (v << 4) | d;
+		n++;
+	}
+
+	*val = v;
+	return n;
+}
+
+/*
+ * Eight digits at a time: check all eight bytes are digits and then
+ * combine them pairwise with three multiplies. Only for little endian
+ * where the first digit lands in the low byte.
+ */
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+static inline int dec8(const unsigned char *p, unsigned long long *v)
+{
+	unsigned long long c;
+
+	memcpy(&c, p, 8);
+	if ((c & 0xf0f0f0f0f0f0f0f0ULL) != 0x3030303030303030ULL ||
+	    ((c + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) != 0x3030303030303030ULL)
+		return 0;
+
+	c -= 0x3030303030303030ULL;
+	c = (c * 10) + (c >> 8);
+	c = (((c & 0x000000ff000000ffULL) * 0x000f424000000064ULL) +
+	     (((c >> 16) & 0x000000ff000000ffULL) * 0x0000271000000001ULL)) >> 32;
+	*v = c;
+	return 1;
+}
+#else
+static inline int dec8(const unsigned char *p, unsigned long long *v)
+{
+	return 0;
+}
+#endif
+
+int vfi_parse_dec(const char *s, int len, long long *val)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	unsigned long long v = 0;
+	unsigned long long c;
+	unsigned int d;
+	int neg = 0;
+	int n = 0;
+	int start;
+
+	if (len && (*p == '-' || *p == '+')) {
+		neg = (*p == '-');
+		n = 1;
+	}
+	start = n;
+
+	while (len - n >= 8 && dec8(p + n, &c)) {
+		v = v * 100000000ULL + c;
+		n += 8;
+	}
+
+	while (n < len && (d = p[n] - '0') < 10) {
+		v = v * 10 + d;
+		n++;
+	}
+
+	/* negated unsigned so that LLONG_MIN does not overflow */
+	*val = (long long)(neg ? -v : v);
+	return n > start ? n : 0;
+}
+
+int vfi_format_hex(char *buf, unsigned long long val)
+{
+	int n = (64 - __builtin_clzll(val | 1) + 3) / 4;
+	int i;
+
+	for (i = n; i--; val >>= 4)
+		buf[i] = hex_digit[val & 15];
+	buf[n] = '\0';
+	return n;
+}
+
+int vfi_format_dec(char *buf, long long val)
+{
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	unsigned long long v = val < 0 ? -(unsigned long long)val : val;
+	int n;
+
+	while (v >= 100) {
+		p -= 2;
+		memcpy(p, dec_pairs + (v % 100) * 2, 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, dec_pairs + v * 2, 2);
+	}
+	else
+		*--p = '0' + v;
+	if (val < 0)
+		*--p = '-';
+
+	n = tmp + sizeof(tmp) - p;
+	memcpy(buf, p, n);
+	buf[n] = '\0';
+	return n;
+}
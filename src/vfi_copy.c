@@ -0,0 +1,230 @@
+#include <vfi_api.h>
+#include <vfi_frmwrk.h>
+#include <vfi_log.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define MY_ERROR VFI_DBG_DEFAULT
+#define MY_DEBUG (VFI_DBG_EVERYONE | VFI_DBG_EVERYTHING | VFI_LOG_DEBUG)
+
+/*
+ * Map to map copies. Small copies are left to memcpy(), whose result
+ * is likely wanted in cache. Copies too big to stay in cache anyway
+ * are done with non-temporal stores, which go round the cache instead
+ * of evicting everything else from it, and very big ones are split
+ * between threads as one core cannot fill the memory bandwidth. With
+ * one CPU, copies big enough for memcpy() to stream itself are left
+ * to it.
+ */
+#define NT_MIN (1 << 20)	/* smallest cutover to streaming stores */
+#define NT_MAX (32 << 20)
+#define THREAD_MIN (8 << 20)	/* bytes worth a thread of their own */
+#define THREAD_MAX 16
+
+static long nt_threshold(void)
+{
+	static long threshold;
+	long l3;
+
+	if (threshold == 0) {
+		/* half the last level cache, the rest is someone else's */
+		l3 = sysconf(_SC_LEVEL3_CACHE_SIZE) / 2;
+		threshold = l3 < NT_MIN ? NT_MIN : l3 > NT_MAX ? NT_MAX : l3;
+	}
+	return threshold;
+}
+
+static long libc_nt_threshold(void)
+{
+	static long threshold;
+	long l3;
+
+	if (threshold == 0) {
+#if defined(__GLIBC__) && defined(HAVE_X86)
+		/* glibc's memcpy() streams itself from 3/4 of the shared cache */
+		l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+		threshold = l3 > 0 ? l3 / 4 * 3 : LONG_MAX;
+#else
+		threshold = LONG_MAX;
+#endif
+	}
+	return threshold;
+}
+
+/* More threads than CPUs online only take turns at the copy. */
+static int copy_threads(long extent, int threads)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (threads <= 0 && cpus > extent / THREAD_MIN)
+		cpus = extent / THREAD_MIN;
+	if (threads <= 0 || threads > cpus)
+		threads = cpus;
+	if (threads > THREAD_MAX)
+		threads = THREAD_MAX;
+	if (threads < 1)
+		threads = 1;
+	return threads;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static void copy_nt_avx2(char *d, const char *s, size_t n)
+{
+	size_t head = -(uintptr_t)d & 31;
+	__m256i a, b, c, e;
+
+	if (head > n)
+		head = n;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	for (; n >= 128; n -= 128, d += 128, s += 128) {
+		a = _mm256_loadu_si256((const __m256i *)s);
+		b = _mm256_loadu_si256((const __m256i *)(s + 32));
+		c = _mm256_loadu_si256((const __m256i *)(s + 64));
+		e = _mm256_loadu_si256((const __m256i *)(s + 96));
+		_mm256_stream_si256((__m256i *)d, a);
+		_mm256_stream_si256((__m256i *)(d + 32), b);
+		_mm256_stream_si256((__m256i *)(d + 64), c);
+		_mm256_stream_si256((__m256i *)(d + 96), e);
+	}
+	for (; n >= 32; n -= 32, d += 32, s += 32)
+		_mm256_stream_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+	_mm_sfence();
+	memcpy(d, s, n);
+}
+
+static void copy_nt_sse2(char *d, const char *s, size_t n)
+{
+	size_t head = -(uintptr_t)d & 15;
+	__m128i a, b, c, e;
+
+	if (head > n)
+		head = n;
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+
+	for (; n >= 64; n -= 64, d += 64, s += 64) {
+		a = _mm_loadu_si128((const __m128i *)s);
+		b = _mm_loadu_si128((const __m128i *)(s + 16));
+		c = _mm_loadu_si128((const __m128i *)(s + 32));
+		e = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+	}
+	for (; n >= 16; n -= 16, d += 16, s += 16)
+		_mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+	_mm_sfence();
+	memcpy(d, s, n);
+}
+#endif
+
+static void copy_nt(char *d, const char *s, size_t n)
+{
+#ifdef HAVE_X86
+	if (__builtin_cpu_supports("avx2"))
+		copy_nt_avx2(d, s, n);
+	else if (__builtin_cpu_supports("sse2"))
+		copy_nt_sse2(d, s, n);
+	else
+#endif
+		memcpy(d, s, n);
+}
+
+struct copy_job {
+	char *d;
+	const char *s;
+	size_t n;
+	int strategy;
+};
+
+static void *copy_thread(void *arg)
+{
+	struct copy_job *job = arg;
+
+	if (job->strategy == VFI_COPY_MEMCPY)
+		memcpy(job->d, job->s, job->n);
+	else
+		copy_nt(job->d, job->s, job->n);
+	return NULL;
+}
+
+int vfi_copy_strategy(long extent, int threads)
+{
+	if (extent < nt_threshold())
+		return VFI_COPY_MEMCPY;
+	if (copy_threads(extent, threads) > 1)
+		return VFI_COPY_PARALLEL;
+	/* one thread of our streaming stores loses to memcpy() doing the same */
+	if (extent >= libc_nt_threshold())
+		return VFI_COPY_MEMCPY;
+	return VFI_COPY_STREAM;
+}
+
+int vfi_copy_map(struct vfi_map *dst, long long doff, struct vfi_map *src, long long soff,
+		 long extent, int threads)
+{
+	struct copy_job job[THREAD_MAX];
+	pthread_t tid[THREAD_MAX];
+	char *d;
+	const char *s;
+	long per;
+	int i, n, started, strategy;
+
+	if (doff < 0 || soff < 0 || extent < 0 ||
+	    dst->extent < doff + extent || src->extent < soff + extent)
+		return VFI_RESULT(-EINVAL);
+
+	d = (char *)dst->mem + doff;
+	s = (char *)src->mem + soff;
+
+	/* the same memory, through slices perhaps, overlapping */
+	if (d < s + extent && s < d + extent) {
+		memmove(d, s, extent);
+		return 0;
+	}
+
+	strategy = vfi_copy_strategy(extent, threads);
+	if (strategy != VFI_COPY_PARALLEL) {
+		job[0].d = d;
+		job[0].s = s;
+		job[0].n = extent;
+		job[0].strategy = strategy;
+		copy_thread(&job[0]);
+		return 0;
+	}
+
+	threads = copy_threads(extent, threads);
+
+	/* pieces in whole cache lines so no two threads share one */
+	per = ((extent + threads - 1) / threads + 63) & ~63L;
+	for (n = 0; n < threads && n * per < extent; n++) {
+		job[n].d = d + n * per;
+		job[n].s = s + n * per;
+		job[n].n = extent - n * per < per ? extent - n * per : per;
+		job[n].strategy = VFI_COPY_STREAM;
+	}
+
+	for (started = 1; started < n; started++)
+		if (pthread_create(&tid[started], NULL, copy_thread, &job[started]))
+			break;
+	/* anything we could not hand off is done here */
+	for (i = started; i < n; i++)
+		copy_thread(&job[i]);
+	copy_thread(&job[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(tid[i], NULL);
+	return 0;
+}
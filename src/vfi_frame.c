@@ -0,0 +1,185 @@
+#include <vfi_api.h>
+#include <vfi_log.h>
+
+#define MY_ERROR VFI_DBG_DEFAULT
+#define MY_DEBUG (VFI_DBG_EVERYONE | VFI_DBG_EVERYTHING | VFI_LOG_DEBUG)
+
+/*
+ * Compact binary framing of the common verbs. A frame carries the
+ * verb as a byte and the request/reply tag and result as integers;
+ * everything else the command said is kept as the body text so the
+ * transcoding is lossless and the string API works unchanged on top.
+ * Commands with verbs outside the table travel as VFI_VERB_TEXT
+ * frames whose body keeps the verb, but still with the tag and
+ * result in the header.
+ */
+static struct {
+	char *name;
+	int size;
+} verbs[] = {
+	[VFI_VERB_TEXT] = { "", 0 },
+	[VFI_VERB_EVENT_START] = { "event_start", sizeof("event_start") - 1 },
+	[VFI_VERB_EVENT_CHAIN] = { "event_chain", sizeof("event_chain") - 1 },
+	[VFI_VERB_BIND_CREATE] = { "bind_create", sizeof("bind_create") - 1 },
+};
+
+#define NVERBS (sizeof(verbs)/sizeof(verbs[0]))
+
+static int find_verb(const char *cmd, int size)
+{
+	int v;
+	for (v = VFI_VERB_TEXT + 1; v < NVERBS; v++)
+		if (size == verbs[v].size && !strncmp(cmd, verbs[v].name, size))
+			return v;
+	return VFI_VERB_TEXT;
+}
+
+/* Next delimiter from @set at or after @pos, clamped to @len. */
+static inline int next(struct vfi_delims *d, int pos, const char *set, int len)
+{
+	pos = vfi_next_delim(d, pos, set);
+	return pos < len ? pos : len;
+}
+
+/* Returns 1 and fills in @f if the option is one the frame header carries. */
+static int header_opt(struct vfi_frame *f, const char *name, int size,
+		      const char *val, int vlen)
+{
+	unsigned long long tag;
+	long long result;
+
+	if (size == 6 && !strncmp(name, "result", 6)) {
+		vfi_parse_dec(val, vlen, &result);
+		f->result = result;
+		f->flags |= VFI_FRAME_RESULT;
+		return 1;
+	}
+	if ((size == 7 && !strncmp(name, "request", 7)) ||
+	    (size == 5 && !strncmp(name, "reply", 5))) {
+		vfi_parse_hex(val, vlen, &tag);
+		f->tag = tag;
+		f->flags |= VFI_FRAME_TAG;
+		if (size == 5)
+			f->flags |= VFI_FRAME_REPLY;
+		return 1;
+	}
+	return 0;
+}
+
+int vfi_frame_encode(const char *cmd, int len, char *buf, int size)
+{
+	struct vfi_frame *f = (struct vfi_frame *)buf;
+	struct vfi_delims d;
+	char *body = f->b;
+	int pos, end, stop, sep;
+	int verb;
+
+	while (len && cmd[len-1] == '\n')
+		len--;
+
+	if (size < sizeof(*f) + len)
+		return VFI_RESULT(-E2BIG);
+
+	memset(f, 0, sizeof(*f));
+	f->magic = VFI_FRAME_MAGIC;
+
+	end = strstr(cmd, "://") ? strstr(cmd, "://") - cmd : len;
+	if (end >= len) {
+		memcpy(body, cmd, len);
+		f->len = sizeof(*f) + len;
+		return f->len;
+	}
+
+	verb = find_verb(cmd, end);
+	if (verb == VFI_VERB_TEXT) {
+		memcpy(body, cmd, end + 3);
+		body += end + 3;
+	}
+
+	if (vfi_scan_delims(&d, cmd) < 0)
+		return VFI_RESULT(-ENOMEM);
+
+	/*
+	 * Copy everything after the :// into the body except request(),
+	 * reply() and result() which go in the header. Each option list
+	 * is rebuilt so the separators stay well formed without them.
+	 */
+	pos = end + 3;
+	while (pos < len) {
+		end = next(&d, pos, "?", len);
+		memcpy(body, cmd + pos, end - pos);
+		body += end - pos;
+		if (end == len)
+			break;
+
+		sep = '?';
+		pos = end + 1;
+		for (;;) {
+			end = next(&d, pos, NULL, len);
+			stop = end;
+			if (cmd[end] == '(')
+				stop = next(&d, end, ")", len) + (end < len);
+			if (stop > len)
+				stop = len;
+
+			if (cmd[end] != '(' ||
+			    !header_opt(f, cmd + pos, end - pos, cmd + end + 1, stop - end - 1)) {
+				*body++ = sep;
+				memcpy(body, cmd + pos, stop - pos);
+				body += stop - pos;
+				sep = ',';
+			}
+			pos = stop;
+			if (pos >= len || cmd[pos] != ',')
+				break;
+			pos++;
+		}
+	}
+
+	vfi_release_delims(&d);
+
+	f->verb = verb;
+	f->len = body - buf;
+	return f->len;
+}
+
+int vfi_frame_decode(const char *buf, int len, struct vfi_cmd_buf *cb)
+{
+	const struct vfi_frame *f = (const struct vfi_frame *)buf;
+	const char *last;
+	int ret;
+
+	vfi_cmd_reset(cb);
+
+	if (len < sizeof(*f) || f->magic != VFI_FRAME_MAGIC ||
+	    f->len > len || f->verb >= NVERBS)
+		return VFI_RESULT(-EINVAL);
+	/* a length short of the header would leave a negative body */
+	if (f->len < sizeof(*f))
+		return VFI_RESULT(-EBADMSG);
+
+	len = f->len - sizeof(*f);
+	if (f->verb != VFI_VERB_TEXT)
+		ret = vfi_cmd_put(cb, verbs[f->verb].name, verbs[f->verb].size) ||
+			vfi_cmd_lit(cb, "://");
+	else
+		ret = 0;
+
+	ret = ret || vfi_cmd_put(cb, f->b, len);
+
+	/* header options join the last option list, the src side of a bind */
+	for (last = f->b + len; last > f->b && last[-1] != '='; last--)
+		;
+	cb->opts = memchr(last, '?', f->b + len - last) != NULL;
+
+	if (!ret && (f->flags & VFI_FRAME_RESULT))
+		ret = vfi_cmd_opt_dec(cb, "result", f->result);
+	if (!ret && (f->flags & VFI_FRAME_TAG)) {
+		if (f->flags & VFI_FRAME_REPLY)
+			ret = vfi_cmd_opt_hex(cb, "reply", f->tag);
+		else
+			ret = vfi_cmd_opt_hex(cb, "request", f->tag);
+	}
+
+	return ret ? VFI_RESULT(-ENOMEM) : 0;
+}
@@ -4,6 +4,8 @@
 #include <vfi_frmwrk.h>
 #include <vfi_log.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
 #define MY_ERROR VFI_DBG_DEFAULT
 #define MY_DEBUG (VFI_DBG_EVERYONE | VFI_DBG_EVERYTHING | VFI_LOG_DEBUG)
@@ -116,21 +118,85 @@ int bind_create_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char *
 	return VFI_RESULT(-ENOMEM);
 }
 
+/* buffers(N) on map_install, mmap_create and smb_create */
+static int map_buffers(char *cmd)
+{
+	long buffers;
+
+	if (vfi_get_dec_arg(cmd,"buffers",&buffers) || buffers < 1)
+		return 0;
+	return buffers;
+}
+
+/* stream(chunk) on map_install, mmap_create and smb_create, hex like an extent */
+static long map_stream(char *cmd)
+{
+	long chunk;
+
+	if (vfi_get_hex_arg(cmd,"stream",&chunk) || chunk < 1)
+		return 0;
+	return chunk;
+}
+
+/* prefault and lock on map_install, mmap_create and smb_create */
+static int map_pin(char *cmd)
+{
+	int flags = 0;
+
+	if (vfi_get_option(cmd,"prefault"))
+		flags |= VFI_MAP_PREFAULT;
+	if (vfi_get_option(cmd,"lock"))
+		flags |= VFI_MAP_LOCK;
+	return flags;
+}
+
 static int mmap_create_closure(void *e, struct vfi_dev *dev, struct vfi_async_handle *ah, char *result)
 {
 	long offset;
-	void *mem;
 	int prot = PROT_READ | PROT_WRITE;
 	int flags = MAP_SHARED;
+	int err = 0;
 
 	struct vfi_map *p = e;
+	/* until mapped, flags holds the pinning asked for */
+	int pin = p->flags;
+
+	if (pin & VFI_MAP_PREFAULT)
+		flags |= MAP_POPULATE;
 	if (!vfi_get_hex_arg(result,"mmap_offset",&offset)) {
-		p->mem = mmap(0,p->extent,prot,flags,vfi_fileno(dev), offset);
-		if (vfi_register_map(dev,p->name,e))
-			printf("%s: register map failed\n", __func__);
+		p->flags = 0;
+		if (p->stream) {
+			/* a ring map sees the device memory twice over */
+			if (err = vfi_alloc_ring_mem(p,p->extent,vfi_fileno(dev),offset))
+				vfi_log(VFI_LOG_ERR, "%s: Failed to map ring %s. Error is %d", __func__, p->name, err);
+			else if (pin && (err = vfi_pin_map(p,pin)))
+				vfi_log(VFI_LOG_ERR, "%s: Failed to pin %s. Error is %d", __func__, p->name, err);
+		}
+		else {
+			p->mem = mmap(0,p->extent,prot,flags,vfi_fileno(dev), offset);
+			if (p->mem == MAP_FAILED) {
+				err = -errno;
+				p->mem = NULL;
+				vfi_log(VFI_LOG_ERR, "%s: Failed to map %s. Error is %d", __func__, p->name, err);
+			}
+			else {
+				p->alloc = VFI_MAP_ALLOC_MMAP;
+				p->alloc_extent = p->extent;
+				if ((pin & VFI_MAP_LOCK) && (err = vfi_pin_map(p,pin)))
+					vfi_log(VFI_LOG_ERR, "%s: Failed to lock %s. Error is %d", __func__, p->name, err);
+				p->flags |= pin & VFI_MAP_PREFAULT;
+			}
+		}
+		if (!err && p->buffers > 1 && (err = vfi_map_set_buffers(p,p->buffers)))
+			vfi_log(VFI_LOG_ERR, "%s: Failed to divide %s into %d buffers. Error is %d",
+				__func__, p->name, p->buffers, err);
+		if (!err && (err = vfi_register_map(dev,p->name,e)))
+			vfi_log(VFI_LOG_ERR, "%s: Failed to register map %s. Error is %d", __func__, p->name, err);
 		vfi_set_async_handle(ah,NULL);
+		if (err)
+			vfi_free_map(p);
 	}
-	return 0;
+	return VFI_RESULT(err);
 }
 
 int mmap_create_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
@@ -143,10 +209,16 @@ int mmap_create_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char *
 			vfi_log(VFI_LOG_ERR, "%s: Failed to allocate map. Error is %d", __func__, err);
 		else {
 			e->f = mmap_create_closure;
+			e->buffers = map_buffers(*cmd);
+			e->flags = map_pin(*cmd);
 			if (err = vfi_get_extent(*cmd,&e->extent)) {
 				vfi_log(VFI_LOG_ERR, "%s: Parse error. Extent not found. Error is %d", __func__, err);
 				free(e);
 			}
+			else if (map_stream(*cmd) && (err = vfi_map_set_stream(e,map_stream(*cmd)))) {
+				vfi_log(VFI_LOG_ERR, "%s: Bad stream chunk for extent. Error is %d", __func__, err);
+				free(e);
+			}
 			else
 				free(vfi_set_async_handle(ah,e));
 		}
@@ -157,37 +229,71 @@ int mmap_create_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char *
 
 static int smb_name_closure(void *e, struct vfi_dev *dev, struct vfi_async_handle *ah, char *result)
 {
-	struct {void *f; char *name; long address; char **cmd;} *p = e;
-	struct vfi_map *me;
-	vfi_alloc_map(&me,p->name);
+	struct {void *f; char *name; long address; char **cmd; int buffers; int pin;} *p = e;
+	struct vfi_map *me = NULL;
+	int err;
+
+	if (err = vfi_alloc_map(&me,p->name)) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate map. Error is %d", __func__, err);
+		goto done;
+	}
  	vfi_get_extent(result,&me->extent);
 	me->mem = (char *)p->address;
-	vfi_register_map(dev,me->name,me);
+	if (p->pin && (err = vfi_pin_map(me,p->pin)))
+		vfi_log(VFI_LOG_ERR, "%s: Failed to pin %s. Error is %d", __func__, me->name, err);
+	else if (p->buffers > 1 && (err = vfi_map_set_buffers(me,p->buffers)))
+		vfi_log(VFI_LOG_ERR, "%s: Failed to divide %s into %d buffers. Error is %d",
+			__func__, me->name, p->buffers, err);
+	else if (err = vfi_register_map(dev,me->name,me))
+		vfi_log(VFI_LOG_ERR, "%s: Failed to register map %s. Error is %d", __func__, me->name, err);
+	if (err)
+		vfi_free_map(me);
+ done:
 	free(p->name);
 	free(vfi_set_async_handle(ah,NULL));
-	return 0;
+	return VFI_RESULT(err);
 }
 
 static int smb_create_closure(void *e, struct vfi_dev *dev, struct vfi_async_handle *ah, char *result)
 {
-	int i;
 	char *smb;
-	struct {void *f; char *name; char **cmd;} *p = e;
+	struct vfi_cmd_buf cb;
+	struct {void *f; char *name; char **cmd; int buffers; int pin; long stream;} *p = e;
 	struct vfi_map *me;
-	vfi_alloc_map(&me,p->name);
-	sscanf(result+strlen("smb_create://"),"%a[^?]",&smb);
-	sprintf(*p->cmd,"mmap_create://%s?map_name(%s)",smb,p->name);
-	free(smb);
-	me->f = mmap_create_closure;
+	int err;
+
+	if (err = vfi_alloc_map(&me,p->name)) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate map. Error is %d", __func__, err);
+		goto done;
+	}
+	me->buffers = p->buffers;
+	me->flags = p->pin;
  	vfi_get_extent(result,&me->extent);
+	if (p->stream && (err = vfi_map_set_stream(me,p->stream))) {
+		vfi_log(VFI_LOG_ERR, "%s: Bad stream chunk %lx for %s. Error is %d", __func__, p->stream, p->name, err);
+		vfi_free_map(me);
+		goto done;
+	}
+	smb = result + strlen("smb_create://");
+	vfi_cmd_init(&cb);
+	if (!vfi_build_mmap_create(&cb,smb,strcspn(smb,"?"),p->name)) {
+		free(*p->cmd);
+		*p->cmd = vfi_cmd_dup(&cb);
+	}
+	vfi_cmd_release(&cb);
+	me->f = mmap_create_closure;
 	free(p->name);
 	free(vfi_set_async_handle(ah,me));
 	return 0;
+ done:
+	free(p->name);
+	free(vfi_set_async_handle(ah,NULL));
+	return VFI_RESULT(err);
 }
 
 int smb_create_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
 {
-	/* smb_create://smb.loc.f#off:ext?map_name(name),map_address(address) */
+	/* smb_create://smb.loc.f#off:ext?map_name(name),map_address(address),buffers(n) */
 	char *name;
 	char *result = NULL;
 	unsigned long address;
@@ -201,11 +307,14 @@ int smb_create_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **
 
 	if (!map && named) 
 		if (!sourced) {
-			struct {void *f; char *name; char **cmd;} *e = calloc(1,sizeof(*e));
+			struct {void *f; char *name; char **cmd; int buffers; int pin; long stream;} *e = calloc(1,sizeof(*e));
 			if (e) {
 				e->f =smb_create_closure;
 				e->name = name;
 				e->cmd = cmd;
+				e->buffers = map_buffers(*cmd);
+				e->pin = map_pin(*cmd);
+				e->stream = map_stream(*cmd);
 				free(vfi_set_async_handle(ah,e));
 				return 0;
 			}
@@ -213,35 +322,47 @@ int smb_create_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **
 			return -ENOMEM;
 		}
 		else {
-			struct {void *f; char *name; long address; char **cmd;} *e = calloc(1,sizeof(*e));
+			struct {void *f; char *name; long address; char **cmd; int buffers; int pin;} *e = calloc(1,sizeof(*e));
 			if (e) {
-				char *old_cmd = *cmd;
-				*cmd = malloc(strlen(old_cmd)+64);
-				if (*cmd) {
-					sprintf(*cmd,"%s,mytid(%d)",old_cmd,getpid());
-					free(old_cmd);
+				struct vfi_cmd_buf cb;
+				char *new_cmd = NULL;
+				vfi_cmd_init(&cb);
+				if (!vfi_cmd_from(&cb,*cmd) && !vfi_cmd_opt_dec(&cb,"mytid",getpid()))
+					new_cmd = vfi_cmd_dup(&cb);
+				vfi_cmd_release(&cb);
+				if (new_cmd) {
+					free(*cmd);
+					*cmd = new_cmd;
 					e->f =smb_name_closure;
 					e->name = name;
 					e->address = address;
 					e->cmd = cmd;
+					e->buffers = map_buffers(*cmd);
+					e->pin = map_pin(*cmd);
 					free(vfi_set_async_handle(ah,e));
 					return 0;
 				}
-				*cmd = old_cmd;
+				free(e);
 			}
 			free(name);
 			return -ENOMEM;
 		}
 	else if (map && !sourced) {
 		/* add map_address from map */
-		char *old_cmd = *cmd;
-		*cmd = malloc(strlen(old_cmd)+96);
-		if (*cmd) {
-			sprintf(*cmd,"%s,map_address(%lx),map_extent(%lx),mytid(%d)",old_cmd,map->mem,map->extent,getpid());
-			free(old_cmd);
+		struct vfi_cmd_buf cb;
+		char *new_cmd = NULL;
+		vfi_cmd_init(&cb);
+		if (!vfi_cmd_from(&cb,*cmd) &&
+		    !vfi_cmd_opt_hex(&cb,"map_address",(unsigned long)map->mem) &&
+		    !vfi_cmd_opt_hex(&cb,"map_extent",map->extent) &&
+		    !vfi_cmd_opt_dec(&cb,"mytid",getpid()))
+			new_cmd = vfi_cmd_dup(&cb);
+		vfi_cmd_release(&cb);
+		if (new_cmd) {
+			free(*cmd);
+			*cmd = new_cmd;
 			return 0;
 		}
-		*cmd = old_cmd;
 		return -ENOMEM;
 	}
 
@@ -250,10 +371,13 @@ int smb_create_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **
 
 int map_install_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
 {
-	/* map_install://fred:4000 */
+	/* map_install://fred:4000[?buffers(n)][,hugepage][,align(x)][,numa(node)][,prefault][,lock][,stream(chunk)] */
 	char *name = NULL;
 	char *location = NULL;
 	long extent;
+	long align;
+	long node;
+	int flags;
 	int ret;
 	struct vfi_map *map;
 
@@ -267,30 +391,150 @@ int map_install_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char *
 	if (ret)
 		goto name;
 
-	ret = vfi_alloc_map(&map,name);
-	if (ret)
+	if (vfi_get_hex_arg(*cmd,"align",&align))
+		align = 0;
+	if (vfi_get_dec_arg(*cmd,"numa",&node))
+		node = -1;
+
+	flags = (vfi_get_option(*cmd,"hugepage") ? VFI_MAP_HUGEPAGE : 0) | map_pin(*cmd);
+	if (map_stream(*cmd) && map_buffers(*cmd) > 1) {
+		ret = -EINVAL;
+		vfi_log(VFI_LOG_ERR, "%s: A ring map cannot also be multi buffered. Error is %d", __func__, ret);
 		goto name;
+	}
 
-	map->mem = malloc(extent);
-	if (map->mem == NULL)
-		goto mem;
+	if (map_stream(*cmd)) {
+		ret = vfi_alloc_map(&map,name);
+		if (ret)
+			goto name;
 
-	map->extent = extent;
+		if ((ret = vfi_alloc_ring_mem(map,extent,-1,0)) ||
+		    (ret = vfi_map_set_stream(map,map_stream(*cmd))) ||
+		    (flags & ~VFI_MAP_HUGEPAGE && (ret = vfi_pin_map(map,flags)))) {
+			vfi_log(VFI_LOG_ERR, "%s: Failed to make %s a ring. Error is %d", __func__, name, ret);
+			goto map;
+		}
+	}
+	/* plain maps come from the device's arena if it has one with room */
+	else if (flags || align || node >= 0 || vfi_arena_alloc_map(dev,&map,name,extent)) {
+		ret = vfi_alloc_map(&map,name);
+		if (ret)
+			goto name;
+
+		ret = vfi_alloc_map_mem(map,extent,flags,align,node);
+		if (ret) {
+			vfi_log(VFI_LOG_ERR, "%s: Failed to allocate %lx bytes for %s. Error is %d", __func__, extent, name, ret);
+			goto map;
+		}
+	}
+
+	if (map_buffers(*cmd) > 1 && (ret = vfi_map_set_buffers(map,map_buffers(*cmd))))
+		goto map;
 
 	ret = vfi_register_map(dev,name,map);
 	if (ret)
 		goto map;
 
+	free(name);
 	return 1;
 
 map:
-	free(map->mem);
-mem:
-	free(map);
+	vfi_free_map(map);
 name:
 	free(name);
 out:
-	return ret;
+	return VFI_RESULT(ret);
+}
+
+int map_slice_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
+{
+	/* map_slice://parent#off:ext?map_name(name) */
+	char *name = NULL;
+	char *location = NULL;
+	char *slice = NULL;
+	struct vfi_map *parent;
+	long long offset;
+	long extent;
+	int ret;
+
+	ret = vfi_get_name_location(*cmd,&name,&location);
+	if (ret)
+		return VFI_RESULT(ret);
+
+	free(location);
+
+	if (vfi_get_str_arg(*cmd,"map_name",&slice) != 1) {
+		ret = -EINVAL;
+		vfi_log(VFI_LOG_ERR, "%s: Parse error. map_name not found. Error is %d", __func__, ret);
+		goto out;
+	}
+	if (ret = vfi_find_map(dev,name,&parent)) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to lookup map %s. Error is %d", __func__, name, ret);
+		goto out;
+	}
+	if (vfi_get_offset(*cmd,&offset)) /* Offset defaults to 0 */
+		offset = 0;
+	if (vfi_get_extent(*cmd,&extent)) /* Extent defaults to the rest of the map */
+		extent = parent->extent - offset;
+
+	if (ret = vfi_map_slice(dev,parent,slice,offset,extent))
+		vfi_log(VFI_LOG_ERR, "%s: Failed to slice %s#%llx:%lx. Error is %d", __func__, name, offset, extent, ret);
+out:
+	free(slice);
+	free(name);
+	if (ret)
+		return VFI_RESULT(ret);
+	return 1;
+}
+
+int map_arena_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
+{
+	/* map_arena://:100000[?maps(n)][,hugepage][,prefault][,lock] */
+	long size;
+	long maps;
+	int ret;
+
+	ret = vfi_get_extent(*cmd,&size);
+	if (ret) {
+		vfi_log(VFI_LOG_ERR, "%s: Parse error. Extent not found. Error is %d", __func__, ret);
+		return VFI_RESULT(ret);
+	}
+	if (vfi_get_dec_arg(*cmd,"maps",&maps))
+		maps = 0;
+
+	ret = vfi_arena_create(dev,size,maps,
+			       (vfi_get_option(*cmd,"hugepage") ? VFI_MAP_HUGEPAGE : 0) | map_pin(*cmd));
+	if (ret) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to create arena. Error is %d", __func__, ret);
+		return VFI_RESULT(ret);
+	}
+	return 1;
+}
+
+int map_uninstall_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
+{
+	/* map_uninstall://fred */
+	char *name = NULL;
+	char *location = NULL;
+	struct vfi_map *map;
+	int ret;
+
+	ret = vfi_get_name_location(*cmd,&name,&location);
+	if (ret)
+		return VFI_RESULT(ret);
+
+	free(location);
+
+	ret = vfi_find_map(dev,name,&map);
+	if (ret)
+		vfi_log(VFI_LOG_ERR, "%s: Failed to lookup map %s. Error is %d", __func__, name, ret);
+	else if (!(ret = vfi_unregister_map(dev,name,&map)))
+		vfi_free_map(map);
+
+	free(name);
+	if (ret)
+		return VFI_RESULT(ret);
+	return 1;
 }
 
 static int event_find_closure(void *e, struct vfi_dev *dev, struct vfi_async_handle *ah, char *result)
@@ -333,8 +577,23 @@ int event_find_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **
 	return 0;
 }
 
+/*
+ * Waits retry with exponential backoff, from WAIT_FIRST_US doubling
+ * to wait_cap(us), until the driver says yes or wait_timeout(ms)
+ * passes. Without a timeout they wait for ever, as they always did.
+ */
+#define WAIT_FIRST_US 10
+#define WAIT_CAP_US 100000
+
+struct wait_closure {
+	void *f;
+	struct vfi_backoff b;
+};
+
 static int wait_closure(void *e, struct vfi_dev *dev, struct vfi_async_handle *ah, char *result)
 {
+	struct wait_closure *w = e;
+	long long ns;
 	long rslt;
 	int rc;
 	rc = vfi_get_dec_arg(result,"result",&rslt);
@@ -343,19 +602,71 @@ static int wait_closure(void *e, struct vfi_dev *dev, struct vfi_async_handle *a
 		return VFI_RESULT(-EIO);
 	}
 	if (rslt) {
-		sleep(1);
-		return 1;
+		rc = vfi_backoff_wait(dev, &w->b);
+		if (rc == 0) {
+			vfi_retry_async_handle(ah);
+			return 1;
+		}
+		vfi_log(VFI_LOG_ERR, "%s: Gave up after %d retries. Error is %d",
+			__func__, w->b.retries, rc);
 	}
+	ns = vfi_backoff_done(dev, &w->b, rc != 0);
+	vfi_log(VFI_LOG_DEBUG, "%s: Waited %lldns, %d retries", __func__, ns, w->b.retries);
 	free(vfi_set_async_handle(ah,NULL));
+	return VFI_RESULT(rc);
+}
+
+/*
+ * Commands run often from compiled programs have a bound form, see
+ * vfi_bind_pre_cmd(): the arguments are parsed, and the objects they
+ * name looked up, once into a state which the command then runs
+ * from. The text form parses into a state on the stack and runs the
+ * same way.
+ */
+static void *bound_state(void *args, size_t size)
+{
+	void *state = malloc(size);
+
+	if (state)
+		memcpy(state, args, size);
+	return state;
+}
+
+struct wait_args {
+	int wait;
+	long timeout;
+	long cap;
+};
+
+static void wait_args(char *cmd, struct wait_args *a)
+{
+	/* sync_wait always waits, location_find only when given ?wait */
+	a->wait = !strncmp(cmd,"sync_wait:",10) || vfi_get_option(cmd,"wait");
+	a->timeout = 0;
+	a->cap = WAIT_CAP_US;
+	vfi_get_dec_arg(cmd,"wait_timeout",&a->timeout);
+	vfi_get_dec_arg(cmd,"wait_cap",&a->cap);
+}
+
+static int wait_bind(struct vfi_dev *dev, char *cmd, void **state)
+{
+	struct wait_args *a = malloc(sizeof(*a));
+
+	if (a == NULL)
+		return VFI_RESULT(-ENOMEM);
+	wait_args(cmd,a);
+	*state = a;
 	return 0;
 }
 
-int wait_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
+static int wait_run(struct vfi_dev *dev, struct vfi_async_handle *ah, void *state, char **cmd)
 {
+	struct wait_args *a = state;
 	int err = 0;
-	if (vfi_get_option(*cmd,"wait")) {
-		struct {void *f;} *e = calloc(1,sizeof(*e));
+	if (a->wait) {
+		struct wait_closure *e = calloc(1,sizeof(*e));
 		if (e) {
+			vfi_backoff_init(&e->b, WAIT_FIRST_US, a->cap, a->timeout);
 			e->f = wait_closure;
 			free(vfi_set_async_handle(ah,e));
 		}
@@ -369,379 +680,1509 @@ int wait_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
 	return VFI_RESULT(err);
 }
 
-int pipe_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **command)
+int wait_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
 {
-	/* pipe://[<inmap><]*<func>[(<event>[,<event>]*)][><omap>]*  */
-
-	char *sp;
-	char *iter;
-	int size = 0;
-	int i = 0;
-	int numpipe = 0;
-	int outmaps = 0;
-	int events = 0;
-	int func = 0;
-	int found_func = 0;
-	int inmaps = 0;
-	int numimaps = 0;
-	int numomaps = 0;
-	int numevnts = 0;
-	int numin = 0;
-	int numout = 0;
-	void **pipe = NULL;
-	char *elem[20];
-	int elem_cnt = 0;
-	void *e;
-	char *cmd;
-	char *result = NULL;
-	char *eloc;
-	int err = 0;
-	long rslt = 0;
+	struct wait_args a;
 
-	vfi_parse_unary_op(*command, &cmd, &sp);
-	free(cmd);
-	iter = sp;
+	wait_args(*cmd,&a);
+	return wait_run(dev,ah,&a,NULL);
+}
 
-	while (*iter) {
-		if (sscanf(iter,"%a[^<>,()]%n",&elem[elem_cnt],&size) > 0) {
-			switch (*(iter+size)) {
-			case '<':
-				inmaps = elem_cnt;
-				break;
-			case '(':
-				func = elem_cnt;
-				found_func = 1;
-				break;
-			case ')':
-				events = elem_cnt;
-				break;
-			case ',':
-				break;
-			case '>':
-				if (!found_func) {
-					func = elem_cnt;
-					found_func = 1;
-				}
-				outmaps = elem_cnt;
-				break;
+/*
+ * Sends event_chain, or event_unchain, for each link i of events[i] to
+ * events[i+1] marked in @todo. All go to the driver at once, each on
+ * its own handle, and the replies are collected after, so a pipeline
+ * of N events costs one round trip rather than N - 1. On return @done
+ * marks the links which succeeded. With %VFI_RUN_DISPATCH in @flags
+ * the replies are read here rather than by a dispatcher thread.
+ */
+static int collect_links(struct vfi_dev *dev, struct vfi_async_handle **ah,
+			 char **results, int links)
+{
+	struct vfi_async_handle *tag;
+	char *result;
+	int i, left;
+	int ret;
 
-			default:
-				if (!found_func) {
-					func = elem_cnt;
-					found_func = 1;
-				}
-				outmaps = elem_cnt;
+	for (left = i = 0; i < links; i++)
+		left += ah[i] != NULL;
+
+	while (left) {
+		ret = vfi_get_result(dev,&result);
+		if (ret <= 0)
+			return VFI_RESULT(ret ? ret : -EIO);
+
+		tag = NULL;
+		vfi_get_hex_arg(result,"reply",(long *)&tag);
+		for (i = 0; i < links; i++)
+			if (ah[i] && ah[i] == tag && results[i] == NULL)
 				break;
-			}
-			elem_cnt++;
-			iter += size;
+		if (i == links) {
+			vfi_log(VFI_LOG_ERR, "%s: Unmatched reply %s", __func__, result);
+			free(result);
+			continue;
 		}
-		else
-			iter += 1;
+		results[i] = result;
+		left--;
 	}
+	return 0;
+}
 
-	free(sp);
-
-	numpipe = elem_cnt + 1;
-	numimaps = func;
-
-	if (events)
-		numevnts = events - func;
-	else
-		events = func;
-	if (outmaps)
-		numomaps = outmaps - events; 
-
-	if (numevnts == 0) {
-		err = -EINVAL;
-		vfi_log(VFI_LOG_ERR, "%s: 0 events specified. Error is %d", __func__, elem[i], err);
-		goto done;
-	}
+static int send_links(struct vfi_dev *dev, char **events, int links, int unchain,
+		      const char *todo, char *done, int flags)
+{
+	struct vfi_async_handle **ah;
+	struct vfi_cmd_buf cb;
+	char **results;
+	void *e;
+	long rslt;
+	int i, ret;
+	int err = 0;
 
-	pipe = calloc(numpipe-numevnts,sizeof(void *));
-	if (!pipe) {
+	ah = calloc(links, 2 * sizeof(*ah));
+	results = (char **)(ah + links);
+	if (ah == NULL) {
 		err = -ENOMEM;
 		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, err);
+		return VFI_RESULT(err);
 	}
 
-	if (err = vfi_find_func(dev,elem[func],&pipe[0], &numin, &numout)) {
-		vfi_log(VFI_LOG_ERR, "%s: Failed to lookup function %s. Error is %d", __func__, elem[func], err);
-		goto done;
-	}
-
-	if (numin >= 0 && numin != numimaps) {
-		err = -EINVAL;
-		vfi_log(VFI_LOG_ERR, "%s: Number of input maps (%d) differs from expected (%d) for function %s",
-			__func__, numimaps, numin, elem[func]);
-		goto done;
-	}
-
-	if (numout >= 0 && numout != numomaps) {
-		err = -EINVAL;
-		vfi_log(VFI_LOG_ERR, "%s: Number of output maps (%d) differs from expected (%d) for function %s",
-			__func__, numomaps, numout, elem[func]);
-		goto done;
+	vfi_cmd_init(&cb);
+	for (i = 0; i < links; i++) {
+		done[i] = 0;
+		if (!todo[i])
+			continue;
+		if ((ah[i] = vfi_alloc_async_handle(NULL)) == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+		if (unchain)
+			ret = vfi_build_event_unchain(&cb,events[i],ah[i],events[i+1],
+						      strcspn(events[i+1],"."));
+		else
+			ret = vfi_build_event_chain(&cb,events[i],ah[i],events[i+1],
+						    strcspn(events[i+1],"."));
+		if (ret)
+			err = -ENOMEM;
+		else if (vfi_invoke_cmd_buf(dev,&cb) <= 0)
+			err = -EIO;
+		vfi_cmd_release(&cb);
+		if (err) {
+			vfi_free_async_handle(ah[i]);
+			ah[i] = NULL;
+			break;
+		}
 	}
-
-	for (i = 0; i< numimaps;i++)
-		if (err = vfi_find_map(dev,elem[i],(struct vfi_map **)&pipe[i+2])) {
-			vfi_log(VFI_LOG_ERR, "%s: Failed to find map %s. Error is %d", __func__, elem[i], err);
-			printf("%s:%d\n",__FUNCTION__,__LINE__);
-			goto done;
+	if (err)
+		vfi_log(VFI_LOG_ERR, "%s: Failed to send link %s. Error is %d", __func__, events[i], err);
+
+	if ((flags & VFI_RUN_DISPATCH) && (ret = collect_links(dev,ah,results,links)) && !err)
+		err = ret;
+
+	for (i = 0; i < links; i++) {
+		if (ah[i] == NULL)
+			continue;
+		if (!(flags & VFI_RUN_DISPATCH))
+			vfi_wait_async_handle(ah[i],&results[i],&e);
+		if (results[i] == NULL || vfi_get_dec_arg(results[i],"result",&rslt)) {
+			rslt = -EIO;
+			vfi_log(VFI_LOG_EMERG, "%s: Fatal error. Result string not returned from driver", __func__);
 		}
+		else if (rslt)
+			vfi_log(VFI_LOG_ERR, "%s: Command failed with error %ld (%s)", __func__, rslt, results[i]);
+		else
+			done[i] = 1;
+		if (rslt && !err)
+			err = rslt;
+		free(results[i]);
+		vfi_free_async_handle(ah[i]);
+	}
 
-	for (i = 0; i< numomaps;i++)
-		if (err = vfi_find_map(dev,elem[events+i+1],(struct vfi_map **)&pipe[func+i+2])) {
-			vfi_log(VFI_LOG_ERR, "%s: Failed to find map %s. Error is %d", __func__, elem[events+i+1], err);
-			goto done;
-		}
+	free(ah);
+	return VFI_RESULT(err);
+}
 
-	pipe[1] = (void *)(((numimaps & 0xff) << 0) | ((numomaps & 0xff) << 8));
-	pipe[1] =  (void *)((unsigned int)pipe[1] ^ (unsigned int)pipe[0]);
+/*
+ * Chains each of the @n events to the next. If any link fails, and
+ * the driver has event_unchain, those which were made are unchained
+ * again so the events are left as they were found. Otherwise they
+ * are left, and said so.
+ */
+static int chain_events(struct vfi_dev *dev, char **events, int n, int flags)
+{
+	char *todo;
+	char *eloc;
+	int i;
+	int err = 0;
 
-	if (numevnts > 1) {
-		for (i = 0; i< numevnts-1;i++) {
-			if (err = vfi_find_event(dev,elem[func+i+1],(void **)&eloc)) {
-				vfi_log(VFI_LOG_ERR, "%s: Failed to lookup event %s. Error is %d", __func__, elem[func+i+1], err);
-				goto done;
-			}
+	if (n < 2)
+		return 0;
 
-			cmd = malloc(strlen(elem[func+i+2]));
-			strcpy(cmd,elem[func+i+2]);
-			cmd[strcspn(elem[func+i+2],".")] = 0;
-			vfi_invoke_cmd(dev,"event_chain://%s?request(%p),event_name(%s)\n",
-    			       elem[func+i+1],ah,cmd);
-			free(cmd);
-
-			vfi_wait_async_handle(ah,&result,&e);
-			if (vfi_get_dec_arg(result,"result",&rslt)) {
-				err = -EIO;
-				vfi_log(VFI_LOG_EMERG, "%s: Fatal error. Result string not returned from driver", __func__);
-				goto done;
-			}
-			if (rslt) {
-#warning TODO: Add code to remove chain		
-				err = rslt;
-				vfi_log(VFI_LOG_ERR, "%s: Command failed with error %ld (%s)", __func__, rslt, result);
-				goto done;
-			}
+	for (i = 0; i < n - 1; i++)
+		if (err = vfi_find_event(dev,events[i],(void **)&eloc)) {
+			vfi_log(VFI_LOG_ERR, "%s: Failed to lookup event %s. Error is %d", __func__, events[i], err);
+			return VFI_RESULT(err);
 		}
-	}
-	
-	free(*command);
-	*command = malloc(128);
-	if (*command == NULL) {
+
+	todo = malloc(2 * (n - 1));
+	if (todo == NULL) {
 		err = -ENOMEM;
 		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, err);
-		goto done;
-	}
-	
-	i = snprintf(*command,128,"event_start://%s",elem[func+1]);
-	if (i >= 128) {
-		*command = realloc(*command,i+1);
-		snprintf(*command,128,"event_start://%s",elem[func+1]);
+		return VFI_RESULT(err);
 	}
-	
-	free(vfi_set_async_handle(ah,pipe));
-	
-done:
-	while (elem_cnt--)
-		free(elem[elem_cnt]);
-
-	if (err) {
-		if (pipe)
-			free(pipe);
-		if (*command) {
-			free(*command);
-			*command = NULL;
-		}
+	memset(todo, 1, n - 1);
+
+	err = send_links(dev, events, n - 1, 0, todo, todo + n - 1, flags);
+	if (err && !vfi_dev_unchain(dev)) {
+		for (i = 0; i < n - 1; i++)
+			if (todo[n - 1 + i])
+				vfi_log(VFI_LOG_ERR, "%s: Left %s chained to %s", __func__,
+					events[i], events[i + 1]);
 	}
+	else if (err && send_links(dev, events, n - 1, 1, todo + n - 1, todo, flags))
+		vfi_log(VFI_LOG_ERR, "%s: Failed to undo the chain from %s", __func__, events[0]);
 
+	free(todo);
 	return VFI_RESULT(err);
 }
 
-int unix_pipe_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **command)
+/*
+ * Pipes are compiled once into a struct vfi_pipe. The command is cut
+ * into tokens, each the name of an input map, the function, an event
+ * or an output map, then laid out with its names in one allocation
+ * and the names resolved. A cached pipe is resolved again only when
+ * something has been registered or unregistered since.
+ */
+enum { PIPE_IN, PIPE_FUNC, PIPE_EVENT, PIPE_OUT };
+
+struct pipe_tok {
+	const char *s;
+	int len;
+	int role;
+};
+
+struct pipe_toks {
+	struct pipe_tok *t;
+	int n;
+	int size;
+	int count[4];
+	int chars;
+};
+
+static int add_tok(struct pipe_toks *pt, const char *s, int len, int role)
 {
-	/* unix_pipe://<func>[<event> [<event>]*)][< <inmap>]*[> <omap>]*  */
+	struct pipe_tok *t;
 
-	char *sp;
-	char *cmd;
-	char *iter;
-	int size = 0;
-	int elem_cnt = 0;
-	char *elem[20];
-
-	int func = 0;
-	int found_func = 0;
-	int events = 0;
-	int inmaps = 0;
-	int outmaps = 0;
-
-	int numevnts = 0;
-	int numimaps = 0;
-	int numomaps = 0;
-
-	int i = 0;
-	int numpipe = 0;
-	int numin = 0;
-	int numout = 0;
-	void **pipe = NULL;
-	void *e;
-	char *result = NULL;
-	char *eloc;
+	while (len && (*s == ' ' || *s == '\t')) {
+		s++;
+		len--;
+	}
+	while (len && (s[len-1] == ' ' || s[len-1] == '\t'))
+		len--;
+	if (len == 0)
+		return 0;
+
+	if (pt->n == pt->size) {
+		t = realloc(pt->t, (pt->size ? pt->size * 2 : 16) * sizeof(*t));
+		if (t == NULL)
+			return VFI_RESULT(-ENOMEM);
+		pt->t = t;
+		pt->size = pt->size ? pt->size * 2 : 16;
+	}
+	pt->t[pt->n].s = s;
+	pt->t[pt->n].len = len;
+	pt->t[pt->n].role = role;
+	pt->n++;
+	pt->count[role]++;
+	pt->chars += len + 1;
+	return 0;
+}
+
+/* pipe://[<inmap><]*<func>[(<event>[|<event>]*[,<event>]*)][><omap>]* */
+static int scan_pipe(const char *p, const char *end, struct pipe_toks *pt)
+{
+	int role = PIPE_IN;
+	const char *tok;
 	int err = 0;
-	long rslt = 0;
 
-	vfi_parse_unary_op(*command, &cmd, &sp);
-	free(cmd);
-	iter = sp;
+	while (!err && p < end) {
+		for (tok = p; p < end && !strchr("<>(),", *p); p++)
+			;
+		if (role == PIPE_IN && (p == end || *p != '<'))
+			role = PIPE_FUNC;
+		err = add_tok(pt, tok, p - tok, role);
+		if (role == PIPE_FUNC)
+			role = (p < end && *p == '(') ? PIPE_EVENT : PIPE_OUT;
+		else if (role == PIPE_EVENT && p < end && *p == ')')
+			role = PIPE_OUT;
+		p++;
+	}
+	return err;
+}
 
-	while (*iter) {
-		if (sscanf(iter,"%as%n",&elem[elem_cnt],&size) > 0) {
-			switch (*(iter+size)) {
-			case '<':
-				inmaps = elem_cnt;
-				break;
-			case '>':
-				outmaps = elem_cnt;
-				break;
+/* unix_pipe://<func> <event>[|<event>]* [<event>]* [< <inmap>]* [> <omap>]* */
+static int scan_unix_pipe(const char *p, const char *end, struct pipe_toks *pt)
+{
+	int role = PIPE_FUNC;
+	const char *tok;
+	int err = 0;
 
-			default:
-				if (!found_func) {
-					func = elem_cnt;
-					found_func = 1;
-				}
-				else
-					events = elem_cnt;
-				break;
-			}
-			elem_cnt++;
-			iter += size;
+	while (!err && p < end) {
+		if (*p == '<')
+			role = PIPE_IN;
+		else if (*p == '>')
+			role = PIPE_OUT;
+		for (tok = p; p < end && !strchr("<>(), \t", *p); p++)
+			;
+		if (p > tok) {
+			err = add_tok(pt, tok, p - tok, role);
+			if (role == PIPE_FUNC)
+				role = PIPE_EVENT;
 		}
 		else
-			iter += 1;
+			p++;
 	}
+	return err;
+}
 
-	free(sp);
-
-	if (events)
-		numevnts = events - func;
+static int pipe_tiled(struct vfi_pipe *pipe)
+{
+	return pipe->parallel > 1 || pipe->tile || pipe->nstages > 1;
+}
 
-	if (inmaps)
-		numimaps = inmaps - events;
+static int resolve_pipe(struct vfi_pipe *pipe)
+{
+	struct vfi_dev *dev = pipe->dev;
+	char *func;
+	int numin, numout;
+	int i;
+	int err;
+
+	/* every stage of a fused pipe sees the same maps */
+	for (i = 0; i < pipe->nstages; i++) {
+		func = pipe->stage_names[i];
+		if (err = vfi_find_func(dev,func,&pipe->stages[i],&numin,&numout)) {
+			vfi_log(VFI_LOG_ERR, "%s: Failed to lookup function %s. Error is %d", __func__, func, err);
+			return VFI_RESULT(err);
+		}
 
-	if (outmaps)
-		numomaps = outmaps - inmaps; 
+		if (numin >= 0 && numin != pipe->nin) {
+			vfi_log(VFI_LOG_ERR, "%s: Number of input maps (%d) differs from expected (%d) for function %s",
+				__func__, pipe->nin, numin, func);
+			return VFI_RESULT(-EINVAL);
+		}
 
-	if (numevnts == 0) {
-		err = -EINVAL;
-		vfi_log(VFI_LOG_ERR, "%s: 0 events specified. Error is %d", __func__, elem[i], err);
-		goto done;
+		if (numout >= 0 && numout != pipe->nout) {
+			vfi_log(VFI_LOG_ERR, "%s: Number of output maps (%d) differs from expected (%d) for function %s",
+				__func__, pipe->nout, numout, func);
+			return VFI_RESULT(-EINVAL);
+		}
 	}
+	pipe->f = pipe->stages[0];
 
-	numpipe = elem_cnt + 2;
+	/* in and out are adjacent, as are their names */
+	for (i = 0; i < pipe->nin + pipe->nout; i++)
+		if (err = vfi_find_map(dev,pipe->maps[i],&pipe->in[i])) {
+			vfi_log(VFI_LOG_ERR, "%s: Failed to find map %s. Error is %d", __func__, pipe->maps[i], err);
+			return VFI_RESULT(err);
+		}
 
-	pipe = calloc(numpipe-numevnts,sizeof(void *));
-	if (!pipe) {
-		err = -ENOMEM;
-		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, err);
+	/* a tile of a multi buffered or ring map is not a tile of its data */
+	for (i = 0; pipe_tiled(pipe) && i < pipe->nin + pipe->nout; i++)
+		if (pipe->in[i]->buffers > 1 || pipe->in[i]->stream) {
+			vfi_log(VFI_LOG_ERR, "%s: Map %s of a tiled pipe is multi buffered or a ring",
+				__func__, pipe->maps[i]);
+			return VFI_RESULT(-EINVAL);
+		}
+
+	pipe->gen = vfi_dev_gen(dev);
+	return 0;
+}
+
+int vfi_compile_pipe(struct vfi_dev *dev, char *cmd, struct vfi_pipe **pipep)
+{
+	struct pipe_toks pt;
+	struct vfi_pipe *pipe = NULL;
+	const char *body, *end;
+	struct pipe_tok *func, *head;
+	char **name[4];
+	char *sp, *bar;
+	long val;
+	int nstages;
+	int nheads;
+	int nmaps;
+	int i;
+	int err;
+
+	*pipep = NULL;
+	memset(&pt, 0, sizeof(pt));
+
+	body = strstr(cmd, "://");
+	if (body == NULL) {
+		vfi_log(VFI_LOG_ERR, "%s: Not a pipe command (%s)", __func__, cmd);
+		return VFI_RESULT(-EINVAL);
 	}
+	body += 3;
+	end = body + strcspn(body, "?\n");
 
-	if (err = vfi_find_func(dev,elem[func],&pipe[0], &numin, &numout)) {
-		vfi_log(VFI_LOG_ERR, "%s: Failed to lookup function %s. Error is %d", __func__, elem[func], err);
+	if (!strncmp(cmd, "unix_pipe", 9))
+		err = scan_unix_pipe(body, end, &pt);
+	else
+		err = scan_pipe(body, end, &pt);
+	if (err)
 		goto done;
-	}
 
-	if (numin >= 0 && numin != numimaps) {
+	if (pt.count[PIPE_FUNC] != 1 || pt.count[PIPE_EVENT] == 0) {
 		err = -EINVAL;
-		vfi_log(VFI_LOG_ERR, "%s: Number of input maps (%d) differs from expected (%d) for function %s",
-			__func__, numimaps, numin, elem[func]);
+		vfi_log(VFI_LOG_ERR, "%s: Need one function and at least one event (%s). Error is %d",
+			__func__, cmd, err);
 		goto done;
 	}
 
-	if (numout >= 0 && numout != numomaps) {
+	/* func is f1+f2+... for a fused pipe */
+	for (i = 0; pt.t[i].role != PIPE_FUNC; i++)
+		;
+	func = &pt.t[i];
+	for (nstages = 1, i = 0; i < func->len; i++)
+		nstages += func->s[i] == '+';
+	if (nstages > VFI_PIPE_MAX_STAGES) {
 		err = -EINVAL;
-		vfi_log(VFI_LOG_ERR, "%s: Number of output maps (%d) differs from expected (%d) for function %s",
-			__func__, numomaps, numout, elem[func]);
+		vfi_log(VFI_LOG_ERR, "%s: More than %d functions (%s). Error is %d",
+			__func__, VFI_PIPE_MAX_STAGES, cmd, err);
 		goto done;
 	}
 
-	for (i = 0; i< numimaps;i++)
-		if (err = vfi_find_map(dev,elem[events+i+1],(struct vfi_map **)&pipe[i+2])) {
-			vfi_log(VFI_LOG_ERR, "%s: Failed to find map %s. Error is %d", __func__, elem[i], err);
-			goto done;
-		}
-
-	for (i = 0; i< numomaps;i++)
-		if (err = vfi_find_map(dev,elem[inmaps+i+1],(struct vfi_map **)&pipe[func+i+2])) {
-			vfi_log(VFI_LOG_ERR, "%s: Failed to find map %s. Error is %d", __func__, elem[events+i+1], err);
+	/* the first event may be a head per buffer, b0|b1|... */
+	for (i = 0; pt.t[i].role != PIPE_EVENT; i++)
+		;
+	head = &pt.t[i];
+	for (nheads = 1, i = 0; i < head->len; i++)
+		nheads += head->s[i] == '|';
+	for (i = 0; i < pt.n; i++)
+		if (pt.t[i].role == PIPE_EVENT && &pt.t[i] != head &&
+		    memchr(pt.t[i].s, '|', pt.t[i].len)) {
+			err = -EINVAL;
+			vfi_log(VFI_LOG_ERR, "%s: Only the first event may be one per buffer (%s). Error is %d",
+				__func__, cmd, err);
 			goto done;
 		}
 
-	pipe[1] = (void *)(((numimaps & 0xff) << 0) | ((numomaps & 0xff) << 8));
-	pipe[1] =  (void *)((unsigned int)pipe[1] ^ (unsigned int)pipe[0]);
-
-	if (numevnts > 1) {
-		for (i = 0; i< numevnts-1;i++) {
-			if (err = vfi_find_event(dev,elem[func+i+1],(void **)&eloc)) {
-				vfi_log(VFI_LOG_ERR, "%s: Failed to lookup event %s. Error is %d", __func__, elem[func+i+1], err);
-				goto done;
-			}
+	nmaps = pt.count[PIPE_IN] + pt.count[PIPE_OUT];
+	pipe = calloc(1, sizeof(*pipe) +
+		      (2 * nmaps + pt.count[PIPE_EVENT] + 2 * nstages + nheads) * sizeof(void *) +
+		      nstages * sizeof(long long) + pt.chars + func->len + 1);
+	if (pipe == NULL) {
+		err = -ENOMEM;
+		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, err);
+		goto done;
+	}
+
+	pipe->dev = dev;
+	pipe->nin = pt.count[PIPE_IN];
+	pipe->nout = pt.count[PIPE_OUT];
+	pipe->nevents = pt.count[PIPE_EVENT];
+	pipe->in = (struct vfi_map **)pipe->b;
+	pipe->out = pipe->in + pipe->nin;
+	pipe->maps = (char **)(pipe->in + nmaps);
+	pipe->events = pipe->maps + nmaps;
+	pipe->nstages = nstages;
+	pipe->stages = (void **)(pipe->events + pipe->nevents);
+	pipe->stage_names = (char **)(pipe->stages + nstages);
+	pipe->nheads = nheads;
+	pipe->heads = pipe->stage_names + nstages;
+	pipe->stage_ns = (long long *)(pipe->heads + nheads);
+	sp = (char *)(pipe->stage_ns + nstages);
+
+	name[PIPE_IN] = pipe->maps;
+	name[PIPE_FUNC] = &pipe->func;
+	name[PIPE_EVENT] = pipe->events;
+	name[PIPE_OUT] = pipe->maps + pipe->nin;
+
+	for (i = 0; i < pt.n; i++) {
+		*name[pt.t[i].role]++ = sp;
+		memcpy(sp, pt.t[i].s, pt.t[i].len);
+		sp += pt.t[i].len + 1;
+	}
+
+	/* the first event is cut into the heads in place */
+	pipe->heads[0] = pipe->events[0];
+	for (i = 1; i < nheads; i++) {
+		bar = strchr(pipe->heads[i - 1], '|');
+		*bar = '\0';
+		pipe->heads[i] = bar + 1;
+	}
+	for (i = 0; i < nheads; i++)
+		if (*pipe->heads[i] == '\0') {
+			err = -EINVAL;
+			vfi_log(VFI_LOG_ERR, "%s: Empty event name (%s). Error is %d", __func__, cmd, err);
+			goto done;
+		}
+
+	/* and a copy of func cut into the stage names */
+	memcpy(sp, func->s, func->len);
+	for (i = 0; i < nstages; i++) {
+		pipe->stage_names[i] = sp;
+		sp += strcspn(sp, "+");
+		*sp++ = '\0';
+		if (*pipe->stage_names[i] == '\0') {
+			err = -EINVAL;
+			vfi_log(VFI_LOG_ERR, "%s: Empty function name (%s). Error is %d", __func__, cmd, err);
+			goto done;
+		}
+	}
+
+	/* options only, so a function or event named like one is not taken */
+	if (*end == '?') {
+		if (vfi_get_dec_arg((char *)end,"parallel",&val) == 0 && val > 0)
+			pipe->parallel = val;
+		if (vfi_get_hex_arg((char *)end,"tile",&val) == 0 && val > 0)
+			pipe->tile = val;
+	}
+
+	err = resolve_pipe(pipe);
+done:
+	free(pt.t);
+	if (err)
+		free(pipe);
+	else
+		*pipep = pipe;
+	return VFI_RESULT(err);
+}
+
+static int ready_pipe(struct vfi_pipe *pipe, int flags)
+{
+	char *link[2];
+	int i;
+	int err;
+
+	if (pipe->gen != vfi_dev_gen(pipe->dev) && (err = resolve_pipe(pipe)))
+		return VFI_RESULT(err);
+
+	if (!pipe->chained) {
+		if (err = chain_events(pipe->dev,pipe->events,pipe->nevents,flags))
+			return VFI_RESULT(err);
+		/* the other heads go on to the same second event */
+		for (i = 1; i < pipe->nheads && pipe->nevents > 1; i++) {
+			link[0] = pipe->heads[i];
+			link[1] = pipe->events[1];
+			if (err = chain_events(pipe->dev,link,2,flags))
+				return VFI_RESULT(err);
+		}
+		pipe->chained = 1;
+	}
+	return 0;
+}
+
+int vfi_start_pipe(struct vfi_pipe *pipe, char **cmd)
+{
+	struct vfi_cmd_buf cb;
+	int err;
+
+	*cmd = NULL;
+	if (err = ready_pipe(pipe,0))
+		return VFI_RESULT(err);
+
+	vfi_cmd_init(&cb);
+	if (vfi_build_event_start(&cb,pipe->events[0]) || (*cmd = vfi_cmd_dup(&cb)) == NULL) {
+		err = -ENOMEM;
+		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, err);
+	}
+	else
+		err = 0;
+	vfi_cmd_release(&cb);
+	return VFI_RESULT(err);
+}
+
+void vfi_free_pipe(struct vfi_pipe *pipe)
+{
+	if (pipe->pool)
+		vfi_pool_destroy(pipe->pool);
+	free(pipe);
+}
+
+static void free_pipe(void *pipe)
+{
+	vfi_free_pipe(pipe);
+}
+
+/*
+ * A fixed set of threads taking jobs in order from a queue. The pool
+ * outlives any one pipe run so threads are not made per iteration.
+ */
+struct pool_job {
+	struct pool_job *next;
+	void (*fn)(void *);
+	void *arg;
+};
+
+struct vfi_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pool_job *head;
+	struct pool_job **tail;
+	int threads;
+	int quit;
+	pthread_t tid[];
+};
+
+static void *pool_thread(void *arg)
+{
+	struct vfi_pool *pool = arg;
+	struct pool_job *job;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->head == NULL && !pool->quit)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if ((job = pool->head) == NULL)
+			break;
+		if ((pool->head = job->next) == NULL)
+			pool->tail = &pool->head;
+		pthread_mutex_unlock(&pool->lock);
+
+		job->fn(job->arg);
+		free(job);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+int vfi_pool_create(struct vfi_pool **poolp, int threads)
+{
+	struct vfi_pool *pool;
+	int err = 0;
+
+	*poolp = NULL;
+	if (threads < 1)
+		threads = 1;
+
+	pool = calloc(1, sizeof(*pool) + threads * sizeof(pthread_t));
+	if (pool == NULL) {
+		err = -ENOMEM;
+		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, err);
+		return VFI_RESULT(err);
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->tail = &pool->head;
+
+	for (pool->threads = 0; pool->threads < threads; pool->threads++)
+		if (err = pthread_create(&pool->tid[pool->threads], NULL, pool_thread, pool)) {
+			err = -err;
+			vfi_log(VFI_LOG_ERR, "%s: Failed to start thread. Error is %d", __func__, err);
+			vfi_pool_destroy(pool);
+			return VFI_RESULT(err);
+		}
+
+	*poolp = pool;
+	return 0;
+}
+
+int vfi_pool_threads(struct vfi_pool *pool)
+{
+	return pool->threads;
+}
+
+int vfi_pool_submit(struct vfi_pool *pool, void (*fn)(void *), void *arg)
+{
+	struct pool_job *job = malloc(sizeof(*job));
+
+	if (job == NULL)
+		return VFI_RESULT(-ENOMEM);
+
+	job->fn = fn;
+	job->arg = arg;
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	*pool->tail = job;
+	pool->tail = &job->next;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+void vfi_pool_destroy(struct vfi_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
 
-			cmd = malloc(strlen(elem[func+i+2]));
-			strcpy(cmd,elem[func+i+2]);
-			cmd[strcspn(elem[func+i+2],".")] = 0;
-			vfi_invoke_cmd(dev,"event_chain://%s?request(%p),event_name(%s)\n",
-    			       elem[func+i+1],ah,cmd);
-			free(cmd);
-
-			vfi_wait_async_handle(ah,&result,&e);
-			if (vfi_get_dec_arg(result,"result",&rslt)) {
-				err = -EIO;
-				vfi_log(VFI_LOG_EMERG, "%s: Fatal error. Result string not returned from driver", __func__);
-				goto done;
+	for (i = 0; i < pool->threads; i++)
+		pthread_join(pool->tid[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool);
+}
+
+static long long pipe_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/*
+ * A tiled pipe invokes its function once per tile, see #vfi_pipe, and
+ * a fused one all of its functions on a tile before taking the next.
+ * The caller and up to parallel - 1 pool workers each take the next
+ * tile until none are left, or a function has returned NULL, so
+ * uneven tiles balance out, and the caller returns only once every
+ * worker is done with the maps.
+ */
+#define TILE_ALIGN 64
+#define TILE_MIN 4096		/* smallest default tile of a fused pipe */
+#define L2_DEFAULT (256 << 10)
+
+/* Tiles of all the maps together in half the L2, the rest is the code's. */
+static long fused_tile(int nmaps)
+{
+	static long l2;
+
+	if (l2 == 0) {
+		l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+		if (l2 <= 0)
+			l2 = L2_DEFAULT;
+	}
+	return nmaps && l2 / 2 / nmaps > TILE_MIN ? l2 / 2 / nmaps : TILE_MIN;
+}
+
+struct tile_run {
+	struct vfi_pipe *pipe;
+	struct vfi_dev *dev;
+	struct vfi_async_handle *ah;
+	char *result;
+	long tile;
+	int tiles;
+	int next;		/* the next tile to take */
+	int workers;		/* pool jobs not yet finished */
+	int stop;		/* a function returned NULL */
+	void *ret;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void run_tiles(struct tile_run *tr)
+{
+	struct vfi_pipe *pipe = tr->pipe;
+	int nmaps = pipe->nin + pipe->nout;
+	struct vfi_pipe *tp;
+	struct vfi_map **maps;
+	struct vfi_map *view;
+	struct vfi_map *map;
+	long long off;
+	long long t0;
+	void *ret;
+	int i, t, st;
+
+	/* a copy of the pipe header whose maps are views of one tile */
+	tp = malloc(sizeof(*tp) + nmaps * (sizeof(*maps) + sizeof(*view)));
+	if (tp == NULL) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, -ENOMEM);
+		__atomic_store_n(&tr->stop, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	memcpy(tp, pipe, sizeof(*tp));
+	maps = (struct vfi_map **)(tp + 1);
+	view = (struct vfi_map *)(maps + nmaps);
+	tp->in = maps;
+	tp->out = maps + pipe->nin;
+
+	while (!__atomic_load_n(&tr->stop, __ATOMIC_RELAXED) &&
+	       (t = __atomic_fetch_add(&tr->next, 1, __ATOMIC_RELAXED)) < tr->tiles) {
+		off = (long long)t * tr->tile;
+		for (i = 0; i < nmaps; i++) {
+			map = pipe->in[i];
+			memset(&view[i], 0, sizeof(view[i]));
+			view[i].name = map->name;
+			view[i].parent = map;
+			if (off < map->extent) {
+				view[i].mem = (char *)map->mem + off;
+				view[i].extent = map->extent - off < tr->tile ? map->extent - off : tr->tile;
 			}
-			if (rslt) {
-#warning TODO: Add code to remove chain		
-				err = rslt;
-				vfi_log(VFI_LOG_ERR, "%s: Command failed with error %ld (%s)", __func__, rslt, result);
-				goto done;
+			else
+				view[i].mem = (char *)map->mem + map->extent;
+			maps[i] = &view[i];
+		}
+		for (st = 0; st < pipe->nstages; st++) {
+			tp->f = pipe->stages[st];
+			t0 = pipe_now();
+			ret = vfi_invoke_closure((void **)tp, tr->dev, tr->ah, tr->result);
+			__atomic_add_fetch(&pipe->stage_ns[st], pipe_now() - t0, __ATOMIC_RELAXED);
+			if (ret == NULL) {
+				__atomic_store_n(&tr->stop, 1, __ATOMIC_RELAXED);
+				break;
 			}
+			if (t == 0)
+				tr->ret = ret;
 		}
 	}
-	
-	free(*command);
-	*command = malloc(128);
-	if (*command == NULL) {
+	free(tp);
+}
+
+static void tile_job(void *arg)
+{
+	struct tile_run *tr = arg;
+
+	run_tiles(tr);
+	pthread_mutex_lock(&tr->lock);
+	if (--tr->workers == 0)
+		pthread_cond_signal(&tr->cond);
+	pthread_mutex_unlock(&tr->lock);
+}
+
+/* Invokes the pipe function on the whole maps or, tiled, on each tile. */
+static void *invoke_pipe(struct vfi_pipe *pipe, struct vfi_pool *pool,
+			 struct vfi_dev *dev, struct vfi_async_handle *ah, char *result)
+{
+	struct tile_run tr;
+	long long t0;
+	long extent = 0;
+	void *ret;
+	int i, jobs;
+
+	if (!pipe_tiled(pipe)) {
+		t0 = pipe_now();
+		ret = vfi_invoke_closure((void **)pipe, dev, ah, result);
+		__atomic_add_fetch(&pipe->stage_ns[0], pipe_now() - t0, __ATOMIC_RELAXED);
+		return ret;
+	}
+
+	for (i = 0; i < pipe->nin + pipe->nout; i++)
+		if (pipe->in[i]->extent > extent)
+			extent = pipe->in[i]->extent;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.pipe = pipe;
+	tr.dev = dev;
+	tr.ah = ah;
+	tr.result = result;
+	if (pipe->tile)
+		tr.tile = pipe->tile;
+	else if (pipe->nstages > 1)
+		tr.tile = fused_tile(pipe->nin + pipe->nout);
+	else
+		tr.tile = (extent + pipe->parallel - 1) / pipe->parallel;
+	tr.tile = (tr.tile + TILE_ALIGN - 1) & ~(long)(TILE_ALIGN - 1);
+	if (tr.tile == 0)
+		tr.tile = TILE_ALIGN;
+	tr.tiles = (extent + tr.tile - 1) / tr.tile;
+	if (tr.tiles == 0)
+		tr.tiles = 1;
+	pthread_mutex_init(&tr.lock, NULL);
+	pthread_cond_init(&tr.cond, NULL);
+
+	jobs = pool ? vfi_pool_threads(pool) : 0;
+	if (jobs > tr.tiles - 1)
+		jobs = tr.tiles - 1;
+	pthread_mutex_lock(&tr.lock);
+	for (i = 0; i < jobs; i++)
+		if (vfi_pool_submit(pool, tile_job, &tr) == 0)
+			tr.workers++;
+	pthread_mutex_unlock(&tr.lock);
+
+	run_tiles(&tr);
+
+	pthread_mutex_lock(&tr.lock);
+	while (tr.workers)
+		pthread_cond_wait(&tr.cond, &tr.lock);
+	pthread_mutex_unlock(&tr.lock);
+	pthread_mutex_destroy(&tr.lock);
+	pthread_cond_destroy(&tr.cond);
+
+	return tr.stop ? NULL : tr.ret;
+}
+
+/*
+ * The pipe runtime keeps up to depth iterations of a pipe in flight.
+ * Each is an event_start at the driver or a run of the pipe function
+ * on a worker. When an event completes its function is queued to the
+ * pool and, as soon as the function returns, the event is started
+ * again. So while one iteration computes the others are transferring.
+ * Only this thread talks to the device; workers hand back finished
+ * iterations through a list and an eventfd.
+ */
+enum { SLOT_IDLE, SLOT_ARMED, SLOT_COMPUTING, SLOT_PARKED };
+
+struct pipe_slot {
+	struct pipe_run *run;
+	struct pipe_slot *next;
+	struct vfi_async_handle *ah;
+	char *result;
+	void *ret;
+	long long ns;
+	int state;
+	long seq;		/* start number, to publish ring chunks in order */
+	void **fill;		/* buffer of each input map being filled */
+};
+
+struct pipe_run {
+	struct vfi_pipe *pipe;
+	pthread_mutex_t lock;
+	struct pipe_slot *done;
+	int efd;
+	int computing;
+	int streaming;		/* chunks of the ring maps in flight */
+	long started;
+	long committed;
+	char *landed;		/* chunks completed, by start number modulo the heads */
+	struct vfi_pool *tiles;	/* workers for the tiles of a tiled pipe */
+};
+
+static void compute_slot(void *arg)
+{
+	struct pipe_slot *slot = arg;
+	struct pipe_run *run = slot->run;
+	unsigned long long one = 1;
+	long long t0 = pipe_now();
+
+	slot->ret = invoke_pipe(run->pipe, run->tiles, run->pipe->dev, slot->ah, slot->result);
+	slot->ns = pipe_now() - t0;
+
+	pthread_mutex_lock(&run->lock);
+	slot->next = run->done;
+	run->done = slot;
+	pthread_mutex_unlock(&run->lock);
+	if (write(run->efd, &one, sizeof(one)) < 0)
+		vfi_log(VFI_LOG_ERR, "%s: Failed to signal completion. Error is %d", __func__, -errno);
+}
+
+/*
+ * Multi buffered input maps rotate with the iterations: starting the
+ * events claims a free buffer of each and starts the head event bound
+ * to that buffer, and completion hands it on as ready to the pipe
+ * function.
+ */
+static void fill_done(struct vfi_pipe *pipe, struct pipe_slot *slot, int ok)
+{
+	int i;
+
+	for (i = 0; i < pipe->nin; i++)
+		if (pipe->in[i]->ring) {
+			vfi_map_put_ready(pipe->in[i], slot->fill[i]);
+			if (!ok)
+				vfi_map_put_free(pipe->in[i], slot->fill[i]);
+		}
+}
+
+/*
+ * Ring maps, see vfi_map_set_stream(), take a chunk from each
+ * completion. An iteration is only started when every ring has room
+ * for its chunk on top of those already in flight; otherwise the slot
+ * parks until the pipe function releases some data. Each start fills
+ * the chunk after those in flight, through the head event bound to
+ * it, and the chunks are published in the order they were started so
+ * none is handed on before its own transfer is done.
+ */
+static int stream_room(struct pipe_run *run)
+{
+	struct vfi_pipe *pipe = run->pipe;
+	long chunk;
+	int i;
+
+	for (i = 0; i < pipe->nin; i++)
+		if ((chunk = vfi_stream_chunk(pipe->in[i])) &&
+		    vfi_stream_space(pipe->in[i], NULL) < (run->streaming + 1) * chunk)
+			return 0;
+	return 1;
+}
+
+static void stream_done(struct pipe_run *run, struct pipe_slot *slot, int ok)
+{
+	struct vfi_pipe *pipe = run->pipe;
+	int i;
+
+	/* a failed chunk is never published, nor any after it */
+	if (run->landed == NULL || !ok) {
+		run->streaming--;
+		return;
+	}
+
+	run->landed[slot->seq % pipe->nheads] = 1;
+	while (run->landed[run->committed % pipe->nheads]) {
+		run->landed[run->committed++ % pipe->nheads] = 0;
+		run->streaming--;
+		for (i = 0; i < pipe->nin; i++)
+			if (vfi_stream_chunk(pipe->in[i]))
+				vfi_stream_commit(pipe->in[i], vfi_stream_chunk(pipe->in[i]));
+	}
+}
+
+/* Returns 0 when started, 1 when parked for ring room or an error. */
+static int arm_slot(struct pipe_run *run, struct pipe_slot *slot)
+{
+	struct vfi_pipe *pipe = run->pipe;
+	struct vfi_map *map;
+	struct vfi_cmd_buf cb;
+	char *event;
+	void *p;
+	long chunk;
+	int head = -1;
+	int i, b, ret;
+
+	if (!stream_room(run)) {
+		slot->state = SLOT_PARKED;
+		return 1;
+	}
+
+	for (i = 0; i < pipe->nin; i++)
+		if (pipe->in[i]->ring && vfi_map_get_free(pipe->in[i], &slot->fill[i]) < 0) {
+			vfi_log(VFI_LOG_ERR, "%s: No free buffer in %s, buffers not put back by the pipe function?",
+				__func__, pipe->in[i]->name);
+			while (i--)
+				if (pipe->in[i]->ring) {
+					vfi_map_put_ready(pipe->in[i], slot->fill[i]);
+					vfi_map_put_free(pipe->in[i], slot->fill[i]);
+				}
+			return VFI_RESULT(-EAGAIN);
+		}
+
+	/* the maps rotate together, so the buffers and chunks filled are at one index */
+	for (i = 0; i < pipe->nin; i++) {
+		map = pipe->in[i];
+		if (map->ring)
+			b = ((char *)slot->fill[i] - (char *)map->mem) / map->buffer_extent;
+		else if (chunk = vfi_stream_chunk(map)) {
+			vfi_stream_space(map, &p);
+			b = (((char *)p - (char *)map->mem) / chunk + run->started - run->committed) %
+			    (map->extent / chunk);
+		}
+		else
+			continue;
+		if (head < 0)
+			head = b;
+		else if (b != head) {
+			vfi_log(VFI_LOG_ERR, "%s: Buffer or chunk %d of %s is out of step with %d of the other maps",
+				__func__, b, map->name, head);
+			fill_done(pipe, slot, 0);
+			return VFI_RESULT(-EINVAL);
+		}
+	}
+	event = pipe->heads[head < 0 ? 0 : head];
+
+	vfi_cmd_init(&cb);
+	if (vfi_build_event_start(&cb,event) || vfi_cmd_request(&cb,slot->ah))
+		ret = -ENOMEM;
+	else
+		ret = vfi_invoke_cmd_buf(run->pipe->dev,&cb);
+	vfi_cmd_release(&cb);
+	if (ret > 0) {
+		slot->state = SLOT_ARMED;
+		slot->seq = run->started++;
+		run->streaming++;
+		return 0;
+	}
+	fill_done(pipe, slot, 0);
+	ret = ret ? ret : -EIO;
+	vfi_log(VFI_LOG_ERR, "%s: Failed to start %s. Error is %d", __func__, event, ret);
+	return VFI_RESULT(ret);
+}
+
+int vfi_run_pipe(struct vfi_pipe *pipe, struct vfi_pool *pool, int depth,
+		 long iterations, struct vfi_pipe_stats *stats)
+{
+	struct vfi_dev *dev = pipe->dev;
+	struct pipe_run run;
+	struct pipe_slot *slots, *slot, *done;
+	struct vfi_async_handle *tag;
+	struct pollfd fds[2];
+	unsigned long long count;
+	long long t0 = pipe_now();
+	struct rusage ru0, ru1;
+	long long stage_ns0[VFI_PIPE_MAX_STAGES];
+	long issued = 0;
+	long chunks;
+	int streams = 0;
+	int inflight = 0;
+	int busy;
+	int stop = 0;
+	char *result;
+	long rslt;
+	int i, ret;
+	int err = 0;
+
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < pipe->nstages; i++)
+		stage_ns0[i] = __atomic_load_n(&pipe->stage_ns[i], __ATOMIC_RELAXED);
+	getrusage(RUSAGE_SELF, &ru0);
+	if (depth < 1)
+		depth = 1;
+	/* an iteration in flight holds a buffer or chunk of each input map, filled by its own head */
+	for (i = 0; i < pipe->nin; i++)
+		if (pipe->in[i]->ring && pipe->in[i]->buffers != pipe->nheads) {
+			vfi_log(VFI_LOG_ERR, "%s: Map %s has %d buffers but the pipe %d head events, one is needed per buffer",
+				__func__, pipe->in[i]->name, pipe->in[i]->buffers, pipe->nheads);
+			return VFI_RESULT(-EINVAL);
+		}
+		else if (pipe->in[i]->ring && depth > pipe->in[i]->buffers)
+			depth = pipe->in[i]->buffers;
+		else if (vfi_stream_chunk(pipe->in[i])) {
+			chunks = pipe->in[i]->extent / vfi_stream_chunk(pipe->in[i]);
+			if (chunks != pipe->nheads) {
+				vfi_log(VFI_LOG_ERR, "%s: Ring %s has %ld chunks but the pipe %d head events, one is needed per chunk",
+					__func__, pipe->in[i]->name, chunks, pipe->nheads);
+				return VFI_RESULT(-EINVAL);
+			}
+			if (depth > chunks)
+				depth = chunks;
+			streams = 1;
+		}
+
+	if (err = ready_pipe(pipe,VFI_RUN_DISPATCH))
+		return VFI_RESULT(err);
+
+	slots = calloc(depth, sizeof(*slots) + pipe->nin * sizeof(void *));
+	if (slots == NULL) {
 		err = -ENOMEM;
 		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, err);
-		goto done;
+		return VFI_RESULT(err);
 	}
-	
-	i = snprintf(*command,128,"event_start://%s",elem[func+1]);
-	if (i >= 128) {
-		*command = realloc(*command,i+1);
-		snprintf(*command,128,"event_start://%s",elem[func+1]);
+
+	memset(&run, 0, sizeof(run));
+	run.pipe = pipe;
+	pthread_mutex_init(&run.lock, NULL);
+	run.efd = vfi_get_eventfd(0);
+	if (run.efd < 0) {
+		err = -EMFILE;
+		goto out;
+	}
+	if (streams && (run.landed = calloc(pipe->nheads, 1)) == NULL) {
+		err = -ENOMEM;
+		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, err);
+		goto out;
 	}
-	
-	free(vfi_set_async_handle(ah,pipe));
-	
-done:
-	while (elem_cnt--)
-		free(elem[elem_cnt]);
 
-	if (err) {
-		if (pipe)
-			free(pipe);
-		if (*command) {
-			free(*command);
-			*command = NULL;
+	/* a failure here only leaves the tiles to the computing thread */
+	if (pipe->parallel > 1 && vfi_pool_create(&run.tiles, pipe->parallel - 1))
+		run.tiles = NULL;
+
+	for (i = 0; i < depth; i++) {
+		slots[i].run = &run;
+		slots[i].fill = (void **)(slots + depth) + i * pipe->nin;
+		if ((slots[i].ah = vfi_alloc_async_handle(NULL)) == NULL) {
+			err = -ENOMEM;
+			goto out;
 		}
 	}
 
+	for (i = 0; i < depth && !err && (!iterations || issued < iterations); i++)
+		if ((err = arm_slot(&run, &slots[i])) >= 0) {
+			err = 0;
+			issued++;
+			inflight++;
+		}
+	stop = err != 0;
+
+	fds[0].fd = vfi_fileno(dev);
+	fds[0].events = POLLIN;
+	fds[1].fd = run.efd;
+	fds[1].events = POLLIN;
+
+	while (inflight) {
+		ret = poll(fds, 2, 1000);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err = err ? err : -errno;
+			break;
+		}
+		if (vfi_dev_done(dev))
+			stop = 1;
+		if (ret == 0 && stop && run.computing == 0)
+			break;	/* the driver has stopped answering */
+
+		if (fds[0].revents & POLLIN) {
+			if ((ret = vfi_get_result(dev,&result)) <= 0) {
+				err = err ? err : (ret ? ret : -EIO);
+				break;
+			}
+			tag = NULL;
+			vfi_get_hex_arg(result,"reply",(long *)&tag);
+			for (i = 0; i < depth; i++)
+				if (slots[i].state == SLOT_ARMED && slots[i].ah == tag)
+					break;
+			if (i == depth) {
+				vfi_log(VFI_LOG_ERR, "%s: Unmatched reply %s", __func__, result);
+				free(result);
+			}
+			else if (vfi_get_dec_arg(result,"result",&rslt) || rslt) {
+				vfi_log(VFI_LOG_ERR, "%s: Command failed (%s)", __func__, result);
+				err = err ? err : (rslt ? rslt : -EIO);
+				stop = 1;
+				free(result);
+				fill_done(pipe, &slots[i], 0);
+				stream_done(&run, &slots[i], 0);
+				slots[i].state = SLOT_IDLE;
+				inflight--;
+			}
+			else {
+				slot = &slots[i];
+				slot->result = result;
+				slot->state = SLOT_COMPUTING;
+				fill_done(pipe, slot, 1);
+				stream_done(&run, slot, 1);
+				run.computing++;
+				if (stats && run.computing > stats->max_computing)
+					stats->max_computing = run.computing;
+				if (pool == NULL || vfi_pool_submit(pool, compute_slot, slot))
+					compute_slot(slot);
+			}
+		}
+
+		if (fds[1].revents & POLLIN || pool == NULL) {
+			if (read(run.efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				vfi_log(VFI_LOG_ERR, "%s: Failed to read completions. Error is %d", __func__, -errno);
+			pthread_mutex_lock(&run.lock);
+			done = run.done;
+			run.done = NULL;
+			pthread_mutex_unlock(&run.lock);
+
+			while ((slot = done)) {
+				done = slot->next;
+				run.computing--;
+				free(slot->result);
+				slot->result = NULL;
+				if (stats) {
+					stats->iterations++;
+					stats->compute_ns += slot->ns;
+				}
+				if (slot->ret == NULL)
+					stop = 1;
+				if (!stop && (!iterations || issued < iterations) &&
+				    (err = arm_slot(&run, slot)) >= 0) {
+					err = 0;
+					issued++;
+					continue;
+				}
+				stop = 1;
+				slot->state = SLOT_IDLE;
+				inflight--;
+			}
+		}
+
+		/* the pipe function may have made room in the rings */
+		for (busy = 0, i = 0; i < depth; i++) {
+			if (slots[i].state != SLOT_PARKED) {
+				busy += slots[i].state != SLOT_IDLE;
+				continue;
+			}
+			if (!stop && (ret = arm_slot(&run, &slots[i])) >= 0) {
+				busy += ret == 0;
+				continue;
+			}
+			if (!stop)
+				err = err ? err : ret;
+			stop = 1;
+			slots[i].state = SLOT_IDLE;
+			inflight--;
+		}
+		if (inflight && !busy) {
+			err = err ? err : -ENOBUFS;
+			vfi_log(VFI_LOG_ERR, "%s: Rings full and nothing running, is the pipe function releasing data?",
+				__func__);
+			break;
+		}
+	}
+
+out:
+	/* Workers still running own their slots; wait for them. */
+	while (run.computing) {
+		struct pollfd fd = { run.efd, POLLIN, 0 };
+		poll(&fd, 1, 1000);
+		if (read(run.efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			break;
+		pthread_mutex_lock(&run.lock);
+		for (done = run.done; done; done = done->next)
+			run.computing--;
+		run.done = NULL;
+		pthread_mutex_unlock(&run.lock);
+	}
+
+	for (i = 0; i < depth; i++) {
+		free(slots[i].result);
+		if (slots[i].ah)
+			vfi_free_async_handle(slots[i].ah);
+	}
+	if (run.efd >= 0)
+		close(run.efd);
+	if (run.tiles)
+		vfi_pool_destroy(run.tiles);
+	pthread_mutex_destroy(&run.lock);
+	free(run.landed);
+	free(slots);
+
+	if (stats) {
+		stats->elapsed_ns = pipe_now() - t0;
+		if (!getrusage(RUSAGE_SELF, &ru1)) {
+			stats->minor_faults = ru1.ru_minflt - ru0.ru_minflt;
+			stats->major_faults = ru1.ru_majflt - ru0.ru_majflt;
+		}
+		stats->stages = pipe->nstages;
+		for (i = 0; i < pipe->nstages; i++)
+			stats->stage_ns[i] = __atomic_load_n(&pipe->stage_ns[i], __ATOMIC_RELAXED) -
+					     stage_ns0[i];
+	}
 	return VFI_RESULT(err);
 }
 
+/*
+ * The cached pipe belongs to the device, so the handle is given a
+ * closure of its own which passes the reply on to the pipe. Threads
+ * for a tiled pipe are started at its first reply and kept with the
+ * pipe, as vfi_run_pipe() keeps them for a run; the device frees them
+ * with the pipe.
+ */
+static void *pipe_closure(void *e, struct vfi_dev *dev, struct vfi_async_handle *ah, char *result)
+{
+	struct {void *f; struct vfi_pipe *pipe;} *p = e;
+	struct vfi_pipe *pipe = p->pipe;
+	struct vfi_pool *pool = __atomic_load_n(&pipe->pool, __ATOMIC_ACQUIRE);
+	struct vfi_pool *none = NULL;
+
+	if (pool == NULL && pipe->parallel > 1) {
+		if (vfi_pool_create(&pool, pipe->parallel - 1))
+			pool = NULL;	/* the tiles are left to this thread */
+		else if (!__atomic_compare_exchange_n(&pipe->pool, &none, pool, 0,
+						      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			/* another reply got there first */
+			vfi_pool_destroy(pool);
+			pool = none;
+		}
+	}
+	/* only as true or false, so that no pointer is taken for an error */
+	return invoke_pipe(pipe, pool, dev, ah, result) ? (void *)1 : NULL;
+}
+
+static int lookup_pipe(struct vfi_dev *dev, char *command, struct vfi_pipe **pipe)
+{
+	int err;
+
+	if (vfi_find_pipe(dev,command,(void **)pipe)) {
+		if (err = vfi_compile_pipe(dev,command,pipe))
+			return VFI_RESULT(err);
+		if (err = vfi_register_pipe(dev,command,*pipe)) {
+			vfi_free_pipe(*pipe);
+			return VFI_RESULT(err);
+		}
+	}
+	return 0;
+}
+
+static int pipe_bind(struct vfi_dev *dev, char *command, void **state)
+{
+	struct vfi_pipe *pipe;
+	int err;
+
+	if (err = lookup_pipe(dev,command,&pipe))
+		return VFI_RESULT(err);
+	if ((*state = bound_state(&pipe, sizeof(pipe))) == NULL)
+		return VFI_RESULT(-ENOMEM);
+	return 0;
+}
+
+/*
+ * A pipe whose events are not chained yet is started by a run of
+ * commands on the one handle: event_chain for each link, then the
+ * event_start. The closure rewrites the command through the pointer
+ * it was given and asks for it to be sent again, so the replies come
+ * back through the reply loop of whatever runs the command, the
+ * program runner's or the server's, and nothing here waits for them.
+ * A link which fails has those made before it unchained again, as
+ * chain_events() does, if the driver can.
+ */
+struct pipe_start {
+	void *f;
+	struct vfi_pipe *pipe;	/* where pipe_closure() takes it */
+	char **cmd;
+	int link;		/* the link being made, or unmade */
+	int links;
+	int undo;
+	int err;		/* of the link which failed */
+};
+
+/* Each event on to the next, then the other heads on to the second */
+static int pipe_links(struct vfi_pipe *pipe)
+{
+	return pipe->nevents < 2 ? 0 : pipe->nevents - 1 + pipe->nheads - 1;
+}
+
+static void pipe_link(struct vfi_pipe *pipe, int k, char **from, char **to)
+{
+	if (k < pipe->nevents - 1) {
+		*from = pipe->events[k];
+		*to = pipe->events[k + 1];
+	}
+	else {
+		*from = pipe->heads[k - (pipe->nevents - 1) + 1];
+		*to = pipe->events[1];
+	}
+}
+
+static int pipe_link_cmd(struct pipe_start *p)
+{
+	struct vfi_cmd_buf cb;
+	char *from, *to, *cmd;
+	int err = 0;
+
+	pipe_link(p->pipe, p->link, &from, &to);
+	vfi_cmd_init(&cb);
+	if ((p->undo ? vfi_cmd_lit(&cb, "event_unchain://") : vfi_cmd_lit(&cb, "event_chain://")) ||
+	    vfi_cmd_str(&cb, from) || vfi_cmd_opt_str(&cb, "event_name", to, strcspn(to, ".")) ||
+	    (cmd = vfi_cmd_dup(&cb)) == NULL) {
+		err = -ENOMEM;
+		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, err);
+	}
+	else {
+		free(*p->cmd);
+		*p->cmd = cmd;
+	}
+	vfi_cmd_release(&cb);
+	return VFI_RESULT(err);
+}
+
+static int pipe_start_closure(void *e, struct vfi_dev *dev, struct vfi_async_handle *ah, char *result)
+{
+	struct pipe_start *p = e;
+	char *from, *to, *cmd;
+	long rslt;
+	int i, err;
+
+	if (vfi_get_dec_arg(result,"result",&rslt)) {
+		rslt = -EIO;
+		vfi_log(VFI_LOG_EMERG, "%s: Fatal error. Result string not returned from driver", __func__);
+	}
+	else if (rslt)
+		vfi_log(VFI_LOG_ERR, "%s: Command failed with error %ld (%s)", __func__, rslt, result);
+
+	if (!p->undo && rslt == 0 && ++p->link < p->links)
+		err = pipe_link_cmd(p);
+	else if (!p->undo && rslt == 0) {
+		p->pipe->chained = 1;
+		if ((err = vfi_start_pipe(p->pipe,&cmd)) == 0) {
+			free(*p->cmd);
+			*p->cmd = cmd;
+			p->f = pipe_closure;
+		}
+	}
+	else if (!p->undo) {
+		p->err = rslt;
+		if (!vfi_dev_unchain(dev)) {
+			for (i = 0; i < p->link; i++) {
+				pipe_link(p->pipe, i, &from, &to);
+				vfi_log(VFI_LOG_ERR, "%s: Left %s chained to %s", __func__, from, to);
+			}
+			goto fail;
+		}
+		if (p->link == 0)
+			goto fail;
+		p->undo = 1;
+		p->link--;
+		err = pipe_link_cmd(p);
+	}
+	else if (rslt == 0 && p->link > 0) {
+		p->link--;
+		err = pipe_link_cmd(p);
+	}
+	else {
+		if (rslt)
+			vfi_log(VFI_LOG_ERR, "%s: Failed to undo the chain from %s", __func__,
+				p->pipe->events[0]);
+		goto fail;
+	}
+	if (err) {
+		p->err = p->err ? p->err : err;
+		goto fail;
+	}
+	vfi_retry_async_handle(ah);
+	return 0;
+fail:
+	err = p->err;
+	free(vfi_set_async_handle(ah,NULL));
+	return VFI_RESULT(err);
+}
+
+/*
+ * Sends the event_start of the pipe's first event in place of the
+ * command, or the first event_chain if the pipe is not chained yet.
+ */
+static int pipe_run(struct vfi_dev *dev, struct vfi_async_handle *ah, void *state, char **command)
+{
+	struct vfi_pipe *pipe = *(struct vfi_pipe **)state;
+	struct pipe_start *e;
+	char *from, *to, *eloc;
+	char *cmd;
+	int i, err;
+
+	e = calloc(1,sizeof(*e));
+	if (e == NULL) {
+		err = -ENOMEM;
+		vfi_log(VFI_LOG_ERR, "%s: Failed to allocate memory. Error is %d", __func__, err);
+		return VFI_RESULT(err);
+	}
+	e->pipe = pipe;
+	e->cmd = command;
+	e->links = pipe_links(pipe);
+
+	if (pipe->chained || e->links == 0) {
+		if (err = vfi_start_pipe(pipe,&cmd))
+			goto fail;
+		free(*command);
+		*command = cmd;
+		e->f = pipe_closure;
+	}
+	else {
+		if (pipe->gen != vfi_dev_gen(dev) && (err = resolve_pipe(pipe)))
+			goto fail;
+		for (i = 0; i < e->links; i++) {
+			pipe_link(pipe, i, &from, &to);
+			if (err = vfi_find_event(dev,from,(void **)&eloc)) {
+				vfi_log(VFI_LOG_ERR, "%s: Failed to lookup event %s. Error is %d", __func__, from, err);
+				goto fail;
+			}
+		}
+		if (err = pipe_link_cmd(e))
+			goto fail;
+		e->f = pipe_start_closure;
+	}
+	free(vfi_set_async_handle(ah,e));
+	return 0;
+fail:
+	free(e);
+	return VFI_RESULT(err);
+}
+
+static int start_pipe_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **command)
+{
+	struct vfi_pipe *pipe;
+	int err;
+
+	if ((err = lookup_pipe(dev,*command,&pipe)) ||
+	    (err = pipe_run(dev,ah,&pipe,command)))
+		return VFI_RESULT(err);
+	return 0;
+}
+
+int pipe_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **command)
+{
+	/* pipe://[<inmap><]*<func>[(<event>[,<event>]*)][><omap>]*[?parallel(n)][,tile(hex)]  */
+	return start_pipe_cmd(dev,ah,command);
+}
+
+int unix_pipe_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **command)
+{
+	/* unix_pipe://<func>[<event> [<event>]*)][< <inmap>]*[> <omap>]*  */
+	return start_pipe_cmd(dev,ah,command);
+}
+
 int quit_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
 {
 	/* quit or quit:// */
@@ -749,149 +2190,330 @@ int quit_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
 	return 1;
 }
 
-int map_init_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
+/*
+ * Common parsing for map_init and map_check: the map, the region in
+ * bytes and the pattern to lay down or look for.
+ */
+struct pattern_args {
+	struct vfi_map *map;
+	long long offset;
+	long extent;
+	int type;
+	unsigned long long val;
+	int threads;
+};
+
+static int map_pattern_args(struct vfi_dev *dev, char *cmd, struct pattern_args *a)
 {
-	/* map_init://name#o:e?value(x) */
-	/* map_init://name#o:e?pattern(counting) */
 	char *name;
 	char *location;
-	long long offset;
-	long extent;
-	long val;
 	char *pattern = NULL;
-	struct vfi_map *map;
-	long *mem;
+	long v = 0;
+	long n;
 	int err = 0;
 
-	if (err = vfi_get_name_location(*cmd, &name, &location)) {
-		vfi_log(VFI_LOG_ERR, "%s: Error parsing string. Name and location not found (%s).", __func__, *cmd);
-		goto done;
+	if (err = vfi_get_name_location(cmd, &name, &location)) {
+		vfi_log(VFI_LOG_ERR, "%s: Error parsing string. Name and location not found (%s).", __func__, cmd);
+		return err;
 	}
-	if (vfi_get_offset(*cmd,&offset)) /* Offset defaults to 0 */
-		offset = 0;
-	if (vfi_get_hex_arg(*cmd,"value",&val))
-		if (vfi_get_str_arg(*cmd,"pattern",&pattern) != 1) {
-			err = -EINVAL;
-			vfi_log(VFI_LOG_ERR, "%s: Error parsing string. Value or pattern not found (%s)", __func__, *cmd);
+	if (vfi_get_offset(cmd,&a->offset)) /* Offset defaults to 0 */
+		a->offset = 0;
+	a->type = VFI_PATTERN_VALUE;
+	if (vfi_get_str_arg(cmd,"pattern",&pattern) == 1) {
+		if ((a->type = vfi_pattern_type(pattern)) < 0) {
+			err = a->type;
+			vfi_log(VFI_LOG_ERR, "%s: Illegal pattern (%s). Error is %d", __func__, pattern, err);
 			goto done;
 		}
-	if (err = vfi_find_map(dev,name,&map)) {
+		vfi_get_hex_arg(cmd,"value",&v);
+	}
+	else if (vfi_get_hex_arg(cmd,"value",&v)) {
+		err = -EINVAL;
+		vfi_log(VFI_LOG_ERR, "%s: Error parsing string. Value or pattern not found (%s)", __func__, cmd);
+		goto done;
+	}
+	a->val = v;
+	a->threads = vfi_get_dec_arg(cmd,"threads",&n) ? 0 : n;
+	if (err = vfi_find_map(dev,name,&a->map)) {
 		vfi_log(VFI_LOG_ERR, "%s: Failed to lookup map %s. Error is %d", __func__, name, err);		
 		goto done;
 	}
-	if (vfi_get_extent(*cmd,&extent)) /* Extent defaults to map's extent */
-		extent = map->extent;
-	if (map->extent < offset + extent) {
+	if (vfi_get_extent(cmd,&a->extent)) /* Extent defaults to the rest of the map */
+		a->extent = a->map->extent - a->offset;
+	if (a->offset < 0 || a->extent < 0 || a->map->extent < a->offset + a->extent) {
 		err = -EINVAL;
 		vfi_log(VFI_LOG_ERR, "%s: Offset and extent combination larger than maps extent. Error is %d", __func__, err);
-		goto done;
 	}
-
-	mem = (long *)map->mem + offset;
-	extent = extent >> 2;
-
-	if (pattern)
-		if (strstr(pattern,"counting")) {
-			val = 1;
-			while  (extent--)
-				*mem++ = val++;			
-		}
-		else {
-			err = -EINVAL;
-			vfi_log(VFI_LOG_ERR, "%s: Illegal pattern (%s). Error is %d", __func__, pattern, err);
-		}
-		
-	else
-		while  (extent--)
-			*mem++ = val;
-
 done:
 	free(location);
 	free(name);
 	free(pattern);
-	if (err)
+	return err;
+}
+
+static int map_pattern_bind(struct vfi_dev *dev, char *cmd, void **state)
+{
+	struct pattern_args a;
+	int err;
+
+	if (err = map_pattern_args(dev, cmd, &a))
+		return VFI_RESULT(err);
+	if ((*state = bound_state(&a, sizeof(a))) == NULL)
+		return VFI_RESULT(-ENOMEM);
+	return 0;
+}
+
+static int map_init_run(struct vfi_dev *dev, struct vfi_async_handle *ah, void *state, char **cmd)
+{
+	struct pattern_args *a = state;
+	int err;
+
+	if (err = vfi_fill_map(a->map, a->offset, a->extent, a->type, a->val, a->threads)) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to fill map. Error is %d", __func__, err);
 		return VFI_RESULT(err);
+	}
+	return 1;
+}
+
+int map_init_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
+{
+	/* map_init://name#o:e?value(x) */
+	/* map_init://name#o:e?pattern(counting|lfsr|walking_ones|address)[,value(seed)] */
+	struct pattern_args a;
+	int err;
+
+	if (err = map_pattern_args(dev, *cmd, &a))
+		return VFI_RESULT(err);
+	return map_init_run(dev, ah, &a, NULL);
+}
+
+static int map_check_run(struct vfi_dev *dev, struct vfi_async_handle *ah, void *state, char **cmd)
+{
+	struct pattern_args *a = state;
+	struct vfi_check_stats stats;
+	int err;
+
+	err = vfi_check_map(a->map, a->offset, a->extent, a->type, a->val, a->threads, &stats);
+	if (err == -EBADMSG)
+		vfi_log(VFI_LOG_ERR, "%s: %lld words do not match, first at 0x%llx, last at 0x%llx",
+			__func__, stats.mismatches, stats.first_bad, stats.last_bad);
+	if (err) {
+		VFI_DEBUG (MY_DEBUG, "%s: Map has ERRORS\n", __func__);
+		return VFI_RESULT(err);
+	}
+	else
+		VFI_DEBUG (MY_DEBUG, "%s: Map is OK\n", __func__);
 	return 1;
 }
 
 int map_check_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
 {
 	/* map_check://name#o:e?value(x) */
-	/* map_check://name#o:e?pattern(counting) */
-	char *name;
-	char *location;
+	/* map_check://name#o:e?pattern(counting|lfsr|walking_ones|address)[,value(seed)] */
+	struct pattern_args a;
+	int err;
+
+	if (err = map_pattern_args(dev, *cmd, &a))
+		return VFI_RESULT(err);
+	return map_check_run(dev, ah, &a, NULL);
+}
+
+struct checksum_args {
+	struct vfi_map *map;
+	struct vfi_map *match;	/* or NULL */
 	long long offset;
 	long extent;
-	long val;
-	char *pattern = NULL;
-	struct vfi_map *map;
-	long *mem;
+	int type;
+	int threads;
+};
+
+static int map_checksum_args(struct vfi_dev *dev, char *cmd, struct checksum_args *a)
+{
+	char *name;
+	char *location;
+	char *algo = NULL;
+	char *match = NULL;
+	long threads;
 	int err = 0;
 
-	if (err = vfi_get_name_location(*cmd, &name, &location)) {
-		vfi_log(VFI_LOG_ERR, "%s: Error parsing string. Name and location not found (%s).", __func__, *cmd);
+	if (err = vfi_get_name_location(cmd, &name, &location)) {
+		vfi_log(VFI_LOG_ERR, "%s: Error parsing string. Name and location not found (%s).", __func__, cmd);
+		return err;
+	}
+	if (vfi_get_offset(cmd,&a->offset)) /* Offset defaults to 0 */
+		a->offset = 0;
+	a->threads = vfi_get_dec_arg(cmd,"threads",&threads) ? 0 : threads;
+	a->type = VFI_CHECKSUM_CRC32C;
+	if (vfi_get_str_arg(cmd,"algo",&algo) == 1 && (a->type = vfi_checksum_type(algo)) < 0) {
+		err = a->type;
+		vfi_log(VFI_LOG_ERR, "%s: Illegal algorithm (%s). Error is %d", __func__, algo, err);
 		goto done;
 	}
-	if (vfi_get_offset(*cmd,&offset)) /* Offset defaults to 0 */
-		offset = 0;
-	if (vfi_get_hex_arg(*cmd,"value",&val))
-		if (vfi_get_str_arg(*cmd,"pattern",&pattern) != 1) {
-			err = -EINVAL;
-			vfi_log(VFI_LOG_ERR, "%s: Error parsing command string. Value or pattern not found (%s)", __func__, *cmd);
-			goto done;
-		}
-	if (err = vfi_find_map(dev,name,&map)) {
+	if (err = vfi_find_map(dev,name,&a->map)) {
 		vfi_log(VFI_LOG_ERR, "%s: Failed to lookup map %s. Error is %d", __func__, name, err);		
 		goto done;
 	}
-	if (vfi_get_extent(*cmd,&extent)) /* Extent defaults to map's extent */
-		extent = map->extent;
-	if (map->extent < offset + extent) {
-		err = -EINVAL;
-		vfi_log(VFI_LOG_ERR, "%s: Offset and extent combination larger than maps extent. Error is %d", __func__, err);
-		goto done;
+	if (vfi_get_extent(cmd,&a->extent)) /* Extent defaults to the rest of the map */
+		a->extent = a->map->extent - a->offset;
+
+	a->match = NULL;
+	if (vfi_get_str_arg(cmd,"match",&match) == 1 && (err = vfi_find_map(dev,match,&a->match)))
+		vfi_log(VFI_LOG_ERR, "%s: Failed to lookup map %s. Error is %d", __func__, match, err);
+done:
+	free(location);
+	free(name);
+	free(algo);
+	free(match);
+	return err;
+}
+
+static int map_checksum_bind(struct vfi_dev *dev, char *cmd, void **state)
+{
+	struct checksum_args a;
+	int err;
+
+	if (err = map_checksum_args(dev, cmd, &a))
+		return VFI_RESULT(err);
+	if ((*state = bound_state(&a, sizeof(a))) == NULL)
+		return VFI_RESULT(-ENOMEM);
+	return 0;
+}
+
+static int map_checksum_run(struct vfi_dev *dev, struct vfi_async_handle *ah, void *state, char **cmd)
+{
+	struct checksum_args *a = state;
+	unsigned long long digest;
+	int err;
+
+	if (err = vfi_checksum_map(a->map, a->offset, a->extent, a->type, a->threads, &digest)) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to checksum map %s. Error is %d", __func__, a->map->name, err);
+		return VFI_RESULT(err);
 	}
+	vfi_log(VFI_LOG_INFO, "%s: %s#%llx:%lx digest %llx", __func__, a->map->name, a->offset, a->extent, digest);
 
-	mem = (long *)map->mem + offset;
-	extent = extent >> 2;
+	if (a->match && (a->match->digest_algo != a->type || a->match->digest != digest)) {
+		err = -EBADMSG;
+		vfi_log(VFI_LOG_ERR, "%s: Digest of %s does not match %s. Error is %d", __func__,
+			a->map->name, a->match->name, err);
+		return VFI_RESULT(err);
+	}
+	return 1;
+}
 
-	if (pattern)
-		if (strstr(pattern,"counting")) {
-			val = 1;
-			while  (extent--)
-				if (*mem++ != val++) {
-					err = -EBADMSG;
-					vfi_log(VFI_LOG_ERR, "%s: Counting pattern has errors", __func__);
-					break;
-				}
-					
-		}
-		else {
-			err = -EINVAL;
-			vfi_log(VFI_LOG_ERR, "%s: Illegal pattern (%s). Error is %d", __func__, pattern, err);
-		}
-		
-	else
-		while  (extent--)
-			if (*mem++ != val) {
-				err = -EBADMSG;
-				vfi_log(VFI_LOG_ERR, "%s: Repeating value pattern has errors", __func__);
-				break;
-			}
+int map_checksum_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
+{
+	/* map_checksum://name#o:e?algo(crc32c|xxh64)[,match(other)][,threads(n)] */
+	struct checksum_args a;
+	int err;
+
+	if (err = map_checksum_args(dev, *cmd, &a))
+		return VFI_RESULT(err);
+	return map_checksum_run(dev, ah, &a, NULL);
+}
+
+struct copy_args {
+	struct vfi_map *dst;
+	struct vfi_map *src;
+	long long doff;
+	long long soff;
+	long extent;
+	int threads;
+};
 
+static int map_copy_args(struct vfi_dev *dev, char *cmd, struct copy_args *a)
+{
+	char *name = NULL;
+	char *location = NULL;
+	char *from = NULL;
+	char *eq;
+	long threads;
+	int dext;
+	int len;
+	int err;
+
+	eq = strchr(cmd, '=');
+	if (eq == NULL) {
+		vfi_log(VFI_LOG_ERR, "%s: Error parsing string. Source map not found (%s).", __func__, cmd);
+		return -EINVAL;
+	}
+
+	/* the destination, on its own so its # and : are not the source's */
+	*eq = '\0';
+	err = vfi_get_name_location(cmd, &name, &location);
+	if (vfi_get_offset(cmd,&a->doff)) /* Offset defaults to 0 */
+		a->doff = 0;
+	dext = vfi_get_extent(cmd,&a->extent);
+	*eq = '=';
+	if (err) {
+		vfi_log(VFI_LOG_ERR, "%s: Error parsing string. Name and location not found (%s).", __func__, cmd);
+		return err;
+	}
+
+	len = strcspn(eq + 1, ".?#:,");
+	if (len == 0 || (from = malloc(len + 1)) == NULL) {
+		err = len ? -ENOMEM : -EINVAL;
+		vfi_log(VFI_LOG_ERR, "%s: Error parsing source map (%s). Error is %d", __func__, eq + 1, err);
+		goto done;
+	}
+	memcpy(from, eq + 1, len);
+	from[len] = '\0';
+	if (vfi_get_offset(eq + 1,&a->soff)) /* Offset defaults to 0 */
+		a->soff = 0;
+	a->threads = vfi_get_dec_arg(cmd,"threads",&threads) ? 0 : threads;
+
+	if (err = vfi_find_map(dev,name,&a->dst)) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to lookup map %s. Error is %d", __func__, name, err);
+		goto done;
+	}
+	if (err = vfi_find_map(dev,from,&a->src)) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to lookup map %s. Error is %d", __func__, from, err);
+		goto done;
+	}
+	if (dext) /* Extent defaults to the rest of the destination */
+		a->extent = a->dst->extent - a->doff;
 done:
 	free(location);
 	free(name);
-	free(pattern);
-	if (err) {
-		VFI_DEBUG (MY_DEBUG, "%s: Map has ERRORS\n", __func__);
+	free(from);
+	return err;
+}
+
+static int map_copy_bind(struct vfi_dev *dev, char *cmd, void **state)
+{
+	struct copy_args a;
+	int err;
+
+	if (err = map_copy_args(dev, cmd, &a))
+		return VFI_RESULT(err);
+	if ((*state = bound_state(&a, sizeof(a))) == NULL)
+		return VFI_RESULT(-ENOMEM);
+	return 0;
+}
+
+static int map_copy_run(struct vfi_dev *dev, struct vfi_async_handle *ah, void *state, char **cmd)
+{
+	struct copy_args *a = state;
+	int err;
+
+	if (err = vfi_copy_map(a->dst, a->doff, a->src, a->soff, a->extent, a->threads)) {
+		vfi_log(VFI_LOG_ERR, "%s: Failed to copy %s#%llx to %s#%llx:%lx. Error is %d",
+			__func__, a->src->name, a->soff, a->dst->name, a->doff, a->extent, err);
 		return VFI_RESULT(err);
 	}
-	else
-		VFI_DEBUG (MY_DEBUG, "%s: Map is OK\n", __func__);
 	return 1;
 }
 
+int map_copy_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd)
+{
+	/* map_copy://dst#o:e=src#o[?threads(n)] */
+	struct copy_args a;
+	int err;
+
+	if (err = map_copy_args(dev, *cmd, &a))
+		return VFI_RESULT(err);
+	return map_copy_run(dev, ah, &a, NULL);
+}
+
 int vfi_initialize_api(struct vfi_dev *dev)
 {
 	int ret = 0;
@@ -899,6 +2521,9 @@ int vfi_initialize_api(struct vfi_dev *dev)
 	if (!ret) ret = vfi_register_pre_cmd(dev,"mmap_create",mmap_create_pre_cmd);
 	if (!ret) ret = vfi_register_pre_cmd(dev,"smb_create",smb_create_pre_cmd);
 	if (!ret) ret = vfi_register_pre_cmd(dev,"map_install",map_install_pre_cmd);
+	if (!ret) ret = vfi_register_pre_cmd(dev,"map_uninstall",map_uninstall_pre_cmd);
+	if (!ret) ret = vfi_register_pre_cmd(dev,"map_arena",map_arena_pre_cmd);
+	if (!ret) ret = vfi_register_pre_cmd(dev,"map_slice",map_slice_pre_cmd);
 	if (!ret) ret = vfi_register_pre_cmd(dev,"event_find",event_find_pre_cmd);
 	if (!ret) ret = vfi_register_pre_cmd(dev,"location_find",wait_pre_cmd);
 	if (!ret) ret = vfi_register_pre_cmd(dev,"sync_wait",wait_pre_cmd);
@@ -907,6 +2532,18 @@ int vfi_initialize_api(struct vfi_dev *dev)
 	if (!ret) ret = vfi_register_pre_cmd(dev,"quite",quit_pre_cmd);
 	if (!ret) ret = vfi_register_pre_cmd(dev,"map_init",map_init_pre_cmd);
 	if (!ret) ret = vfi_register_pre_cmd(dev,"map_check",map_check_pre_cmd);
+	if (!ret) ret = vfi_register_pre_cmd(dev,"map_checksum",map_checksum_pre_cmd);
+	if (!ret) ret = vfi_register_pre_cmd(dev,"map_copy",map_copy_pre_cmd);
+
+	if (!ret) ret = vfi_bind_pre_cmd(dev,"location_find",wait_bind,wait_run);
+	if (!ret) ret = vfi_bind_pre_cmd(dev,"sync_wait",wait_bind,wait_run);
+	if (!ret) ret = vfi_bind_pre_cmd(dev,"pipe",pipe_bind,pipe_run);
+	if (!ret) ret = vfi_bind_pre_cmd(dev,"unix_pipe",pipe_bind,pipe_run);
+	if (!ret) ret = vfi_bind_pre_cmd(dev,"map_init",map_pattern_bind,map_init_run);
+	if (!ret) ret = vfi_bind_pre_cmd(dev,"map_check",map_pattern_bind,map_check_run);
+	if (!ret) ret = vfi_bind_pre_cmd(dev,"map_checksum",map_checksum_bind,map_checksum_run);
+	if (!ret) ret = vfi_bind_pre_cmd(dev,"map_copy",map_copy_bind,map_copy_run);
+	if (!ret) vfi_set_pipe_free(dev,free_pipe);
 
 	return ret;
 }
@@ -917,6 +2554,9 @@ void vfi_clear_api(struct vfi_dev *dev)
 	vfi_unregister_pre_cmd(dev,"mmap_create");
 	vfi_unregister_pre_cmd(dev,"smb_create");
 	vfi_unregister_pre_cmd(dev,"map_install");
+	vfi_unregister_pre_cmd(dev,"map_uninstall");
+	vfi_unregister_pre_cmd(dev,"map_arena");
+	vfi_unregister_pre_cmd(dev,"map_slice");
 	vfi_unregister_pre_cmd(dev,"event_find");
 	vfi_unregister_pre_cmd(dev,"location_find");
 	vfi_unregister_pre_cmd(dev,"sync_wait");
@@ -925,5 +2565,7 @@ void vfi_clear_api(struct vfi_dev *dev)
 	vfi_unregister_pre_cmd(dev,"quite");
 	vfi_unregister_pre_cmd(dev,"map_init");
 	vfi_unregister_pre_cmd(dev,"map_check");
+	vfi_unregister_pre_cmd(dev,"map_checksum");
+	vfi_unregister_pre_cmd(dev,"map_copy");
 }
 
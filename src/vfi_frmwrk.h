@@ -4,6 +4,7 @@
 
 struct vfi_dev;
 struct vfi_async_handle;
+struct vfi_map;
 /**
  * bind_create_pre_cmd
  * @dev: API handle
@@ -29,6 +30,11 @@ extern int bind_create_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah,
  *
  * This command parses the mmap_create command in @cmd for map names
  * and registers them with the API handle @dev's map name list. 
+ * With a buffers(n) option the map is divided into n buffers, see
+ * vfi_map_set_buffers().
+ * The prefault and lock options take the map's page faults when it is
+ * mapped, see vfi_pin_map(), and stream(chunk) maps it twice over as a
+ * ring, see vfi_map_set_stream().
  *
  * Returns: 0 to indicate that the @cmd should be run by the driver.
  */
@@ -42,6 +48,11 @@ extern int mmap_create_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah,
  *
  * This command parses the smb_create command in @cmd for map names
  * and registers them with the API handle @dev's map name list. 
+ * With a buffers(n) option the map is divided into n buffers, see
+ * vfi_map_set_buffers().
+ * The prefault and lock options take the map's page faults when it is
+ * mapped, see vfi_pin_map(), and stream(chunk) maps it twice over as a
+ * ring, see vfi_map_set_stream().
  *
  * Returns: 0 to indicate that the @cmd should be run by the driver.
  */
@@ -69,25 +80,282 @@ extern int event_find_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah,
  *
  * This command parses any command in @cmd for a wait option 
  * and sets up a closure to loop on errors from the driver command if found.
+ * Retries back off exponentially from microseconds up to wait_cap(us),
+ * 100ms by default, and give up with -ETIMEDOUT after wait_timeout(ms)
+ * if one is given. See vfi_set_notify_fd() to end each delay early and
+ * vfi_get_wait_stats() for how long the waits took.
  *
  * Returns: 0 to indicate that the @cmd should be run by the driver.
  */
 extern int wait_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd);
 
+/**
+ * VFI_PIPE_MAX_STAGES:
+ *
+ * The most functions a fused pipe may chain, see #vfi_pipe.
+ */
+#define VFI_PIPE_MAX_STAGES 8
+
+/**
+ * vfi_pipe
+ * @f: the pipe function, so that the pipe is itself a closure
+ * @dev: the API handle the names were resolved on
+ * @nin: number of input maps
+ * @nout: number of output maps
+ * @nevents: number of events, the first is the head of the chain
+ * @nheads: number of head events, one per buffer or chunk of the input maps
+ * @in: the input maps
+ * @out: the output maps
+ * @events: the event names
+ * @heads: the head event of each buffer or chunk, the first is also @events[0]
+ * @maps: the names of the input then the output maps
+ * @func: the function name
+ * @gen: vfi_dev_gen() when the names were last resolved
+ * @chained: set once the events have been chained at the driver
+ * @parallel: threads to run the tiles of the maps on, from a parallel(n) option
+ * @tile: bytes per tile, from a tile(hex) option, 0 to split the maps by @parallel
+ * @nstages: number of functions, more than one for a fused pipe
+ * @stages: the functions, the first is also @f
+ * @stage_names: the names of the functions
+ * @stage_ns: time spent in each function since the pipe was compiled
+ * @pool: threads for the tiles when the pipe runs as a closure, started on first use
+ *
+ * A compiled pipe:// or unix_pipe:// command. The pipe function is
+ * invoked as a closure with the #vfi_pipe as its first argument and
+ * finds its maps in @in and @out. The pipe is a single allocation.
+ *
+ * A pipe with @parallel above 1 or a @tile size is tiled: every map is
+ * cut at the same offsets into tiles of @tile bytes, rounded up to a
+ * cache line, and the function is invoked once per tile with a copy of
+ * the pipe whose @in and @out are views of that tile. The tiles are
+ * shared between @parallel threads and all of them complete before
+ * the invocation does, so the function must only touch its own tile
+ * and be safe to run on several threads at once. Multi buffered and
+ * ring maps cannot be tiled.
+ *
+ * A fused pipe names several functions joined by '+', as in
+ * pipe://in<scale+clip+pack(evt)>out, and is always tiled. Each tile
+ * goes through every function in turn, all on the same views, before
+ * the next tile is started, so what one function leaves in the maps
+ * for the next is still in cache. Without a tile(hex) option the tiles
+ * of all the maps together take half the L2 cache.
+ *
+ * A transfer always fills the range its bind covers, so a pipe whose
+ * input maps are multi buffered names a head event per buffer, each
+ * bound to its buffer at offset i * buffer_extent, joined by '|' in
+ * place of the first event, as in pipe://in<f(b0.loc|b1.loc,evt)>out.
+ * Likewise a ring input map needs a head event per chunk, bound at
+ * offset i * chunk. Each is chained to the second event, if any.
+ */
+struct vfi_pipe {
+	void *f;
+	struct vfi_dev *dev;
+	int nin;
+	int nout;
+	int nevents;
+	int nheads;
+	struct vfi_map **in;
+	struct vfi_map **out;
+	char **events;
+	char **heads;
+	char **maps;
+	char *func;
+	unsigned long gen;
+	int chained;
+	int parallel;
+	long tile;
+	int nstages;
+	void **stages;
+	char **stage_names;
+	long long *stage_ns;
+	struct vfi_pool *pool;
+	void *b[];
+};
+
+/**
+ * vfi_compile_pipe
+ * @dev: API handle
+ * @cmd: a pipe:// or unix_pipe:// command
+ * @pipe: returns the compiled pipe
+ *
+ * Parses @cmd, which may have any number of maps and events, and
+ * resolves and checks the function, maps and events it names. The
+ * parallel(n) and tile(hex) options of @cmd tile the pipe, see #vfi_pipe.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_compile_pipe(struct vfi_dev *dev, char *cmd, struct vfi_pipe **pipe);
+
+/**
+ * vfi_start_pipe
+ * @pipe: a compiled pipe
+ * @cmd: returns the command to start the pipe, to be freed by the caller
+ *
+ * Readies @pipe to run, as often as wanted. Names are resolved again
+ * only if registrations on the device have changed since, and the
+ * events are chained at the driver only the first time. @cmd is the
+ * event_start command for the head of the chain; the reply to it
+ * should be passed to @pipe as a closure. The first time, the replies
+ * to the chain commands are waited for on their handles, so another
+ * thread must be dispatching replies; pipe_pre_cmd() chains without
+ * waiting.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_start_pipe(struct vfi_pipe *pipe, char **cmd);
+
+/**
+ * vfi_free_pipe
+ * @pipe: a compiled pipe, not one registered with vfi_register_pipe()
+ *
+ * Frees @pipe and stops the threads it keeps for its tiles.
+ * vfi_initialize_api() has vfi_close() free registered pipes with it.
+ */
+extern void vfi_free_pipe(struct vfi_pipe *pipe);
+
+/**
+ * vfi_pool:
+ *
+ * An opaque pool of worker threads, see vfi_pool_create().
+ */
+struct vfi_pool;
+
+/**
+ * vfi_pool_create
+ * @pool: returns the new pool
+ * @threads: number of worker threads
+ *
+ * Starts a pool of @threads workers which run submitted jobs in the
+ * order given. A pool can serve any number of pipe runs.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_pool_create(struct vfi_pool **pool, int threads);
+
+/**
+ * vfi_pool_threads
+ * @pool: a pool
+ *
+ * Returns: the number of worker threads in @pool.
+ */
+extern int vfi_pool_threads(struct vfi_pool *pool);
+
+/**
+ * vfi_pool_submit
+ * @pool: a pool
+ * @fn: the job
+ * @arg: passed to @fn
+ *
+ * Queues @fn(@arg) to be run by the next free worker.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_pool_submit(struct vfi_pool *pool, void (*fn)(void *), void *arg);
+
+/**
+ * vfi_pool_destroy
+ * @pool: a pool
+ *
+ * Runs any jobs still queued, then stops the workers and frees @pool.
+ */
+extern void vfi_pool_destroy(struct vfi_pool *pool);
+
+/**
+ * vfi_pipe_stats
+ * @iterations: pipe function runs completed
+ * @max_computing: most function runs at once
+ * @compute_ns: time spent in the pipe function over all runs
+ * @elapsed_ns: time for the whole of vfi_run_pipe()
+ * @minor_faults: page faults without I/O taken by the process meanwhile
+ * @major_faults: page faults with I/O taken by the process meanwhile
+ * @stages: number of functions of the pipe
+ * @stage_ns: time spent in each function, over all tiles and threads
+ *
+ * How a pipe ran, see vfi_run_pipe(). When transfers and computation
+ * overlap @compute_ns approaches, or with several workers exceeds,
+ * @elapsed_ns. Faults left once the maps are prefaulted and locked,
+ * see vfi_pin_map(), are jitter still in the steady state. Comparing
+ * @stage_ns of a fused pipe with the same functions run as separate
+ * pipes shows what keeping the tiles in cache saves.
+ */
+struct vfi_pipe_stats {
+	long iterations;
+	int max_computing;
+	long long compute_ns;
+	long long elapsed_ns;
+	long minor_faults;
+	long major_faults;
+	int stages;
+	long long stage_ns[VFI_PIPE_MAX_STAGES];
+};
+
+/**
+ * vfi_run_pipe
+ * @pipe: a compiled pipe
+ * @pool: workers to run the pipe function, or %NULL to run it here
+ * @depth: iterations to keep in flight
+ * @iterations: iterations to run, 0 until the pipe function stops it
+ * @stats: filled in with how the run went, may be %NULL
+ *
+ * Runs @pipe: its events are started, and each time the chain
+ * completes the pipe function is run on the maps and the events are
+ * started again. Up to @depth iterations are in flight at once so
+ * transfers for some overlap computation on others; with more than
+ * one the maps should be multi buffered or the function must
+ * otherwise cope. The pipe function returns %NULL to stop the pipe,
+ * though iterations already in flight still complete, and with a
+ * pool must be safe to run on several threads at once.
+ *
+ * Multi buffered input maps, see vfi_map_set_buffers(), rotate with
+ * the iterations and @depth is limited to their number of buffers.
+ * Each start claims a free buffer and starts the head event of that
+ * buffer, see #vfi_pipe, and its completion makes the buffer ready.
+ * A pipe without a head event for every buffer is refused. The pipe
+ * function takes the oldest ready buffer with vfi_map_get_ready() and
+ * must give it back with vfi_map_put_free() for the pipe to keep
+ * running.
+ *
+ * Ring maps, see vfi_map_set_stream(), gain a chunk at each completion
+ * and @depth is limited to the chunks they hold. Each start fills the
+ * next chunk through its head event, see #vfi_pipe, and chunks are
+ * published in the order they were started, so one is never handed on
+ * before its own transfer is done. A pipe without a head event for
+ * every chunk is refused. An iteration starts only when every ring
+ * has room for its chunk; the pipe function takes data with
+ * vfi_stream_claim() and must give it back with vfi_stream_release()
+ * or the pipe stops with -ENOBUFS.
+ *
+ * A tiled pipe, see #vfi_pipe, runs its tiles on threads of its own
+ * rather than on @pool, started once for the whole run.
+ *
+ * The runtime reads its replies from the device itself, so no other
+ * thread may be dispatching replies on it meanwhile.
+ *
+ * Returns: 0 on success, otherwise the first error.
+ */
+extern int vfi_run_pipe(struct vfi_pipe *pipe, struct vfi_pool *pool, int depth,
+			long iterations, struct vfi_pipe_stats *stats);
+
 /**
  * pipe_pre_cmd
  * @dev: API handle
  * @ah: async handle in use for this thread
  * @cmd: IO parameter, bind command on input
  *
- * This command parses the pipe command in @cmd for event names, map names and function
- * and sets up a closure in the #vfi_async_handle @ah to execute the
- * named function. The pipe command in @cmd is replaced with an
+ * This command compiles the pipe command in @cmd, or finds it
+ * compiled already, see vfi_compile_pipe(), and sets up a closure in
+ * the #vfi_async_handle @ah to execute the named function. The pipe command in @cmd is replaced with an
  * event_start command for the head of the event chain, or lone event,
  * named in the pipe command and the closure will return true to keep
  * the pipeline in source_thread() running. The closure will terminate
  * the pipeline if errors occur or if it detects that quit/abort etc.,
- * have been called.
+ * have been called. With parallel(n) and tile(hex) options the function
+ * runs once per tile of the maps on n threads, see #vfi_pipe, and the
+ * closure returns only when every tile is done. Functions joined by '+'
+ * are fused and run one after another on each tile. Until the events
+ * are chained @cmd is each event_chain in turn instead, the closure
+ * rewriting it and asking with vfi_retry_async_handle() for it to be
+ * sent again, and then the event_start.
  *
  * Returns: 0 to indicate that the @cmd should be run by the driver.
  */
@@ -99,9 +367,9 @@ extern int pipe_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char *
  * @ah: async handle in use for this thread
  * @cmd: IO parameter, bind command on input
  *
- * This command parses the pipe command in @cmd for event names, map names and function
- * and sets up a closure in the #vfi_async_handle @ah to execute the
- * named function. The pipe command in @cmd is replaced with an
+ * This command compiles the pipe command in @cmd, or finds it
+ * compiled already, see vfi_compile_pipe(), and sets up a closure in
+ * the #vfi_async_handle @ah to execute the named function. The pipe command in @cmd is replaced with an
  * event_start command for the head of the event chain, or lone event,
  * named in the pipe command and the closure will return true to keep
  * the pipeline in source_thread() running. The closure will terminate
@@ -125,6 +393,193 @@ extern int unix_pipe_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, c
  */
 extern int quit_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd);
 
+/**
+ * VFI_PATTERN_VALUE:
+ *
+ * Every 64 bit word holds the value given.
+ */
+#define VFI_PATTERN_VALUE 0
+/**
+ * VFI_PATTERN_COUNTING:
+ *
+ * Word n of the region holds n + 1.
+ */
+#define VFI_PATTERN_COUNTING 1
+/**
+ * VFI_PATTERN_LFSR:
+ *
+ * Pseudo random words from a 64 bit LFSR. The LFSR is reseeded from
+ * the value given, the seed, at every 4KiB of the region.
+ */
+#define VFI_PATTERN_LFSR 2
+/**
+ * VFI_PATTERN_WALKING_ONES:
+ *
+ * Word n of the region has just bit n % 64 set.
+ */
+#define VFI_PATTERN_WALKING_ONES 3
+/**
+ * VFI_PATTERN_ADDRESS:
+ *
+ * Each word holds its own byte offset in the map.
+ */
+#define VFI_PATTERN_ADDRESS 4
+
+/**
+ * vfi_pattern_type
+ * @name: "counting", "lfsr", "walking_ones" or "address"
+ *
+ * Returns: the VFI_PATTERN_ type for @name or -EINVAL.
+ */
+extern int vfi_pattern_type(const char *name);
+
+/**
+ * vfi_check_stats
+ * @mismatches: number of words which did not match
+ * @first_bad: byte offset in the map of the first of them, or -1
+ * @last_bad: byte offset in the map of the last of them, or -1
+ *
+ * The result of vfi_check_map().
+ */
+struct vfi_check_stats {
+	long long mismatches;
+	long long first_bad;
+	long long last_bad;
+};
+
+/**
+ * vfi_fill_map
+ * @map: the map
+ * @offset: byte offset into @map
+ * @extent: bytes to fill
+ * @pattern: one of the VFI_PATTERN_ types
+ * @val: the value for %VFI_PATTERN_VALUE, the seed for %VFI_PATTERN_LFSR
+ * @threads: threads to use, 0 to pick by @extent and the CPUs online
+ *
+ * Fills @extent bytes of @map at @offset with @pattern. The pattern
+ * is laid out in 64 bit words from @offset, host byte order, and a
+ * last partial word gets the low order bytes of its pattern word.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_fill_map(struct vfi_map *map, long long offset, long extent, int pattern,
+			unsigned long long val, int threads);
+
+/**
+ * vfi_check_map
+ * @map: the map
+ * @offset: byte offset into @map
+ * @extent: bytes to check
+ * @pattern: one of the VFI_PATTERN_ types
+ * @val: the value for %VFI_PATTERN_VALUE, the seed for %VFI_PATTERN_LFSR
+ * @threads: threads to use, 0 to pick by @extent and the CPUs online
+ * @stats: filled in with the mismatches found, may be %NULL
+ *
+ * Checks @extent bytes of @map at @offset hold @pattern as laid out
+ * by vfi_fill_map(). The whole extent is checked, every mismatching
+ * word is counted.
+ *
+ * Returns: 0 if the map holds the pattern, -EBADMSG if it does not,
+ * otherwise error.
+ */
+extern int vfi_check_map(struct vfi_map *map, long long offset, long extent, int pattern,
+			 unsigned long long val, int threads, struct vfi_check_stats *stats);
+
+/**
+ * VFI_CHECKSUM_CRC32C:
+ *
+ * CRC32C, the Castagnoli CRC, as used by iSCSI and SCTP. Computed with
+ * the SSE4.2 crc32 instruction where the CPU has it.
+ */
+#define VFI_CHECKSUM_CRC32C 1
+/**
+ * VFI_CHECKSUM_XXH64:
+ *
+ * XXH64 with seed 0 for regions of up to 1MiB. A larger region is
+ * hashed as 1MiB chunks and its digest is the XXH64 of the chunk
+ * digests, in order, so the chunks can be hashed in parallel.
+ */
+#define VFI_CHECKSUM_XXH64 2
+
+/**
+ * vfi_checksum_type
+ * @name: "crc32c" or "xxh64"
+ *
+ * Returns: the VFI_CHECKSUM_ algorithm for @name or -EINVAL.
+ */
+extern int vfi_checksum_type(const char *name);
+
+/**
+ * vfi_checksum_map
+ * @map: the map
+ * @offset: byte offset into @map
+ * @extent: bytes to checksum
+ * @algo: one of the VFI_CHECKSUM_ algorithms
+ * @threads: threads to use, 0 to pick by @extent and the CPUs online
+ * @digest: returns the checksum
+ *
+ * Checksums @extent bytes of @map at @offset. The digest does not
+ * depend on @threads. It is also kept in @map, see #vfi_map, so the
+ * maps at each end of a transfer can be compared afterwards.
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_checksum_map(struct vfi_map *map, long long offset, long extent, int algo,
+			    int threads, unsigned long long *digest);
+
+/**
+ * VFI_COPY_MEMCPY:
+ *
+ * A copy small enough to stay in the last level cache, done with memcpy().
+ * So is one on a single thread big enough for memcpy() to use
+ * non-temporal stores itself, as glibc's does from 3/4 of the cache.
+ */
+#define VFI_COPY_MEMCPY 0
+/**
+ * VFI_COPY_STREAM:
+ *
+ * A copy larger than about half the last level cache, done on one thread
+ * with non-temporal stores so it does not evict the rest of the cache.
+ */
+#define VFI_COPY_STREAM 1
+/**
+ * VFI_COPY_PARALLEL:
+ *
+ * A streaming copy split between threads, no more than the CPUs online
+ * and, unless the threads are given, each with at least 8MiB.
+ */
+#define VFI_COPY_PARALLEL 2
+
+/**
+ * vfi_copy_strategy
+ * @extent: bytes to copy
+ * @threads: as for vfi_copy_map()
+ *
+ * Only the CPUs online count as threads, so on one CPU a copy is never
+ * %VFI_COPY_PARALLEL.
+ *
+ * Returns: the VFI_COPY_ strategy vfi_copy_map() uses for @extent bytes.
+ */
+extern int vfi_copy_strategy(long extent, int threads);
+
+/**
+ * vfi_copy_map
+ * @dst: the map copied to
+ * @doff: byte offset into @dst
+ * @src: the map copied from
+ * @soff: byte offset into @src
+ * @extent: bytes to copy
+ * @threads: threads to use, no more than the CPUs online, 0 to pick by @extent
+ *
+ * Copies @extent bytes of @src at @soff to @dst at @doff, choosing
+ * the strategy by size, see vfi_copy_strategy(). Overlapping regions,
+ * of one map or of slices sharing memory, are copied with memmove().
+ *
+ * Returns: 0 on success, otherwise error.
+ */
+extern int vfi_copy_map(struct vfi_map *dst, long long doff, struct vfi_map *src, long long soff,
+			long extent, int threads);
+
 /**
  * map_init_pre_cmd
  * @dev: API handle
@@ -135,8 +590,10 @@ extern int quit_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char *
  * map_init://map.location#offset:extent?value(x) and the 
  * map_init://map.location#offset:extent?pattern(type) command in @cmd
  * for a map name and an init value or init pattern. The offset and extent of the
- * named map is then initialized with the value x or the pattern type. 
- * The supported pattern type is "counting".
+ * named map, both in bytes, is then initialized with the value x or the pattern
+ * type, see vfi_fill_map(). The supported pattern types are "counting", "lfsr",
+ * "walking_ones" and "address"; with a pattern value(x) seeds "lfsr". A
+ * threads(n) option sets the number of threads used.
  *
  * Returns: 1 to indicate that the @cmd should not be run by the driver or a negative
  * value if an error occurred.
@@ -152,15 +609,52 @@ extern int map_init_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, ch
  * This command parses the
  * map_check://map.location#offset:extent?value(x) and the
  * map_check://map.location#offset:extent?pattern(type) command in @cmd
- * for a map name and an init value or init patter. The offset and extent of the
- * named map is checked for the value x or the pattern type. The supported pattern 
- * type is "counting".
+ * for a map name and an init value or init pattern. The offset and extent of the
+ * named map is checked for the value x or the pattern type, as for
+ * map_init_pre_cmd(), see vfi_check_map(). The number of mismatches and the
+ * offsets of the first and last are logged.
  *
  * Returns: 1 to indicate that the @cmd should not be run by the driver or a negative
  * value if an error occurred. If the check fails then -EBADMSG is returned.
  */
 extern int map_check_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd);
 
+/**
+ * map_checksum_pre_cmd
+ * @dev: API handle
+ * @ah: async handle in use for this thread
+ * @cmd: IO parameter, bind command on input
+ *
+ * This command parses the
+ * map_checksum://map.location#offset:extent?algo(crc32c|xxh64) command in @cmd
+ * and checksums the offset and extent of the named map, see vfi_checksum_map().
+ * The algorithm defaults to crc32c, and a threads(n) option sets the number of
+ * threads used. The digest is logged and kept with the map. With a match(name)
+ * option the digest is compared with the one last taken of the map name, with
+ * the same algorithm, typically the source of a transfer into this map.
+ *
+ * Returns: 1 to indicate that the @cmd should not be run by the driver or a negative
+ * value if an error occurred. If the digests do not match then -EBADMSG is returned.
+ */
+extern int map_checksum_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd);
+
+/**
+ * map_copy_pre_cmd
+ * @dev: API handle
+ * @ah: async handle in use for this thread
+ * @cmd: IO parameter, bind command on input
+ *
+ * This command parses the
+ * map_copy://dst.location#offset:extent=src.location#offset command in @cmd
+ * and copies extent bytes of the src map at its offset to the dst map at its
+ * offset, see vfi_copy_map(). Both offsets default to 0 and the extent to the
+ * rest of the dst map. A threads(n) option sets the number of threads used.
+ *
+ * Returns: 1 to indicate that the @cmd should not be run by the driver or a negative
+ * value if an error occurred.
+ */
+extern int map_copy_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd);
+
 /**
  * map_install_pre_cmd
  * @dev: API handle
@@ -169,14 +663,71 @@ extern int map_check_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, c
  *
  * This command parses the
  * map_install://name:extent command in @cmd
- * for a map name and extent and malloc's an area of memory of extent size and then
- * registers it as a map under name.
+ * for a map name and extent and allocates an area of memory of extent size and then
+ * registers it as a map under name. With a buffers(n) option the extent is
+ * divided into n buffers, see vfi_map_set_buffers(). The hugepage, align(x),
+ * where x is hex like the extent, and numa(node) options control how the memory
+ * is allocated, see vfi_alloc_map_mem(), and the prefault and lock options
+ * take its page faults up front, see vfi_pin_map(). The stream(chunk) option
+ * makes the map a ring, see vfi_alloc_ring_mem() and vfi_map_set_stream(),
+ * with chunk hex like the extent.
+ * A map with none of these options comes from the device's arena if it has
+ * one with room, see map_arena_pre_cmd().
  *
  * Returns: 1 to indicate that the @cmd should not be run by the driver or a negative
- * value if an error occurred. If the check fails then -EBADMSG is returned.
+ * value if an error occurred.
  */
 extern int map_install_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd);
 
+/**
+ * map_slice_pre_cmd
+ * @dev: API handle
+ * @ah: async handle in use for this thread
+ * @cmd: IO parameter, bind command on input
+ *
+ * This command parses the map_slice://parent#offset:extent?map_name(name)
+ * command in @cmd and registers name as a slice of the map parent, see
+ * vfi_map_slice(). The offset defaults to 0 and the extent to the rest of
+ * the parent. Slices are freed with map_uninstall_pre_cmd().
+ *
+ * Returns: 1 to indicate that the @cmd should not be run by the driver or a negative
+ * value if an error occurred.
+ */
+extern int map_slice_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd);
+
+/**
+ * map_arena_pre_cmd
+ * @dev: API handle
+ * @ah: async handle in use for this thread
+ * @cmd: IO parameter, bind command on input
+ *
+ * This command parses the map_arena://:size command in @cmd and gives @dev an
+ * arena of size bytes, hex like an extent, from which later small maps are
+ * installed, see vfi_arena_create(). The maps(n) option sets the most maps the
+ * arena holds and the hugepage, prefault and lock options apply to the whole
+ * arena as for map_install_pre_cmd().
+ *
+ * Returns: 1 to indicate that the @cmd should not be run by the driver or a negative
+ * value if an error occurred.
+ */
+extern int map_arena_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd);
+
+/**
+ * map_uninstall_pre_cmd
+ * @dev: API handle
+ * @ah: async handle in use for this thread
+ * @cmd: IO parameter, bind command on input
+ *
+ * This command parses the map_uninstall://name command in @cmd, unregisters
+ * the named map and frees it, and its memory however it was allocated, see
+ * vfi_free_map(). A map with slices is refused with -EBUSY; uninstall the
+ * slices first.
+ *
+ * Returns: 1 to indicate that the @cmd should not be run by the driver or a negative
+ * value if an error occurred.
+ */
+extern int map_uninstall_pre_cmd(struct vfi_dev *dev, struct vfi_async_handle *ah, char **cmd);
+
 /**
  * vfi_initialize_api
  * @dev: API handle
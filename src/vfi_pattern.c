@@ -0,0 +1,313 @@
+#include <vfi_api.h>
+#include <vfi_frmwrk.h>
+#include <vfi_log.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define MY_ERROR VFI_DBG_DEFAULT
+#define MY_DEBUG (VFI_DBG_EVERYONE | VFI_DBG_EVERYTHING | VFI_LOG_DEBUG)
+
+/*
+ * Fill and verify of map contents with test patterns. Every pattern
+ * is a function of the position of a 64 bit word, so any part of a
+ * map can be done on its own and large extents are split between
+ * threads. Expected words are generated a block at a time into a
+ * buffer which stays in L1; a fill copies the block out and a check
+ * compares against it with the widest vectors the CPU has, counting
+ * every mismatch rather than stopping at the first.
+ */
+#define BLOCK_WORDS 512		/* 4KiB, also the LFSR reseed interval */
+#define THREAD_MIN (8 << 20)	/* bytes worth a thread of their own */
+#define THREAD_MAX 16
+
+typedef unsigned long long u64;
+
+static const struct {
+	char *name;
+	int type;
+} patterns[] = {
+	{ "counting", VFI_PATTERN_COUNTING },
+	{ "lfsr", VFI_PATTERN_LFSR },
+	{ "walking_ones", VFI_PATTERN_WALKING_ONES },
+	{ "address", VFI_PATTERN_ADDRESS },
+};
+
+int vfi_pattern_type(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(patterns)/sizeof(patterns[0]); i++)
+		if (!strcmp(name, patterns[i].name))
+			return patterns[i].type;
+	return VFI_RESULT(-EINVAL);
+}
+
+struct pattern_job {
+	char *mem;		/* the word at offset 0 of the region */
+	long long base;		/* byte offset of the region in the map */
+	u64 words;		/* whole words in this job */
+	u64 first;		/* index of the job's first word in the region */
+	int tail;		/* bytes after the last whole word */
+	int type;
+	u64 val;
+	int check;
+	struct vfi_check_stats stats;
+};
+
+/* Galois LFSR, x^64 + x^63 + x^61 + x^60 + 1 */
+static inline u64 lfsr_step(u64 s)
+{
+	return (s >> 1) ^ (-(s & 1) & 0xd800000000000000ULL);
+}
+
+static inline u64 lfsr_seed(u64 seed, u64 block)
+{
+	u64 s = seed ^ (block * 0x9e3779b97f4a7c15ULL);
+	return s ? s : 1;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static void gen_linear_avx2(u64 *out, int n, u64 start, u64 step)
+{
+	__m256i v = _mm256_set_epi64x(start + 3 * step, start + 2 * step, start + step, start);
+	__m256i inc = _mm256_set1_epi64x(4 * step);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		_mm256_store_si256((__m256i *)(out + i), v);
+		v = _mm256_add_epi64(v, inc);
+	}
+	for (; i < n; i++)
+		out[i] = start + i * step;
+}
+#endif
+
+static void gen_linear(u64 *out, int n, u64 start, u64 step)
+{
+	int i;
+
+#ifdef HAVE_X86
+	if (__builtin_cpu_supports("avx2")) {
+		gen_linear_avx2(out, n, start, step);
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		out[i] = start + i * step;
+}
+
+/* Expected words @j to @j + @n - 1 of the region; @j is block aligned. */
+static void gen_block(struct pattern_job *job, u64 j, u64 *out, int n)
+{
+	u64 s;
+	int i;
+
+	switch (job->type) {
+	case VFI_PATTERN_COUNTING:
+		gen_linear(out, n, j + 1, 1);
+		break;
+	case VFI_PATTERN_ADDRESS:
+		gen_linear(out, n, job->base + 8 * j, 8);
+		break;
+	case VFI_PATTERN_WALKING_ONES:
+		for (i = 0; i < n; i++)
+			out[i] = 1ULL << ((j + i) & 63);
+		break;
+	case VFI_PATTERN_LFSR:
+		s = lfsr_seed(job->val, j / BLOCK_WORDS);
+		for (i = 0; i < n; i++) {
+			out[i] = s;
+			s = lfsr_step(s);
+		}
+		break;
+	default:
+		for (i = 0; i < n; i++)
+			out[i] = job->val;
+		break;
+	}
+}
+
+static inline void note_bad(struct vfi_check_stats *st, long long off)
+{
+	if (st->mismatches++ == 0)
+		st->first_bad = off;
+	st->last_bad = off;
+}
+
+static void cmp_scalar(struct pattern_job *job, const char *mem, const u64 *exp,
+		       int from, int n, long long off)
+{
+	u64 w;
+	int i;
+
+	for (i = from; i < n; i++) {
+		memcpy(&w, mem + 8 * i, 8);
+		if (w != exp[i])
+			note_bad(&job->stats, off + 8 * i);
+	}
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static void cmp_avx2(struct pattern_job *job, const char *mem, const u64 *exp,
+		     int n, long long off)
+{
+	__m256i a, b;
+	int i, m;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm256_loadu_si256((const __m256i *)(mem + 8 * i));
+		b = _mm256_load_si256((const __m256i *)(exp + i));
+		m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, b)));
+		if (m != 0xf)
+			cmp_scalar(job, mem, exp, i, i + 4, off);
+	}
+	cmp_scalar(job, mem, exp, i, n, off);
+}
+
+static void cmp_sse2(struct pattern_job *job, const char *mem, const u64 *exp,
+		     int n, long long off)
+{
+	__m128i a, b;
+	int i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		a = _mm_loadu_si128((const __m128i *)(mem + 8 * i));
+		b = _mm_load_si128((const __m128i *)(exp + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) != 0xffff)
+			cmp_scalar(job, mem, exp, i, i + 2, off);
+	}
+	cmp_scalar(job, mem, exp, i, n, off);
+}
+#endif
+
+static void cmp_block(struct pattern_job *job, const char *mem, const u64 *exp,
+		      int n, long long off)
+{
+#ifdef HAVE_X86
+	if (__builtin_cpu_supports("avx2"))
+		cmp_avx2(job, mem, exp, n, off);
+	else if (__builtin_cpu_supports("sse2"))
+		cmp_sse2(job, mem, exp, n, off);
+	else
+#endif
+		cmp_scalar(job, mem, exp, 0, n, off);
+}
+
+static void *pattern_thread(void *arg)
+{
+	struct pattern_job *job = arg;
+	u64 exp[BLOCK_WORDS] __attribute__((aligned(32)));
+	u64 j, end = job->first + job->words;
+	char *mem;
+	int n;
+
+	for (j = job->first; j < end; j += n) {
+		n = end - j < BLOCK_WORDS ? end - j : BLOCK_WORDS;
+		mem = job->mem + 8 * j;
+		gen_block(job, j, exp, n);
+		if (job->check)
+			cmp_block(job, mem, exp, n, job->base + 8 * j);
+		else
+			memcpy(mem, exp, 8 * n);
+	}
+
+	/* The low bytes of one more word. */
+	if (job->tail) {
+		mem = job->mem + 8 * end;
+		gen_block(job, end - end % BLOCK_WORDS, exp, end % BLOCK_WORDS + 1);
+		n = end % BLOCK_WORDS;
+		if (!job->check)
+			memcpy(mem, &exp[n], job->tail);
+		else if (memcmp(mem, &exp[n], job->tail))
+			note_bad(&job->stats, job->base + 8 * end);
+	}
+	return NULL;
+}
+
+static int run_pattern(struct vfi_map *map, long long offset, long extent, int type,
+		       unsigned long long val, int threads, int check,
+		       struct vfi_check_stats *stats)
+{
+	struct pattern_job job[THREAD_MAX];
+	pthread_t tid[THREAD_MAX];
+	u64 words = extent / 8;
+	u64 blocks = (words + BLOCK_WORDS - 1) / BLOCK_WORDS;
+	u64 per;
+	int i, n, started, err = 0;
+
+	if (offset < 0 || extent < 0 || map->extent < offset + extent)
+		return VFI_RESULT(-EINVAL);
+
+	if (threads <= 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads > extent / THREAD_MIN)
+			threads = extent / THREAD_MIN;
+	}
+	if (threads > THREAD_MAX)
+		threads = THREAD_MAX;
+	if (threads > blocks)
+		threads = blocks;
+	if (threads < 1)
+		threads = 1;
+
+	/* whole blocks to each thread so the LFSR reseeds line up */
+	per = (blocks + threads - 1) / threads * BLOCK_WORDS;
+	for (n = 0; n < threads && (n == 0 || n * per < words); n++) {
+		memset(&job[n], 0, sizeof(job[n]));
+		job[n].mem = (char *)map->mem + offset;
+		job[n].base = offset;
+		job[n].first = n * per;
+		job[n].words = words - job[n].first < per ? words - job[n].first : per;
+		job[n].type = type;
+		job[n].val = val;
+		job[n].check = check;
+		job[n].stats.first_bad = -1;
+		job[n].stats.last_bad = -1;
+	}
+	job[n-1].tail = extent % 8;
+
+	for (started = 1; started < n; started++)
+		if (pthread_create(&tid[started], NULL, pattern_thread, &job[started]))
+			break;
+	/* anything we could not hand off is done here */
+	for (i = started; i < n; i++)
+		pattern_thread(&job[i]);
+	pattern_thread(&job[0]);
+	for (i = 1; i < started; i++)
+		pthread_join(tid[i], NULL);
+
+	if (stats) {
+		memset(stats, 0, sizeof(*stats));
+		stats->first_bad = -1;
+		stats->last_bad = -1;
+		for (i = 0; i < n; i++) {
+			if (job[i].stats.mismatches == 0)
+				continue;
+			if (stats->mismatches == 0)
+				stats->first_bad = job[i].stats.first_bad;
+			stats->last_bad = job[i].stats.last_bad;
+			stats->mismatches += job[i].stats.mismatches;
+		}
+	}
+	for (i = 0; i < n; i++)
+		if (job[i].stats.mismatches)
+			err = -EBADMSG;
+	return err;
+}
+
+int vfi_fill_map(struct vfi_map *map, long long offset, long extent, int pattern,
+		 unsigned long long val, int threads)
+{
+	return VFI_RESULT(run_pattern(map, offset, extent, pattern, val, threads, 0, NULL));
+}
+
+int vfi_check_map(struct vfi_map *map, long long offset, long extent, int pattern,
+		  unsigned long long val, int threads, struct vfi_check_stats *stats)
+{
+	return run_pattern(map, offset, extent, pattern, val, threads, 1, stats);
+}
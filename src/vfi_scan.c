@@ -0,0 +1,264 @@
+#include <vfi_api.h>
+#include <vfi_log.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VFI_SCAN_X86
+#include <immintrin.h>
+#endif
+
+#define MY_ERROR VFI_DBG_DEFAULT
+#define MY_DEBUG (VFI_DBG_EVERYONE | VFI_DBG_EVERYTHING | VFI_LOG_DEBUG)
+
+#define BITS_PER_LONG ((int)(8 * sizeof(unsigned long)))
+
+/*
+ * RIL delimiters. Anything which terminates a name, location, offset,
+ * extent or option in cmd://name.location#offset:extent?opt(val),opt
+ * and the xfer/dest=src form of the ternary ops.
+ */
+static const unsigned char delim_class[256] = {
+	[':'] = 1, ['/'] = 1, ['?'] = 1, ['('] = 1, [')'] = 1,
+	[','] = 1, ['#'] = 1, ['.'] = 1, ['='] = 1,
+};
+
+/* Or @n bits of @mask into the bitmap starting at string position @pos. */
+static inline void set_bits(unsigned long *bits, int pos, unsigned long mask, int n)
+{
+	int w = pos / BITS_PER_LONG;
+	int s = pos % BITS_PER_LONG;
+
+	if (n < BITS_PER_LONG)
+		mask &= (1UL << n) - 1;
+	if (mask == 0)
+		return;
+	bits[w] |= mask << s;
+	if (s && (s + n) > BITS_PER_LONG)
+		bits[w+1] |= mask >> (BITS_PER_LONG - s);
+}
+
+/*
+ * Grow the bitmap when the string is longer than the inline buffer
+ * allows. We only get here once per scan and only for strings longer
+ * than anything the driver will return.
+ */
+static int grow_bits(struct vfi_delims *d, const char *str, int done)
+{
+	int len = done + strlen(str + done);
+	int nwords = len / BITS_PER_LONG + 3;
+	unsigned long *bits = calloc(nwords, sizeof(unsigned long));
+
+	if (bits == NULL)
+		return VFI_RESULT(-ENOMEM);
+
+	memcpy(bits, d->bits, d->nwords * sizeof(unsigned long));
+	if (d->bits != d->b)
+		free(d->bits);
+	d->bits = bits;
+	d->nwords = nwords;
+	return 0;
+}
+
+static int scan_scalar(struct vfi_delims *d, const char *str)
+{
+	const unsigned char *p = (const unsigned char *)str;
+	int pos;
+
+	for (pos = 0; p[pos]; pos++) {
+		if ((pos / BITS_PER_LONG) >= d->nwords - 1)
+			if (grow_bits(d, str, pos))
+				return VFI_RESULT(-ENOMEM);
+		if (delim_class[p[pos]])
+			d->bits[pos / BITS_PER_LONG] |= 1UL << (pos % BITS_PER_LONG);
+	}
+	return pos;
+}
+
+#ifdef VFI_SCAN_X86
+/*
+ * The vector scanners use aligned loads so that reading past the
+ * terminating NUL can never cross into an unmapped page. The first
+ * block is aligned down and the bytes before @str are shifted off the
+ * masks. The same over-read is why the address sanitizer is told to
+ * look the other way.
+ */
+#define VFI_SCAN_ATTR __attribute__((no_sanitize_address))
+
+static inline unsigned int sse2_delims(__m128i v)
+{
+	__m128i m;
+	m = _mm_cmpeq_epi8(v, _mm_set1_epi8(':'));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('(')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(')')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('=')));
+	return _mm_movemask_epi8(m);
+}
+
+VFI_SCAN_ATTR
+static int scan_sse2(struct vfi_delims *d, const char *str)
+{
+	const char *p = (const char *)((unsigned long)str & ~15UL);
+	int skip = str - p;
+	int pos = -skip;
+
+	for (;;) {
+		__m128i v = _mm_load_si128((const __m128i *)p);
+		unsigned int zero = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) >> skip;
+		unsigned int mask = sse2_delims(v) >> skip;
+		int n = 16 - skip;
+
+		if ((pos + skip + 16) / BITS_PER_LONG >= d->nwords - 1)
+			if (grow_bits(d, str, pos + skip))
+				return VFI_RESULT(-ENOMEM);
+		if (zero) {
+			n = __builtin_ctz(zero);
+			set_bits(d->bits, pos + skip, mask, n);
+			return pos + skip + n;
+		}
+		set_bits(d->bits, pos + skip, mask, n);
+		pos += 16;
+		p += 16;
+		skip = 0;
+	}
+}
+
+VFI_SCAN_ATTR __attribute__((target("avx2")))
+static int scan_avx2(struct vfi_delims *d, const char *str)
+{
+	const char *p = (const char *)((unsigned long)str & ~31UL);
+	int skip = str - p;
+	int pos = -skip;
+
+	for (;;) {
+		__m256i v = _mm256_load_si256((const __m256i *)p);
+		__m256i m;
+		unsigned int zero, mask;
+		int n = 32 - skip;
+
+		m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(':'));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('(')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(')')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('=')));
+		mask = (unsigned int)_mm256_movemask_epi8(m) >> skip;
+		zero = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256())) >> skip;
+
+		if ((pos + skip + 32) / BITS_PER_LONG >= d->nwords - 1)
+			if (grow_bits(d, str, pos + skip))
+				return VFI_RESULT(-ENOMEM);
+		if (zero) {
+			n = __builtin_ctz(zero);
+			set_bits(d->bits, pos + skip, mask, n);
+			return pos + skip + n;
+		}
+		set_bits(d->bits, pos + skip, mask, n);
+		pos += 32;
+		p += 32;
+		skip = 0;
+	}
+}
+#endif
+
+static int scan_resolve(struct vfi_delims *d, const char *str);
+
+static int (*scan_impl)(struct vfi_delims *, const char *) = scan_resolve;
+
+/*
+ * First call picks the best scanner the CPU supports. The race on
+ * scan_impl is benign, every thread picks the same answer.
+ */
+static int scan_resolve(struct vfi_delims *d, const char *str)
+{
+	vfi_select_scan(VFI_SCAN_AUTO);
+	return scan_impl(d, str);
+}
+
+int vfi_select_scan(int impl)
+{
+#ifdef VFI_SCAN_X86
+	__builtin_cpu_init();
+	if (impl == VFI_SCAN_AUTO)
+		impl = __builtin_cpu_supports("avx2") ? VFI_SCAN_AVX2 :
+			__builtin_cpu_supports("sse2") ? VFI_SCAN_SSE2 : VFI_SCAN_SCALAR;
+
+	switch (impl) {
+	case VFI_SCAN_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return VFI_RESULT(-EINVAL);
+		scan_impl = scan_avx2;
+		return impl;
+	case VFI_SCAN_SSE2:
+		if (!__builtin_cpu_supports("sse2"))
+			return VFI_RESULT(-EINVAL);
+		scan_impl = scan_sse2;
+		return impl;
+	}
+#else
+	if (impl == VFI_SCAN_AUTO)
+		impl = VFI_SCAN_SCALAR;
+#endif
+	if (impl != VFI_SCAN_SCALAR)
+		return VFI_RESULT(-EINVAL);
+	scan_impl = scan_scalar;
+	return impl;
+}
+
+int vfi_scan_delims(struct vfi_delims *d, const char *str)
+{
+	int len;
+
+	d->str = str;
+	d->bits = d->b;
+	d->nwords = VFI_SCAN_WORDS;
+	memset(d->b, 0, sizeof(d->b));
+
+	len = scan_impl(d, str);
+	if (len < 0) {
+		vfi_release_delims(d);
+		return VFI_RESULT(len);
+	}
+	d->len = len;
+	return len;
+}
+
+void vfi_release_delims(struct vfi_delims *d)
+{
+	if (d->bits != d->b)
+		free(d->bits);
+	d->bits = d->b;
+	d->nwords = VFI_SCAN_WORDS;
+}
+
+int vfi_next_delim(struct vfi_delims *d, int pos, const char *set)
+{
+	int w;
+	unsigned long word;
+
+	if (pos >= d->len)
+		return d->len;
+
+	w = pos / BITS_PER_LONG;
+	word = d->bits[w] & (~0UL << (pos % BITS_PER_LONG));
+
+	for (;;) {
+		while (word) {
+			pos = w * BITS_PER_LONG + __builtin_ctzl(word);
+			if (pos >= d->len)
+				return d->len;
+			if (set == NULL || strchr(set, d->str[pos]))
+				return pos;
+			word &= word - 1;
+		}
+		if (++w * BITS_PER_LONG >= d->len)
+			return d->len;
+		word = d->bits[w];
+	}
+}
@@ -0,0 +1,537 @@
+#include <vfi_api.h>
+#include <vfi_log.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MY_ERROR VFI_DBG_DEFAULT
+#define MY_DEBUG (VFI_DBG_EVERYONE | VFI_DBG_EVERYTHING | VFI_LOG_DEBUG)
+
+/*
+ * An in-process command server. Local clients connect to a UNIX
+ * domain socket and write RIL lines. One event loop owns the device:
+ * each line goes through the pre commands and, if it is for the
+ * driver, is sent with a request tag of the server's own. Replies are
+ * matched back to the request by that tag, the pre command's closure
+ * is run, and the reply is returned to the client which asked, with
+ * the client's own request() tag, if it gave one, as the reply(). A
+ * closure may rewrite the request's command and ask for it again, as
+ * a pipe does for each event_chain before its event_start, so such a
+ * run of commands stays in the request table and the event loop
+ * never waits on a reply itself.
+ */
+
+#define SRV_LINE 4096
+#define SRV_HASH 256
+
+struct srv_client {
+	struct srv_client *next;
+	int fd;
+	int in_len;
+	char *out;		/* replies the socket would not yet take */
+	int out_len;
+	int out_size;
+	char in[SRV_LINE];
+};
+
+struct srv_req {
+	struct srv_req *next;
+	struct vfi_async_handle *ah;
+	struct srv_client *client;	/* NULL once the client has gone */
+	unsigned long long tag;
+	int has_tag;
+	char *cmd;		/* as sent, should the closure want a retry */
+};
+
+struct vfi_server {
+	struct vfi_dev *dev;
+	int fd;
+	char *path;
+	int nclients;
+	struct srv_client *clients;
+	struct pollfd *pfd;
+	int npfd;
+	struct srv_req *reqs[SRV_HASH];
+};
+
+static inline int req_hash(struct vfi_async_handle *ah)
+{
+	return ((unsigned long)ah >> 4) % SRV_HASH;
+}
+
+static struct srv_req *find_req(struct vfi_server *srv, struct vfi_async_handle *ah)
+{
+	struct srv_req **pp, *req;
+
+	for (pp = &srv->reqs[req_hash(ah)]; (req = *pp); pp = &req->next)
+		if (req->ah == ah) {
+			*pp = req->next;
+			return req;
+		}
+	return NULL;
+}
+
+/*
+ * Replace the request/reply tag of @cmd via its frame form, which
+ * lifts the tag out of wherever it is in the option lists. @old gets
+ * the tag found, if any. With @flags zero the tag is dropped.
+ */
+static int retag(const char *cmd, int len, struct vfi_cmd_buf *cb,
+		 unsigned long long *old, int *had, unsigned long long tag, int flags)
+{
+	union {
+		struct vfi_frame f;
+		char b[sizeof(struct vfi_frame) + SRV_LINE];
+	} frame;
+	int ret;
+
+	vfi_cmd_init(cb);
+	if ((ret = vfi_frame_encode(cmd, len, frame.b, sizeof(frame))) < 0)
+		return VFI_RESULT(ret);
+
+	if (had)
+		*had = (frame.f.flags & VFI_FRAME_TAG) != 0;
+	if (old)
+		*old = frame.f.tag;
+
+	frame.f.flags &= ~(VFI_FRAME_TAG | VFI_FRAME_REPLY);
+	frame.f.flags |= flags;
+	frame.f.tag = tag;
+
+	return vfi_frame_decode(frame.b, frame.f.len, cb);
+}
+
+static int client_write(struct srv_client *c, const char *buf, int len)
+{
+	int ret = 0;
+	char *p;
+
+	if (c->out_len == 0) {
+		ret = send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0 && errno != EAGAIN)
+			return VFI_RESULT(-errno);
+		if (ret < 0)
+			ret = 0;
+		if (ret == len)
+			return 0;
+	}
+
+	if (c->out_len + len - ret > c->out_size) {
+		int size = c->out_size ? c->out_size : SRV_LINE;
+		while (size < c->out_len + len - ret)
+			size *= 2;
+		p = realloc(c->out, size);
+		if (p == NULL)
+			return VFI_RESULT(-ENOMEM);
+		c->out = p;
+		c->out_size = size;
+	}
+	memcpy(c->out + c->out_len, buf + ret, len - ret);
+	c->out_len += len - ret;
+	return 0;
+}
+
+static int client_flush(struct srv_client *c)
+{
+	int ret;
+
+	ret = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (ret < 0)
+		return errno == EAGAIN ? 0 : VFI_RESULT(-errno);
+
+	memmove(c->out, c->out + ret, c->out_len - ret);
+	c->out_len -= ret;
+	return 0;
+}
+
+/* Reply to @c with @cb, tagged with the client's own tag if it gave one. */
+static int client_reply(struct srv_client *c, struct vfi_cmd_buf *cb,
+			unsigned long long tag, int has_tag)
+{
+	struct vfi_cmd_buf out;
+	int ret;
+
+	ret = retag(cb->p, cb->len, &out, NULL, NULL, tag,
+		    has_tag ? VFI_FRAME_TAG | VFI_FRAME_REPLY : 0);
+	if (!ret)
+		ret = vfi_cmd_lit(&out, "\n") ? -ENOMEM : client_write(c, out.p, out.len);
+	vfi_cmd_release(&out);
+	return VFI_RESULT(ret);
+}
+
+/* Answer a command which never reached the driver with its result. */
+static int client_status(struct srv_client *c, const char *cmd, int result,
+			 unsigned long long tag, int has_tag)
+{
+	struct vfi_cmd_buf cb;
+	int ret;
+
+	vfi_cmd_init(&cb);
+	if (vfi_cmd_from(&cb, cmd) || vfi_cmd_opt_dec(&cb, "result", result))
+		ret = -ENOMEM;
+	else
+		ret = client_reply(c, &cb, tag, has_tag);
+	vfi_cmd_release(&cb);
+	return VFI_RESULT(ret);
+}
+
+static void client_close(struct vfi_server *srv, struct srv_client *c)
+{
+	struct srv_client **pp;
+	struct srv_req *req;
+	int i;
+
+	for (pp = &srv->clients; *pp; pp = &(*pp)->next)
+		if (*pp == c) {
+			*pp = c->next;
+			break;
+		}
+
+	/* Replies still due to this client are dropped when they arrive. */
+	for (i = 0; i < SRV_HASH; i++)
+		for (req = srv->reqs[i]; req; req = req->next)
+			if (req->client == c)
+				req->client = NULL;
+
+	close(c->fd);
+	free(c->out);
+	free(c);
+	srv->nclients--;
+}
+
+static int send_req(struct vfi_server *srv, struct srv_req *req)
+{
+	struct vfi_cmd_buf cb;
+	int ret;
+
+	vfi_cmd_init(&cb);
+	if (vfi_cmd_from(&cb, req->cmd) || vfi_cmd_request(&cb, req->ah))
+		ret = -ENOMEM;
+	else if ((ret = vfi_invoke_cmd_buf(srv->dev, &cb)) > 0)
+		ret = 0;
+	else if (ret == 0)
+		ret = -EIO;
+	vfi_cmd_release(&cb);
+	if (ret == 0) {
+		req->next = srv->reqs[req_hash(req->ah)];
+		srv->reqs[req_hash(req->ah)] = req;
+	}
+	return ret;
+}
+
+static void free_req(struct srv_req *req)
+{
+	vfi_free_async_handle(req->ah);
+	free(req->cmd);
+	free(req);
+}
+
+static int handle_line(struct vfi_server *srv, struct srv_client *c, char *line, int len)
+{
+	struct vfi_async_handle *ah;
+	struct vfi_cmd_buf cb;
+	struct srv_req *req;
+	unsigned long long tag;
+	char *cmd = NULL;
+	int has_tag;
+	int ret;
+
+	if ((ret = retag(line, len, &cb, &tag, &has_tag, 0, 0))) {
+		vfi_cmd_release(&cb);
+		line[len] = '\0';
+		return client_status(c, line, ret, 0, 0);
+	}
+	cmd = vfi_cmd_dup(&cb);
+	vfi_cmd_release(&cb);
+
+	ah = vfi_alloc_async_handle(NULL);
+	req = calloc(1, sizeof(*req));
+	if (cmd == NULL || ah == NULL || req == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	req->ah = ah;
+	req->client = c;
+	req->tag = tag;
+	req->has_tag = has_tag;
+	req->cmd = cmd;
+
+	/*
+	 * The pre command is given the request's own pointer as a closure
+	 * may keep it to rewrite the command once the reply is in.
+	 */
+	ret = vfi_find_pre_cmd(srv->dev, ah, &req->cmd);
+	cmd = req->cmd;
+	if (ret) {
+		ret = client_status(c, cmd, ret > 0 ? 0 : ret, tag, has_tag);
+		goto done;
+	}
+
+	if ((ret = send_req(srv, req)))
+		goto fail;
+	return 0;
+
+fail:
+	vfi_log(VFI_LOG_ERR, "%s: Failed to issue %s. Error is %d", __func__,
+		cmd ? cmd : "command", ret);
+	ret = client_status(c, cmd ? cmd : "", ret, tag, has_tag);
+done:
+	free(req);
+	free(cmd);
+	if (ah)
+		vfi_free_async_handle(ah);
+	return VFI_RESULT(ret);
+}
+
+static int client_read(struct vfi_server *srv, struct srv_client *c)
+{
+	char *line, *nl, *end;
+	int ret;
+
+	ret = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+	if (ret < 0)
+		return errno == EAGAIN ? 0 : VFI_RESULT(-errno);
+	if (ret == 0)
+		return VFI_RESULT(-EPIPE);
+
+	c->in_len += ret;
+	end = c->in + c->in_len;
+	for (line = c->in; (nl = memchr(line, '\n', end - line)); line = nl + 1) {
+		char *p = line;
+		int len;
+
+		while (p < nl && (*p == ' ' || *p == '\t'))
+			p++;
+		len = nl - p;
+		if (len && p[len-1] == '\r')
+			len--;
+		p[len] = '\0';
+		if (len && *p != '#' && (ret = handle_line(srv, c, p, len)))
+			return VFI_RESULT(ret);
+	}
+
+	c->in_len = end - line;
+	if (c->in_len == sizeof(c->in))
+		return VFI_RESULT(-E2BIG);
+	memmove(c->in, line, c->in_len);
+	return 0;
+}
+
+/*
+ * A reply from the driver. Only tags we issued are looked up, so a
+ * stray reply can't be mistaken for a handle.
+ */
+static int handle_result(struct vfi_server *srv)
+{
+	struct vfi_async_handle *ah = NULL;
+	struct vfi_cmd_buf cb;
+	struct srv_req *req;
+	char *result = NULL;
+	void *e;
+	int ret;
+
+	ret = vfi_get_result(srv->dev, &result);
+	if (ret <= 0)
+		return VFI_RESULT(ret);
+
+	vfi_get_hex_arg(result, "reply", (long *)&ah);
+	req = ah ? find_req(srv, ah) : NULL;
+	if (req == NULL) {
+		vfi_log(VFI_LOG_ERR, "%s: Unmatched reply %s", __func__, result);
+		free(result);
+		return 0;
+	}
+
+	/*
+	 * The closure frees itself via the handle so put it back first.
+	 * One which marks the handle, such as a wait, wants the command
+	 * again.
+	 */
+	e = vfi_set_async_handle(ah, NULL);
+	vfi_set_async_handle(ah, e);
+	ret = 0;
+	if (e)
+		ret = (long)vfi_invoke_closure(e, srv->dev, ah, result);
+	if (e && vfi_clear_retry_async_handle(ah)) {
+		free(result);
+		if ((ret = send_req(srv, req)) == 0)
+			return 0;
+		vfi_log(VFI_LOG_ERR, "%s: Failed to retry %s. Error is %d",
+			__func__, req->cmd, ret);
+		if (req->client &&
+		    client_status(req->client, req->cmd, ret, req->tag, req->has_tag))
+			client_close(srv, req->client);
+		free_req(req);
+		return 0;
+	}
+
+	/* the driver did its part but the closure failed, say so */
+	if (req->client && ret < 0) {
+		if (client_status(req->client, req->cmd, ret, req->tag, req->has_tag))
+			client_close(srv, req->client);
+	}
+	else if (req->client) {
+		vfi_cmd_init(&cb);
+		vfi_cmd_from(&cb, result);
+		while (cb.len && cb.p[cb.len-1] == '\n')
+			cb.p[--cb.len] = '\0';
+		if (client_reply(req->client, &cb, req->tag, req->has_tag))
+			client_close(srv, req->client);
+		vfi_cmd_release(&cb);
+	}
+
+	free(result);
+	free_req(req);
+	return 0;
+}
+
+static int srv_accept(struct vfi_server *srv)
+{
+	struct srv_client *c;
+	int fd;
+
+	fd = accept(srv->fd, NULL, NULL);
+	if (fd < 0)
+		return errno == EAGAIN ? 0 : VFI_RESULT(-errno);
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		close(fd);
+		return VFI_RESULT(-ENOMEM);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c->fd = fd;
+	c->next = srv->clients;
+	srv->clients = c;
+	srv->nclients++;
+	return 0;
+}
+
+int vfi_server_open(struct vfi_dev *dev, struct vfi_server **srvp, char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct vfi_server *srv;
+	int ret;
+
+	*srvp = NULL;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return VFI_RESULT(-ENAMETOOLONG);
+	strcpy(addr.sun_path, path);
+
+	srv = calloc(1, sizeof(*srv));
+	if (srv == NULL)
+		return VFI_RESULT(-ENOMEM);
+	srv->dev = dev;
+	srv->path = strdup(path);
+
+	srv->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (srv->fd < 0 || srv->path == NULL) {
+		ret = srv->path ? -errno : -ENOMEM;
+		goto fail;
+	}
+
+	unlink(path);
+	if (bind(srv->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(srv->fd, 64)) {
+		ret = -errno;
+		goto fail;
+	}
+	fcntl(srv->fd, F_SETFL, fcntl(srv->fd, F_GETFL) | O_NONBLOCK);
+
+	*srvp = srv;
+	return 0;
+
+fail:
+	vfi_log(VFI_LOG_ERR, "%s: Failed to listen on %s. Error is %d", __func__, path, ret);
+	if (srv->fd >= 0)
+		close(srv->fd);
+	free(srv->path);
+	free(srv);
+	return VFI_RESULT(ret);
+}
+
+void vfi_server_close(struct vfi_server *srv)
+{
+	struct srv_req *req;
+	int i;
+
+	while (srv->clients)
+		client_close(srv, srv->clients);
+
+	for (i = 0; i < SRV_HASH; i++)
+		while ((req = srv->reqs[i])) {
+			srv->reqs[i] = req->next;
+			free_req(req);
+		}
+
+	close(srv->fd);
+	unlink(srv->path);
+	free(srv->path);
+	free(srv->pfd);
+	free(srv);
+}
+
+int vfi_server_clients(struct vfi_server *srv)
+{
+	return srv->nclients;
+}
+
+int vfi_server_poll(struct vfi_server *srv, int timeout)
+{
+	struct srv_client *c, *next;
+	struct pollfd *pfd;
+	int n, i, ret;
+
+	if (srv->npfd < srv->nclients + 2) {
+		n = (srv->nclients + 2) * 2;
+		pfd = realloc(srv->pfd, n * sizeof(*pfd));
+		if (pfd == NULL)
+			return VFI_RESULT(-ENOMEM);
+		srv->pfd = pfd;
+		srv->npfd = n;
+	}
+
+	pfd = srv->pfd;
+	pfd[0] = (struct pollfd) { srv->fd, POLLIN, 0 };
+	pfd[1] = (struct pollfd) { vfi_fileno(srv->dev), POLLIN, 0 };
+	for (n = 2, c = srv->clients; c; c = c->next, n++)
+		pfd[n] = (struct pollfd) { c->fd, POLLIN | (c->out_len ? POLLOUT : 0), 0 };
+
+	ret = poll(pfd, n, timeout);
+	if (ret <= 0)
+		return ret < 0 ? VFI_RESULT(-errno) : 0;
+
+	/* pfd[] follows the client list as it was before accepting */
+	for (i = 2, c = srv->clients; c; c = next, i++) {
+		next = c->next;
+		if (pfd[i].revents & POLLOUT)
+			ret = client_flush(c);
+		else
+			ret = 0;
+		if (!ret && (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+			ret = client_read(srv, c);
+		if (ret)
+			client_close(srv, c);
+	}
+
+	/* One reply per wakeup, the device stays readable while more are queued. */
+	if (pfd[1].revents & POLLIN)
+		handle_result(srv);
+
+	if (pfd[0].revents & POLLIN)
+		srv_accept(srv);
+
+	return 0;
+}
+
+int vfi_server_run(struct vfi_server *srv)
+{
+	int ret = 0;
+
+	while (!ret && !vfi_dev_done(srv->dev)) {
+		ret = vfi_server_poll(srv, -1);
+		if (ret == -EINTR)
+			ret = 0;
+	}
+	return VFI_RESULT(ret);
+}
@@ -0,0 +1,60 @@
+/*
+ * Checksums of maps. Both algorithms give their published check
+ * values, and a region over several threads' worth which is not a
+ * whole number of chunks has the same digest however many threads
+ * take it.
+ */
+#include <vfi_api.h>
+#include <vfi_frmwrk.h>
+#include <stdio.h>
+
+#define BIG ((24 << 20) + 12345)
+
+static int failures;
+
+static void expect(const char *what, int got, int want)
+{
+	if (got != want) {
+		printf("FAIL %s: %d, expected %d\n", what, got, want);
+		failures++;
+	}
+	else
+		printf("ok   %s\n", what);
+}
+
+int main(int argc, char **argv)
+{
+	static const int threads[] = { 2, 3, 7 };
+	unsigned long long one, many;
+	struct vfi_map *map;
+	int algo, i;
+	long j;
+
+	if (vfi_alloc_map(&map, "sum") || vfi_alloc_map_mem(map, BIG, 0, 0, -1)) {
+		printf("FAIL cannot allocate the map\n");
+		return 1;
+	}
+
+	memcpy(map->mem, "123456789", 9);
+	expect("crc32c check value", vfi_checksum_map(map, 0, 9, VFI_CHECKSUM_CRC32C, 1, &one), 0);
+	expect("crc32c of 123456789", one == 0xe3069283ULL, 1);
+	expect("crc32c digest kept", map->digest == one && map->digest_algo == VFI_CHECKSUM_CRC32C, 1);
+	expect("xxh64 of nothing", vfi_checksum_map(map, 0, 0, VFI_CHECKSUM_XXH64, 1, &one), 0);
+	expect("xxh64 empty value", one == 0xef46db3751d8e999ULL, 1);
+
+	for (j = 0; j < BIG; j++)
+		((unsigned char *)map->mem)[j] = j * 131 + (j >> 12);
+
+	for (algo = VFI_CHECKSUM_CRC32C; algo <= VFI_CHECKSUM_XXH64; algo++) {
+		expect("one thread", vfi_checksum_map(map, 1, BIG - 1, algo, 1, &one), 0);
+		for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+			expect("threads", vfi_checksum_map(map, 1, BIG - 1, algo, threads[i], &many), 0);
+			expect("same digest for threads", many == one, 1);
+		}
+		expect("threads picked", vfi_checksum_map(map, 1, BIG - 1, algo, 0, &many), 0);
+		expect("same digest picked", many == one, 1);
+	}
+
+	vfi_free_map(map);
+	return failures != 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Binary frames which are short, truncated or corrupt are refused by
+ * vfi_frame_decode() rather than decoded, and a good frame round trips
+ * to the text it was encoded from. A driver which answers the framing
+ * probe only after the open gave up on it leaves the device in text,
+ * and its late answer is not taken for the next command's reply.
+ */
+#include <vfi_api.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+static int failures;
+
+static void expect(const char *what, int got, int want)
+{
+	if (got != want) {
+		printf("FAIL %s: %d, expected %d\n", what, got, want);
+		failures++;
+	}
+	else
+		printf("ok   %s\n", what);
+}
+
+/* Answers the probe only once the next command is in, then that */
+static void *slow_driver(void *arg)
+{
+	int fd = (long)arg;
+	char buf[256];
+	long tag = 0;
+	int len;
+
+	if ((len = read(fd, buf, sizeof(buf) - 1)) <= 0)
+		return NULL;
+	buf[len] = '\0';
+	vfi_get_hex_arg(buf, "request", &tag);
+	if (read(fd, buf, sizeof(buf) - 1) <= 0)
+		return NULL;
+	len = sprintf(buf, "framing://binary?result(0),reply(%lx)\n", tag);
+	len = write(fd, buf, len);
+	len = write(fd, "event_find://e.loc?result(0)\n", 29);
+	return NULL;
+}
+
+static void late_probe(void)
+{
+	struct vfi_dev *dev;
+	pthread_t tid;
+	char *result = NULL;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) ||
+	    pthread_create(&tid, NULL, slow_driver, (void *)(long)sv[1])) {
+		expect("slow driver", 0, 1);
+		return;
+	}
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+
+	expect("open past a slow probe", vfi_open_fd(&dev, sv[0], 50, VFI_OPEN_BINARY), 0);
+	expect("left in text", vfi_dev_binary(dev), 0);
+	expect("command after a late probe", vfi_do_cmd(dev, &result, "event_find://e.loc\n") > 0, 1);
+	expect("its own reply", result && !strncmp(result, "event_find", 10), 1);
+	free(result);
+
+	pthread_join(tid, NULL);
+	vfi_close(dev);
+	close(sv[1]);
+}
+
+int main(int argc, char **argv)
+{
+	static char cmd[] = "event_start://evt1.loc.f?request(1234)";
+	union {
+		struct vfi_frame f;
+		char b[VFI_FRAME_MAX];
+	} frame;
+	struct vfi_cmd_buf cb;
+	int len;
+
+	vfi_cmd_init(&cb);
+	len = vfi_frame_encode(cmd, strlen(cmd), frame.b, sizeof(frame));
+	expect("encode", len > (int)sizeof(frame.f), 1);
+
+	expect("decode", vfi_frame_decode(frame.b, len, &cb), 0);
+	expect("round trip", strcmp(cb.p, cmd), 0);
+
+	expect("truncated buffer", vfi_frame_decode(frame.b, sizeof(frame.f) - 1, &cb), -EINVAL);
+	expect("length past buffer", vfi_frame_decode(frame.b, len - 1, &cb), -EINVAL);
+
+	frame.f.len = sizeof(frame.f) - 4;
+	expect("length short of header", vfi_frame_decode(frame.b, len, &cb), -EBADMSG);
+	frame.f.len = 0;
+	expect("zero length", vfi_frame_decode(frame.b, len, &cb), -EBADMSG);
+	frame.f.len = sizeof(frame.f);
+	expect("empty body", vfi_frame_decode(frame.b, len, &cb), 0);
+
+	frame.f.len = len;
+	frame.f.magic = 'e';
+	expect("bad magic", vfi_frame_decode(frame.b, len, &cb), -EINVAL);
+	frame.f.magic = VFI_FRAME_MAGIC;
+	frame.f.verb = 0xff;
+	expect("bad verb", vfi_frame_decode(frame.b, len, &cb), -EINVAL);
+
+	vfi_cmd_release(&cb);
+
+	late_probe();
+	return failures != 0;
+}
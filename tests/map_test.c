@@ -0,0 +1,63 @@
+/*
+ * Maps through the API alone. A parent with slices can be neither
+ * unregistered nor freed, since the slices point into its memory and
+ * at the parent itself; once the slices are gone it can be both. Huge
+ * page maps honour an alignment above the huge page size.
+ */
+#include <vfi_api.h>
+#include <stdio.h>
+#include "standin.h"
+
+static int failures;
+
+static void expect(const char *what, int got, int want)
+{
+	if (got != want) {
+		printf("FAIL %s: %d, expected %d\n", what, got, want);
+		failures++;
+	}
+	else
+		printf("ok   %s\n", what);
+}
+
+int main(int argc, char **argv)
+{
+	struct vfi_dev *dev;
+	struct vfi_map *frame, *tile, *map;
+
+	if (standin_open(&dev, 1000, 0) || vfi_initialize_api(dev)) {
+		printf("FAIL cannot open the stand in\n");
+		return 1;
+	}
+
+	expect("alloc frame", vfi_alloc_map(&frame, "frame"), 0);
+	expect("frame memory", vfi_alloc_map_mem(frame, 0x4000, 0, 0, -1), 0);
+	expect("register frame", vfi_register_map(dev, "frame", frame), 0);
+	expect("slice", vfi_map_slice(dev, frame, "tile", 0x1000, 0x1000), 0);
+	expect("slices", frame->slices, 1);
+
+	expect("unregister busy frame", vfi_unregister_map(dev, "frame", &map), -EBUSY);
+	expect("busy frame still found", vfi_find_map(dev, "frame", &map), 0);
+	vfi_free_map(frame);
+	expect("busy frame kept", frame->slices, 1);
+
+	expect("unregister tile", vfi_unregister_map(dev, "tile", &tile), 0);
+	vfi_free_map(tile);
+	expect("slices gone", frame->slices, 0);
+	expect("unregister frame", vfi_unregister_map(dev, "frame", &map), 0);
+	expect("unregistered frame", map == frame, 1);
+	vfi_free_map(frame);
+
+	/* huge page maps come back aligned however large the alignment */
+	expect("alloc huge", vfi_alloc_map(&map, "huge"), 0);
+	expect("huge memory", vfi_alloc_map_mem(map, 0x1000, VFI_MAP_HUGEPAGE, 0x10000, -1), 0);
+	expect("huge page aligned", (long)map->mem % 0x10000, 0);
+	vfi_free_map(map);
+	expect("alloc aligned huge", vfi_alloc_map(&map, "huge"), 0);
+	expect("aligned huge memory", vfi_alloc_map_mem(map, 0x1000, VFI_MAP_HUGEPAGE, 0x800000, -1), 0);
+	expect("huge aligned", (long)map->mem % 0x800000, 0);
+	vfi_free_map(map);
+
+	vfi_close(dev);
+	return failures != 0;
+}
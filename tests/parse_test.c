@@ -0,0 +1,102 @@
+/*
+ * Parsing of commands. Options are matched whole, never as part of a
+ * verb, a name, a value or another option. Numbers decode through the
+ * eight digit path and around it alike, stop at the first non digit
+ * wherever it falls, refuse a hex value too large for 64 bits and
+ * take LLONG_MIN both ways.
+ */
+#include <vfi_api.h>
+#include <stdio.h>
+#include <limits.h>
+
+static int failures;
+
+static void expect(const char *what, int got, int want)
+{
+	if (got != want) {
+		printf("FAIL %s: %d, expected %d\n", what, got, want);
+		failures++;
+	}
+	else
+		printf("ok   %s\n", what);
+}
+
+static void parse_dec(const char *what, const char *s, int want_n, long long want)
+{
+	long long val = -1;
+	int n = vfi_parse_dec(s, strlen(s), &val);
+
+	expect(what, n, want_n);
+	if (want_n)
+		expect(what, val == want, 1);
+}
+
+static void parse_hex(const char *what, const char *s, int want_n, unsigned long long want)
+{
+	unsigned long long val = 1;
+	int n = vfi_parse_hex(s, strlen(s), &val);
+
+	expect(what, n, want_n);
+	expect(what, val == want, 1);
+}
+
+int main(int argc, char **argv)
+{
+	char buf[32];
+	long long want;
+	int i;
+
+	expect("bare option", vfi_get_option("map_install://m#0:1000?lock", "lock"), 1);
+	expect("later option", vfi_get_option("map_install://m#0:1000?stream(400),lock", "lock"), 1);
+	expect("option with value", vfi_get_option("location_find://e.loc?wait(1)", "wait"), 1);
+	expect("part of an option", vfi_get_option("map_install://m#0:1000?unlock", "lock"), 0);
+	expect("prefix of an option", vfi_get_option("map_install://m#0:1000?locked", "lock"), 0);
+	expect("in a name", vfi_get_option("location_find://await.loc", "wait"), 0);
+	expect("in a value", vfi_get_option("map_install://m#0:1000?map_name(lock)", "lock"), 0);
+	expect("in the verb", vfi_get_option("sync_wait://e.loc", "wait"), 0);
+	expect("no options", vfi_get_option("sync_wait://e.loc", "lock"), 0);
+	expect("no string", vfi_get_option(NULL, "lock"), 0);
+
+	parse_dec("8 digits", "12345678", 8, 12345678);
+	parse_dec("16 digits", "1234567890123456", 16, 1234567890123456LL);
+	parse_dec("17 digits", "12345678901234567", 17, 12345678901234567LL);
+	parse_dec("leading zeros", "00000000000000042", 17, 42);
+	/* ':' is the character after '9', '/' the one before '0' */
+	for (i = 0, want = 0; i < 8; want = want * 10 + 8 - i, i++) {
+		strcpy(buf, "876543219");
+		buf[i] = ':';
+		parse_dec("colon in 8 digits", buf, i, want);
+		buf[i] = '/';
+		parse_dec("slash in 8 digits", buf, i, want);
+	}
+	/* the value up to the non digit */
+	strcpy(buf, "123456789");
+	buf[5] = 'a';
+	parse_dec("stops at the non digit", buf, 5, 12345);
+	parse_dec("sign only", "-", 0, 0);
+	parse_dec("plus only", "+", 0, 0);
+	parse_dec("sign and non digit", "-x", 0, 0);
+	parse_dec("negative 8 digits", "-12345678", 9, -12345678);
+	parse_dec("LLONG_MAX", "9223372036854775807", 19, LLONG_MAX);
+	parse_dec("LLONG_MIN", "-9223372036854775808", 20, LLONG_MIN);
+
+	parse_hex("16 hex digits", "ffffffffffffffff", 16, ~0ULL);
+	parse_hex("0x and 16 hex digits", "0xFEDCBA9876543210", 18, 0xfedcba9876543210ULL);
+	parse_hex("17 hex digits", "1ffffffffffffffff", 0, 0);
+	parse_hex("0x and 17 hex digits", "0x10000000000000000", 0, 0);
+	parse_hex("leading zero hex", "00000000000000000001", 20, 1);
+	parse_hex("0x alone", "0x", 1, 0);
+	parse_hex("0x and a non digit", "0xg", 1, 0);
+	parse_hex("no hex digits", "g", 0, 0);
+
+	expect("format LLONG_MIN", vfi_format_dec(buf, LLONG_MIN), 20);
+	expect("LLONG_MIN text", strcmp(buf, "-9223372036854775808"), 0);
+	expect("format LLONG_MAX", vfi_format_dec(buf, LLONG_MAX), 19);
+	expect("LLONG_MAX text", strcmp(buf, "9223372036854775807"), 0);
+	expect("format 0", vfi_format_dec(buf, 0), 1);
+	expect("0 text", strcmp(buf, "0"), 0);
+	expect("format -1", vfi_format_dec(buf, -1), 2);
+	expect("-1 text", strcmp(buf, "-1"), 0);
+
+	return failures != 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Fill and check of maps with each pattern, at an offset and extent
+ * which are not whole words. One corrupt byte, in a whole word or in
+ * the partial word at the end, is one mismatch at that word whichever
+ * thread checks it and however many there are.
+ */
+#include <vfi_api.h>
+#include <vfi_frmwrk.h>
+#include <stdio.h>
+
+#define OFFSET 13
+#define EXTENT ((3 << 20) + 1237)
+
+static int failures;
+
+static void expect(const char *what, int got, int want)
+{
+	if (got != want) {
+		printf("FAIL %s: %d, expected %d\n", what, got, want);
+		failures++;
+	}
+	else
+		printf("ok   %s\n", what);
+}
+
+int main(int argc, char **argv)
+{
+	static const int patterns[] = {
+		VFI_PATTERN_VALUE, VFI_PATTERN_COUNTING, VFI_PATTERN_LFSR,
+		VFI_PATTERN_WALKING_ONES, VFI_PATTERN_ADDRESS,
+	};
+	static const long bad[] = { 8 * 4097 + 3, EXTENT / 2 + 5, EXTENT - 2 };
+	static const int threads[] = { 1, 4 };
+	struct vfi_check_stats stats;
+	struct vfi_map *map;
+	char *c;
+	int i, j, k;
+
+	if (vfi_alloc_map(&map, "pattern") || vfi_alloc_map_mem(map, OFFSET + EXTENT + 8, 0, 0, -1)) {
+		printf("FAIL cannot allocate the map\n");
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++)
+		for (j = 0; j < sizeof(threads) / sizeof(threads[0]); j++) {
+			printf("pattern %d threads %d\n", patterns[i], threads[j]);
+			expect("fill", vfi_fill_map(map, OFFSET, EXTENT, patterns[i], 0x5a5a1234, threads[j]), 0);
+			expect("check", vfi_check_map(map, OFFSET, EXTENT, patterns[i], 0x5a5a1234, threads[j], &stats), 0);
+			expect("no mismatches", stats.mismatches == 0 && stats.first_bad == -1, 1);
+
+			for (k = 0; k < sizeof(bad) / sizeof(bad[0]); k++) {
+				c = (char *)map->mem + OFFSET + bad[k];
+				*c ^= 0x10;
+				expect("corrupt check", vfi_check_map(map, OFFSET, EXTENT, patterns[i], 0x5a5a1234,
+								      threads[j], &stats), -EBADMSG);
+				expect("one mismatch", stats.mismatches == 1, 1);
+				expect("first bad word", stats.first_bad == OFFSET + bad[k] / 8 * 8, 1);
+				expect("last bad word", stats.last_bad == stats.first_bad, 1);
+				*c ^= 0x10;
+			}
+		}
+
+	vfi_free_map(map);
+	return failures != 0;
+}
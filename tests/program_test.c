@@ -0,0 +1,75 @@
+/*
+ * Programs run against the stand in driver, reading their own replies.
+ * A pipe whose events are not chained yet has its links made through
+ * the runner's reply loop, once, rather than waiting on handles which
+ * nothing would answer, and its function runs at each start.
+ */
+#include <vfi_api.h>
+#include <vfi_frmwrk.h>
+#include <stdio.h>
+#include "standin.h"
+
+static int failures;
+static int calls;
+
+static void expect(const char *what, int got, int want)
+{
+	if (got != want) {
+		printf("FAIL %s: %d, expected %d\n", what, got, want);
+		failures++;
+	}
+	else
+		printf("ok   %s\n", what);
+}
+
+static void *count(void *e, struct vfi_dev *dev, struct vfi_async_handle *ah, char *result)
+{
+	calls++;
+	return (void *)1;
+}
+
+static int run(struct vfi_dev *dev, char *script, int depth)
+{
+	struct vfi_program *prog;
+	struct vfi_source *src;
+	FILE *f;
+	int ret;
+
+	f = fmemopen(script, strlen(script), "r");
+	if (f == NULL || vfi_setup_file(dev, &src, f))
+		return -ENOMEM;
+	if ((ret = vfi_compile_program(dev, src, &prog)) == 0) {
+		ret = vfi_run_program_parallel(prog, depth, VFI_RUN_DISPATCH);
+		vfi_free_program(prog);
+	}
+	vfi_teardown_file(src);
+	fclose(f);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static char chained[] = "pipe://count(e1.loc,e2.loc,e3.loc)\n"
+				"pipe://count(e1.loc,e2.loc,e3.loc)\n";
+	static char heads[] = "pipe://count(h1.loc|h2.loc,e2.loc)\n";
+	struct vfi_dev *dev;
+
+	if (standin_open(&dev, 1000, 0) || vfi_initialize_api(dev) ||
+	    vfi_register_func(dev, "count", count, -1, -1) ||
+	    vfi_register_event(dev, "e1.loc", "e1") || vfi_register_event(dev, "e2.loc", "e2") ||
+	    vfi_register_event(dev, "e3.loc", "e3") || vfi_register_event(dev, "h1.loc", "h1") ||
+	    vfi_register_event(dev, "h2.loc", "h2")) {
+		printf("FAIL cannot open the stand in\n");
+		return 1;
+	}
+
+	expect("chained pipe", run(dev, chained, 1), 0);
+	expect("chained pipe calls", calls, 2);
+	expect("chained pipe again", run(dev, chained, 4), 0);
+	expect("chained pipe again calls", calls, 4);
+	expect("pipe with two heads", run(dev, heads, 1), 0);
+	expect("pipe with two heads calls", calls, 5);
+
+	vfi_close(dev);
+	return failures != 0;
+}
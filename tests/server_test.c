@@ -0,0 +1,127 @@
+/*
+ * Commands through the command server to the stand in driver. The
+ * smb_create closure rewrites its request's command after the reply,
+ * long after the line was read, so it has to be given the request's
+ * own copy rather than anything on the stack. A closure which fails
+ * after the driver succeeded has its error answered instead. A pipe
+ * whose events are not chained yet is chained through the server's
+ * own requests rather than by waiting for replies nothing reads.
+ */
+#include <vfi_api.h>
+#include <vfi_frmwrk.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "standin.h"
+
+#define PATH "server_test.sock"
+
+static int failures;
+static int calls;
+
+static void expect(const char *what, int got, int want)
+{
+	if (got != want) {
+		printf("FAIL %s: %d, expected %d\n", what, got, want);
+		failures++;
+	}
+	else
+		printf("ok   %s\n", what);
+}
+
+static void *count(void *e, struct vfi_dev *dev, struct vfi_async_handle *ah, char *result)
+{
+	calls++;
+	return (void *)1;
+}
+
+/* Send one line and poll the server until its reply is back. */
+static int ask(struct vfi_server *srv, int fd, const char *line, char *reply, int size)
+{
+	int i, len;
+
+	if (write(fd, line, strlen(line)) != strlen(line))
+		return -errno;
+	for (i = 0; i < 1000; i++) {
+		if (vfi_server_poll(srv, 10))
+			return -EIO;
+		len = recv(fd, reply, size - 1, MSG_DONTWAIT);
+		if (len > 0) {
+			reply[len] = '\0';
+			return 0;
+		}
+	}
+	return -ETIMEDOUT;
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr = { AF_UNIX, PATH };
+	struct vfi_server *srv;
+	struct vfi_dev *dev;
+	struct vfi_map *map;
+	char reply[512];
+	int fd, i;
+
+	unlink(PATH);
+	if (standin_open(&dev, 1000, 0) || vfi_initialize_api(dev) ||
+	    vfi_register_func(dev, "count", count, -1, -1) ||
+	    vfi_register_event(dev, "e1.loc", "e1") || vfi_register_event(dev, "e2.loc", "e2") ||
+	    vfi_register_event(dev, "e3.loc", "e3") ||
+	    vfi_server_open(dev, &srv, PATH)) {
+		printf("FAIL cannot start the server\n");
+		return 1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	expect("connect", connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+
+	for (i = 0; i < 3; i++) {
+		expect("smb_create", ask(srv, fd, "smb_create://smb.loc.f#0:1000?map_name(m),request(7)\n",
+					 reply, sizeof(reply)), 0);
+		expect("smb_create result", strstr(reply, "result(0)") != NULL, 1);
+		expect("smb_create reply", strstr(reply, "reply(7)") != NULL, 1);
+	}
+
+	/* a map the closure cannot divide is not left registered */
+	expect("smb_create buffers", ask(srv, fd, "smb_create://smb.loc.f#0:1000?map_name(b),map_address(10000),buffers(3),request(9)\n",
+					 reply, sizeof(reply)), 0);
+	expect("smb_create buffers result", strstr(reply, "result(-22)") != NULL, 1);
+	expect("smb_create buffers reply", strstr(reply, "reply(9)") != NULL, 1);
+	expect("smb_create buffers map", vfi_find_map(dev, "b", &map) != 0, 1);
+
+	/* nor is one whose memory cannot be locked */
+	expect("smb_create lock", ask(srv, fd, "smb_create://smb.loc.f#0:1000?map_name(l),map_address(10000),lock,request(10)\n",
+				      reply, sizeof(reply)), 0);
+	expect("smb_create lock result", strstr(reply, "result(-12)") != NULL, 1);
+	expect("smb_create lock map", vfi_find_map(dev, "l", &map) != 0, 1);
+
+	/* a ring whose chunk does not divide it fails before the mmap_create */
+	expect("smb_create stream", ask(srv, fd, "smb_create://smb.loc.f#0:1000?map_name(r),stream(300),request(11)\n",
+					reply, sizeof(reply)), 0);
+	expect("smb_create stream result", strstr(reply, "result(-22)") != NULL, 1);
+	expect("smb_create stream map", vfi_find_map(dev, "r", &map) != 0, 1);
+
+	/* nor is a ring the device memory cannot be mapped for */
+	expect("mmap_create ring", ask(srv, fd, "mmap_create://smb.loc.f#0:1000?map_name(r),mmap_offset(0),stream(400),request(12)\n",
+				       reply, sizeof(reply)), 0);
+	expect("mmap_create ring result", strstr(reply, "result(-19)") != NULL, 1);
+	expect("mmap_create ring map", vfi_find_map(dev, "r", &map) != 0, 1);
+
+	expect("event_start", ask(srv, fd, "event_start://e.loc?request(8)\n", reply, sizeof(reply)), 0);
+	expect("event_start reply", strstr(reply, "reply(8)") != NULL, 1);
+
+	/* a pipe is chained by requests of the server's own, then started */
+	for (i = 0; i < 2; i++) {
+		expect("pipe", ask(srv, fd, "pipe://count(e1.loc,e2.loc,e3.loc)?request(13)\n", reply, sizeof(reply)), 0);
+		expect("pipe result", strstr(reply, "event_start://e1.loc") && strstr(reply, "result(0)"), 1);
+		expect("pipe reply", strstr(reply, "reply(13)") != NULL, 1);
+	}
+	expect("pipe calls", calls, 2);
+
+	close(fd);
+	vfi_server_close(srv);
+	vfi_close(dev);
+	unlink(PATH);
+	return failures != 0;
+}